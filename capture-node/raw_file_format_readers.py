@@ -1,11 +1,16 @@
 # Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
 
 import os
+import mmap
 import struct
 import cv2
 import numpy as np
 
 import lz4.block as lz4block
+try:
+    import zstandard # only for recordings made with the zstd codec
+except ImportError:
+    zstandard = None
 
 '''
  Example Usage:
@@ -189,31 +194,92 @@ class AvaSequenceFileReader():
             # float kG;
             # float kB;
             # char compression[4];
+            # unsigned int filters; // since version 5
             # unsigned long long index_start_offset; // offset un bytes from the start of the file where the index will start
 
-            header_format = 'BBBBiii4sfff4sQ'
+            header_format = 'BBBBiii4sfff4sIQ'
             header_size = struct.calcsize(header_format)
 
             # Read Header
             header_buffer = f.read(header_size)
-            magic,version,channels,self.bitcount,self.width,self.height,self.blacklevel,self.bayer,self.kR,self.kG,self.kB,compression,index_offset = struct.unpack(header_format, header_buffer)
+            magic,version,channels,self.bitcount,self.width,self.height,self.blacklevel,self.bayer,self.kR,self.kG,self.kB,compression,self.filters,index_offset = struct.unpack(header_format, header_buffer)
 
             self.bayer = self.bayer.decode("utf-8")
 
             if magic != 0xED:
                 raise Exception('Invalid Ava Sequence file (magic)')
-            if version != 1:
+            if version < 1 or version > 5:
                 raise Exception('Invalid Ava Sequence file (version)')
-            if compression.decode('utf-8')[:3] != 'LZ4':
+            if version < 5:
+                self.filters = 0
+            # LZ4H (LZ4-HC) has the same stream format as LZ4
+            self.compression = compression.rstrip(b'\0').decode('utf-8')
+            if self.compression in ('LZ4', 'LZ4H'):
+                self._decompress = lambda buf: lz4block.decompress(buf, uncompressed_size=self._img_data_size)
+            elif self.compression == 'ZSTD':
+                if zstandard is None:
+                    raise Exception('Ava Sequence file compressed with zstd, the zstandard module is needed')
+                dctx = zstandard.ZstdDecompressor()
+                self._decompress = lambda buf: dctx.decompress(buf, max_output_size=self._img_data_size)
+            elif self.compression == 'RAW':
+                self._decompress = lambda buf: buf
+            else:
                 raise Exception('Invalid Ava Sequence file (unknown compression)')
 
-            self._frame_count = (self.file_size - index_offset)//8
-            self.index_offset = index_offset
+            if version >= 3 and index_offset == 0:
+                raise Exception('Incomplete Ava Sequence file, still recording or interrupted (avaCapture --recover)')
+
+            # Since version 2 the frames can be striped over several segment files, listed after the header.
+            # They are looked for next to this file, then where they were recorded.
+            self.version = version
+            self._segment_filenames = [filename]
+            if version >= 2:
+                count, = struct.unpack('I', f.read(4))
+                for i in range(count):
+                    length, = struct.unpack('H', f.read(2))
+                    path = f.read(length).decode('utf-8')
+                    if i == 0:
+                        continue
+                    moved = os.path.join(os.path.dirname(filename), os.path.basename(path))
+                    if os.path.exists(moved):
+                        path = moved
+                    if not os.path.exists(path):
+                        raise Exception('Missing Ava Sequence segment %s' % os.path.basename(path))
+                    self._segment_filenames.append(path)
 
-            # Read Frame index
-            index_size = self.file_size - index_offset
-            f.seek(index_offset)
-            self._frame_indices = np.frombuffer(f.read(index_size), dtype=np.uint64)
+            self.index_offset = index_offset
+            self._timestamps = None
+
+            if version >= 4:
+                # Index header, the location of each slot, then the frame table: one entry per recorded frame
+                # (timestamp, slot, location, size, checksum), mapped from the file
+                f.seek(index_offset)
+                index_magic, entry_size, slot_count, table_count, reserved = struct.unpack('IIQQQ', f.read(32))
+                if index_magic != 0x49415641 or entry_size != 32:
+                    raise Exception('Invalid Ava Sequence file (index header)')
+                self._frame_count = slot_count
+                self._frame_indices = np.frombuffer(f.read(slot_count*8), dtype=np.uint64)
+
+                self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+                frame_entry = np.dtype([('ts', '<f8'), ('slot', '<u8'), ('location', '<u8'), ('size', '<u4'), ('checksum', '<u4')])
+                self._frame_table = np.frombuffer(self._mm, dtype=frame_entry, count=table_count, offset=index_offset + 32 + slot_count*8)
+                self._timestamps = self._frame_table['ts']
+            else:
+                self._frame_count = (self.file_size - index_offset)//8
+
+                # Read Frame index
+                index_size = self.file_size - index_offset
+                f.seek(index_offset)
+                self._frame_indices = np.frombuffer(f.read(index_size), dtype=np.uint64)
+
+            # Location of each frame: segment in the top 8 bits for striped files, offset below
+            if version >= 2:
+                self._frame_segments = (self._frame_indices >> np.uint64(56)).astype(np.int64)
+                self._frame_offsets = self._frame_indices & np.uint64((1 << 56) - 1)
+            else:
+                self._frame_segments = np.zeros(self._frame_indices.shape, dtype=np.int64)
+                self._frame_offsets = self._frame_indices
+            self._segment_ends = [index_offset] + [os.path.getsize(s) for s in self._segment_filenames[1:]]
 
             byteperpixel = 2 if self.bitcount > 8 else 1
             self._img_data_size = byteperpixel*self.width*self.height
@@ -224,35 +290,78 @@ class AvaSequenceFileReader():
     def frame_count(self):
         return self._frame_count
 
-    def _get_frame_offset_skip(self, frame_index, is_backward=True):
-        while frame_index < self._frame_count and not self._frame_indices[frame_index]:
+    def has_timestamps(self):
+        return self._timestamps is not None
+
+    def frame_timestamp(self, frame_index):
+        # Recording timestamp in seconds (version 4 files), None for a missing frame
+        i = np.searchsorted(self._frame_table['slot'], frame_index)
+        if i < len(self._frame_table) and self._frame_table['slot'][i] == frame_index:
+            return float(self._timestamps[i])
+        return None
+
+    def frame_at_time(self, ts):
+        # Index of the first frame recorded at or after ts (version 4 files), None if there is none
+        i = np.searchsorted(self._timestamps, ts)
+        if i >= len(self._frame_table):
+            return None
+        return int(self._frame_table['slot'][i])
+
+    def _get_frame_skip(self, frame_index, is_backward=True, segment=None):
+        while 0 <= frame_index < self._frame_count and (not self._frame_indices[frame_index] or
+                (segment is not None and self._frame_segments[frame_index] != segment)):
             frame_index = frame_index + (-1 if is_backward else 1)
         if frame_index < 0 or frame_index >= self._frame_count:
             return None
-        return int(self._frame_indices[frame_index])
+        return frame_index
 
     def _compute_frame_size(self, frame_index):
-        # Compute size of one frame, by looking at the index of the next frame (or the index if this is the last frame)
-        offset_of_next_frame = 0
-        if frame_index<self._frame_count-1:
-            offset_of_next_frame = self._get_frame_offset_skip(frame_index+1, is_backward=False)
-        if not offset_of_next_frame:
-            offset_of_next_frame = self.index_offset
-        return offset_of_next_frame - self._get_frame_offset_skip(frame_index)
+        # Compute size of one frame, by looking at the offset of the next frame in the same segment
+        # (or the end of the segment if this is its last frame)
+        segment = int(self._frame_segments[frame_index])
+        next_frame = self._get_frame_skip(frame_index+1, is_backward=False, segment=segment)
+        offset_of_next_frame = int(self._frame_offsets[next_frame]) if next_frame is not None else self._segment_ends[segment]
+        return offset_of_next_frame - int(self._frame_offsets[frame_index])
 
     def _read_frame(self, index):
 
-        # open .ava file if needed
+        # open .ava files if needed
         if not self._f:
-            self._f = open(self.filename, 'rb', 32*1024*1024)
+            self._f = [open(s, 'rb', 32*1024*1024) for s in self._segment_filenames]
 
         # Read one frame from .ava file
-        frame_offset = self._get_frame_offset_skip(index)
-        self._f.seek(frame_offset)
-        buf = self._f.read(self._compute_frame_size(index))
+        frame_index = self._get_frame_skip(index)
+        f = self._f[int(self._frame_segments[frame_index])]
+        f.seek(int(self._frame_offsets[frame_index]))
+        if self.version >= 3:
+            # Packet header: magic, size, slot, timestamp, checksum (zlib.crc32 of the packet), reserved
+            packet_magic, size, slot, ts, checksum, reserved = struct.unpack('IIQdII', f.read(32))
+            if packet_magic != 0x50415641:
+                raise Exception('Invalid Ava Sequence file (packet header)')
+            buf = f.read(size)
+        else:
+            buf = f.read(self._compute_frame_size(frame_index))
 
         return buf
 
+    def _unfilter(self, buffer):
+
+        # Undo the frame_filters applied by the writer (version 5 files), in reverse order
+        dtype = np.uint8 if self.bitcount==8 else np.uint16
+        w, h = self.width, self.height
+        data = np.frombuffer(buffer, np.uint8)
+        if self.filters & 4: # shuffle: all the low bytes, then all the high bytes
+            data = np.stack((data[:w*h], data[w*h:]), axis=-1).reshape(-1)
+        img = data.view(dtype)
+        if self.filters & 2: # zigzag coded delta along the rows, of the planes when they are separated
+            row = w//2 if self.filters & 1 else w
+            img = img.reshape(-1, row).copy()
+            img[:, 1:] = (img[:, 1:] >> 1) ^ (0 - (img[:, 1:] & 1)).astype(dtype)
+            img = np.cumsum(img, axis=1, dtype=dtype)
+        if self.filters & 1: # bayer planes: (row parity, column parity), each h/2 x w/2
+            img = img.reshape(2, 2, h//2, w//2).transpose(2, 0, 3, 1)
+        return img.reshape(h, w)
+
     def _read_one_frame_16bit_linear(self, frame_index, resize_max_side):
 
         if frame_index<0 or frame_index>=self._frame_count:
@@ -263,8 +372,11 @@ class AvaSequenceFileReader():
 
         compressed_buffer = self._read_frame(frame_index)
 
-        buffer = lz4block.decompress(compressed_buffer, uncompressed_size=self._img_data_size)
-        raw_img = np.fromstring(buffer, np.uint8 if self.bitcount==8 else np.uint16).reshape((self.height,self.width))
+        buffer = self._decompress(compressed_buffer)
+        if self.filters:
+            raw_img = self._unfilter(buffer)
+        else:
+            raw_img = np.fromstring(buffer, np.uint8 if self.bitcount==8 else np.uint16).reshape((self.height,self.width))
         return raw_processing_to_16bit_linear(raw_img, self.bayer, self.blacklevel, self.bitcount, self.kB, self.kG, self.kR, resize_max_side=resize_max_side)
 
     def frame_as_cv2_sRGB_8bit(self, frame_index, resize_max_side=None, rotation_angle=0):
@@ -0,0 +1,208 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <opencv2/imgproc.hpp>
+
+#include <cstring>
+#include <vector>
+
+// Layout of the .ava raw sequence files, shared by the writer and the reader.
+// File: header, compressed frames back to back (codec in the compression field of the header: LZ4, LZ4H, ZSTD, RAW), then the index until the end of the file.
+// Index: one unsigned long long file offset per frame slot at the recording framerate, 0 for frames that were not recorded.
+//
+// Striped recordings (version 2) spread the frames over segment files, one per drive. The first segment is the file
+// above, with a segment table between the header and the frames: an unsigned int count, then for each segment an
+// unsigned short length and the path of its file (empty for the first segment itself). The other segments start with
+// a copy of the header followed by their frames. The index entries of a striped recording are locations: the segment
+// in the top 8 bits, the offset in that segment below. The frames of a segment end at the next frame of the same
+// segment, at the index for the first segment, or at the end of the file for the others.
+//
+// Version 3 is what AvaVideoWriter writes: always a segment table (one segment when not striped), every frame is
+// preceded by an ava_packet_header, and the first segment has an ava_checkpoint_header every second or so, with the
+// index entries of the frames written since the previous checkpoint. The index entries are locations of the packet
+// headers. index_start_offset stays 0 until the recording is closed: a reader can follow a live recording through
+// the checkpoints, and a recording that was interrupted can be rebuilt from the packet headers (avaCapture --recover).
+//
+// Version 4 has the same records, the index that starts at index_start_offset is an ava_index_header, the locations
+// of the slots, then an ava_frame_entry per recorded frame in recording order: timestamps and sizes can be read
+// without the packets, and a frame can be found by time with a binary search.
+//
+// Version 5 has the same layout, the frames may be transformed by frame_filters before the codec: the filters field
+// of the header (0 in older files) says which ones, the reader undoes them after decompressing.
+
+struct ava_packet_header {
+	unsigned int magic; // ava_format::PACKET_MAGIC
+	unsigned int size; // compressed frame that follows
+	unsigned long long slot; // position of the frame in the index
+	double ts; // seconds
+	unsigned int checksum; // ava_format::crc32 of the compressed frame
+	unsigned int reserved;
+};
+
+struct ava_checkpoint_header {
+	unsigned int magic; // ava_format::CHECKPOINT_MAGIC
+	unsigned int count; // index entries that follow, for the slots first_slot..first_slot+count-1
+	unsigned long long first_slot;
+	unsigned long long previous; // offset of the previous checkpoint, 0 for the first one
+	unsigned int checksum; // ava_format::crc32 of the entries
+	unsigned int reserved;
+};
+
+struct ava_index_header {
+	unsigned int magic; // ava_format::INDEX_MAGIC
+	unsigned int entry_size; // sizeof(ava_frame_entry)
+	unsigned long long slot_count;
+	unsigned long long frame_count;
+	unsigned long long reserved;
+};
+
+struct ava_frame_entry {
+	double ts; // seconds, increasing
+	unsigned long long slot;
+	unsigned long long location; // of the packet header
+	unsigned int size; // compressed frame, after the packet header
+	unsigned int checksum;
+};
+
+struct ava_raw_info {
+	unsigned char magic; // 0xED
+	unsigned char version; // 1
+	unsigned char channels; // 1 or 3
+	unsigned char bitcount; // 8..16
+	unsigned int width;
+	unsigned int height;
+	unsigned int blacklevel;
+	unsigned char bayer0; // first row, first pixel
+	unsigned char bayer1; // first row, second pixel
+	unsigned char bayer2; // second row, first pixel
+	unsigned char bayer3; // second row, second pixel
+	float kR;
+	float kG;
+	float kB;
+
+	char compression[4];
+	unsigned int filters; // frame_filters::Filter flags, since version 5 (was padding)
+	unsigned long long index_start_offset; // offset un bytes from the start of the file where the index will start
+};
+
+namespace ava_format
+{
+	static const unsigned char MAGIC = 0xED;
+	static const unsigned char VERSION = 1;
+	static const unsigned char VERSION_STRIPED = 2;
+	static const unsigned char VERSION_FRAMED = 3;
+	static const unsigned char VERSION_FRAME_TABLE = 4;
+	static const unsigned char VERSION_FILTERS = 5;
+
+	static const unsigned int PACKET_MAGIC = 0x50415641; // "AVAP"
+	static const unsigned int CHECKPOINT_MAGIC = 0x43415641; // "AVAC"
+	static const unsigned int INDEX_MAGIC = 0x49415641; // "AVAI"
+
+	static const unsigned int MAX_SEGMENTS = 255;
+	static const int SEGMENT_SHIFT = 56;
+
+	inline unsigned long long make_location(unsigned int segment, unsigned long long offset)
+	{
+		return ((unsigned long long)segment << SEGMENT_SHIFT) | offset;
+	}
+	inline unsigned int location_segment(unsigned long long location)
+	{
+		return (unsigned int)(location >> SEGMENT_SHIFT);
+	}
+	inline unsigned long long location_offset(unsigned long long location)
+	{
+		return location & ((1ULL << SEGMENT_SHIFT) - 1);
+	}
+
+	// Upper bound of a compressed frame for all the codecs, to reject corrupted packet sizes
+	inline size_t max_packet_size(const ava_raw_info& info)
+	{
+		const size_t frame_size = (size_t)info.width * info.height * (info.bitcount > 8 ? 2 : 1);
+		return frame_size + frame_size / 128 + 1024;
+	}
+
+	// CRC-32 as in zlib (python: zlib.crc32), for the packets and the checkpoints
+	inline unsigned int crc32(const void * data, size_t size, unsigned int crc = 0)
+	{
+		struct table_t
+		{
+			unsigned int v[256];
+			table_t()
+			{
+				for (unsigned int i = 0; i < 256; i++)
+				{
+					unsigned int c = i;
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+					v[i] = c;
+				}
+			}
+		};
+		static const table_t table;
+
+		const unsigned char * p = (const unsigned char *)data;
+		crc = ~crc;
+		while (size--)
+			crc = table.v[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	// Index of a version 4 file in one block, from the frames in recording order
+	inline void build_index(const std::vector<ava_frame_entry>& frames, std::vector<unsigned char>& block)
+	{
+		ava_index_header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = INDEX_MAGIC;
+		header.entry_size = sizeof(ava_frame_entry);
+		header.slot_count = frames.empty() ? 0 : frames.back().slot + 1;
+		header.frame_count = frames.size();
+
+		const size_t locations_size = (size_t)header.slot_count * sizeof(unsigned long long);
+		block.assign(sizeof(header) + locations_size + frames.size() * sizeof(ava_frame_entry), 0);
+		memcpy(&block[0], &header, sizeof(header));
+
+		unsigned long long * locations = (unsigned long long *)&block[sizeof(header)];
+		for (auto& f : frames)
+			locations[f.slot] = f.location;
+
+		if (!frames.empty())
+			memcpy(&block[sizeof(header) + locations_size], &frames[0], frames.size() * sizeof(ava_frame_entry));
+	}
+
+	// Fill the bayer fields of the header from one of the cv::COLOR_BayerXX2RGB codes
+	inline void set_bayer(ava_raw_info& info, int bayer_pattern)
+	{
+		switch (bayer_pattern) {
+			case cv::COLOR_BayerRG2RGB: info.bayer0 = 'B'; info.bayer1 = 'G'; info.bayer2 = 'G'; info.bayer3 = 'R'; break;
+			case cv::COLOR_BayerBG2RGB: info.bayer0 = 'R'; info.bayer1 = 'G'; info.bayer2 = 'G'; info.bayer3 = 'B'; break;
+			case cv::COLOR_BayerGR2RGB: info.bayer0 = 'G'; info.bayer1 = 'B'; info.bayer2 = 'R'; info.bayer3 = 'G'; break;
+			case cv::COLOR_BayerGB2RGB: info.bayer0 = 'G'; info.bayer1 = 'R'; info.bayer2 = 'B'; info.bayer3 = 'G'; break;
+			default: info.bayer0 = ' '; info.bayer1 = ' '; info.bayer2 = ' '; info.bayer3 = ' '; break;
+		}
+	}
+
+	// Inverse of set_bayer, returns -1 for files without bayer information
+	inline int get_bayer(const ava_raw_info& info)
+	{
+		if (info.bayer0 == 'B' && info.bayer1 == 'G' && info.bayer2 == 'G' && info.bayer3 == 'R') return cv::COLOR_BayerRG2RGB;
+		if (info.bayer0 == 'R' && info.bayer1 == 'G' && info.bayer2 == 'G' && info.bayer3 == 'B') return cv::COLOR_BayerBG2RGB;
+		if (info.bayer0 == 'G' && info.bayer1 == 'B' && info.bayer2 == 'R' && info.bayer3 == 'G') return cv::COLOR_BayerGR2RGB;
+		if (info.bayer0 == 'G' && info.bayer1 == 'R' && info.bayer2 == 'B' && info.bayer3 == 'G') return cv::COLOR_BayerGB2RGB;
+		return -1;
+	}
+
+	// Pattern from its name in reading order, as in the header ("RGGB", "BGGR", "GRBG" or "GBRG"), -1 if unknown
+	inline int bayer_from_name(const char * name)
+	{
+		if (!name || strlen(name) != 4)
+			return -1;
+
+		ava_raw_info info;
+		info.bayer0 = name[0];
+		info.bayer1 = name[1];
+		info.bayer2 = name[2];
+		info.bayer3 = name[3];
+		return get_bayer(info);
+	}
+}
@@ -0,0 +1,175 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "ava_recovery.hpp"
+#include "ava_format.hpp"
+#include "video_reader_ava.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+bool recover_ava_recording(const std::string& filename)
+{
+	namespace fs = boost::filesystem;
+
+	std::vector<std::string> paths;
+	std::vector<unsigned long long> records_start;
+	ava_raw_info info;
+	{
+		std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+		if (!f.read((char *)&info, sizeof(info)) || info.magic != ava_format::MAGIC)
+		{
+			std::cerr << "Recover> " << filename << " is not an Ava Sequence file" << std::endl;
+			return false;
+		}
+		if (info.version < ava_format::VERSION_FRAMED || info.version > ava_format::VERSION_FILTERS)
+		{
+			std::cerr << "Recover> " << filename << " was written without packet headers (version " << (int)info.version << "), it cannot be recovered" << std::endl;
+			return false;
+		}
+		if (info.index_start_offset)
+		{
+			std::cout << "Recover> " << filename << " was closed properly, nothing to do" << std::endl;
+			return true;
+		}
+
+		unsigned int count = 0;
+		if (!f.read((char *)&count, sizeof(count)) || count < 1 || count > ava_format::MAX_SEGMENTS)
+		{
+			std::cerr << "Recover> " << filename << " has an invalid segment table" << std::endl;
+			return false;
+		}
+		for (unsigned int i = 0; i < count; i++)
+		{
+			unsigned short len = 0;
+			std::string path;
+			if (f.read((char *)&len, sizeof(len)))
+			{
+				path.resize(len);
+				if (len)
+					f.read(&path[0], len);
+			}
+			if (!f)
+			{
+				std::cerr << "Recover> " << filename << " has an invalid segment table" << std::endl;
+				return false;
+			}
+			paths.push_back(i == 0 ? filename : AvaVideoReader::segment_path(filename, path));
+			records_start.push_back(sizeof(ava_raw_info)); // after the copy of the header in the other segments
+		}
+		records_start[0] = f.tellg(); // after the segment table in the first one
+	}
+
+	const size_t max_packet_size = ava_format::max_packet_size(info);
+
+	// Scan the segments, each valid packet gives the location of one slot of the index
+	std::vector<ava_frame_entry> frames;
+	std::vector<unsigned long long> ends(paths.size());
+	std::vector<char> payload;
+	for (unsigned int s = 0; s < paths.size(); s++)
+	{
+		std::ifstream f(paths[s].c_str(), std::ios::in | std::ios::binary);
+		if (!f.is_open())
+		{
+			std::cerr << "Recover> Missing segment " << paths[s] << std::endl;
+			return false;
+		}
+
+		unsigned long long pos = records_start[s];
+		size_t found = 0;
+		f.seekg(pos);
+		while (true)
+		{
+			ava_packet_header header;
+			if (!f.read((char *)&header, sizeof(header)))
+				break;
+
+			if (header.magic == ava_format::PACKET_MAGIC && header.size <= max_packet_size)
+			{
+				payload.resize(header.size);
+				if (header.size && !f.read(&payload[0], header.size))
+					break;
+				if (ava_format::crc32(payload.empty() ? 0 : &payload[0], header.size) != header.checksum)
+					break;
+
+				ava_frame_entry entry;
+				entry.ts = header.ts;
+				entry.slot = header.slot;
+				entry.location = ava_format::make_location(s, pos);
+				entry.size = header.size;
+				entry.checksum = header.checksum;
+				frames.push_back(entry);
+				pos += sizeof(header) + header.size;
+				found++;
+			}
+			else if (header.magic == ava_format::CHECKPOINT_MAGIC && s == 0)
+			{
+				// Nothing to learn from the checkpoints, the packets of all the segments are scanned
+				ava_checkpoint_header cp;
+				memcpy(&cp, &header, sizeof(cp));
+				payload.resize(cp.count * sizeof(unsigned long long));
+				if (!payload.empty() && !f.read(&payload[0], payload.size()))
+					break;
+				if (ava_format::crc32(payload.empty() ? 0 : &payload[0], payload.size()) != cp.checksum)
+					break;
+
+				pos += sizeof(cp) + payload.size();
+			}
+			else
+			{
+				break; // not written (preallocated space), or interrupted in the middle of this record
+			}
+		}
+		ends[s] = pos;
+
+		std::cout << "Recover> " << paths[s] << ": " << found << " frames, " << pos << " bytes kept" << std::endl;
+	}
+
+	std::sort(frames.begin(), frames.end(), [](const ava_frame_entry& a, const ava_frame_entry& b) { return a.slot < b.slot; });
+
+	std::vector<unsigned char> index;
+	const unsigned long long slot_count = frames.empty() ? 0 : frames.back().slot + 1;
+	if (info.version >= ava_format::VERSION_FRAME_TABLE)
+	{
+		ava_format::build_index(frames, index);
+	}
+	else
+	{
+		// Version 3: the locations only
+		index.assign((size_t)slot_count * sizeof(unsigned long long), 0);
+		for (auto& e : frames)
+			memcpy(&index[(size_t)e.slot * sizeof(unsigned long long)], &e.location, sizeof(unsigned long long));
+	}
+
+	// Cut what was not completely written, then the index after the last record, as AvaVideoWriter::close does
+	try
+	{
+		for (size_t s = 0; s < paths.size(); s++)
+			fs::resize_file(paths[s], ends[s]);
+	}
+	catch (fs::filesystem_error& e)
+	{
+		std::cerr << "Recover> " << e.what() << std::endl;
+		return false;
+	}
+
+	std::fstream f(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+	unsigned long long index_offset = ends[0];
+	f.seekp(index_offset);
+	if (!index.empty())
+		f.write((const char *)&index[0], index.size());
+	f.seekp(offsetof(struct ava_raw_info, index_start_offset));
+	f.write((const char *)&index_offset, sizeof(index_offset));
+	f.close();
+	if (!f)
+	{
+		std::cerr << "Recover> Could not write the index of " << filename << std::endl;
+		return false;
+	}
+
+	std::cout << "Recover> " << filename << ": " << frames.size() << " frames recovered, " << slot_count << " slots" << std::endl;
+	return true;
+}
@@ -0,0 +1,11 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <string>
+
+// Rebuild the index of an .ava recording that was not closed (the node crashed, or the power was lost during the take).
+// One sequential pass over each segment: every packet with a valid header and checksum is kept, the files are cut
+// after the last complete record and the index is written at the end, as if the recording had been closed.
+// Recordings written before version 3 have no packet headers and cannot be recovered. Details are printed.
+bool recover_ava_recording(const std::string& filename);
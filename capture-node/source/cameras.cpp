@@ -4,6 +4,9 @@
 #include "recorder.hpp"
 #include "base64.hpp"
 #include "color_correction.hpp"
+#include "preview_kernels.hpp"
+#include "image_stats.hpp"
+#include "thread_config.hpp"
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
@@ -13,14 +16,25 @@
 
 #include <iostream>
 #include <numeric>
+#include <cmath>
+#include <thread>
 
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 
 #include "boost/date_time/posix_time/posix_time.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define CAMERAS_SSE2
+#endif
+
 //#define DEBUG_FRAME_TIMINGS
 
+static const double PREALLOCATE_EXTENT_SECONDS = 10.0; // the recording files grow by this much recording at a time
+static const uint64_t PREALLOCATE_MIN_EXTENT = 64 * 1024 * 1024;
+static const int PREROLL_DRAIN_BUFFERS = 50; // % of the encoding queue that the pre-roll may fill, the rest is for live frames
+
 Camera::Camera()
 {
 	m_unique_id = boost::uuids::to_string(boost::uuids::random_generator()());
@@ -36,6 +50,7 @@ Camera::Camera()
 	m_bitcount = 8;
 	m_record_frames_remaining = -1;
 	m_image_counter = 0;
+	m_frame_sequence = 0;
 	m_using_hardware_sync = false;
 	m_display_focus_peak = false;
 	m_display_overexposed = false;
@@ -45,6 +60,15 @@ Camera::Camera()
 	m_preview_height = default_preview_res;
 	m_color_need_debayer = false;
 	m_record_as_raw = false;
+	m_record_staged = false;
+	m_planned_take_seconds = 0.0;
+	m_expected_compression = 1.0;
+	m_codec = "lz4";
+	m_codec_level = 0;
+	m_frame_filters = 0;
+	m_params_dirty = true;
+	m_latency = std::make_shared<LatencyStats>();
+	m_delivery_offset = 0.0;
 
 	m_bayerpattern = cv::COLOR_BayerBG2RGB;
 
@@ -55,15 +79,29 @@ Camera::Camera()
 	m_encoding_buffers_used = 0;
 	m_writing_buffers_used = 0;
 
-	preview_image_is_histogram = false;
+	preview_image_index = 0;
+	large_preview_image_black_point = 0;
+	large_preview_index = 0;
+	m_large_preview_window = 2.0;
+	m_preview_hz = 10.0;
+	m_recording_preroll = false;
+	m_preroll_frames_in_take = 0;
+	m_preroll_seconds = 0.0;
+	m_preroll_frame_bytes = 0;
+	m_next_preview_ts = 0.0;
+
+	m_sharpness = -1.0f;
 
-	focus_peak_buffer_index = 0;
-	focus_peak_buffer_count = 0;
+	m_preview_thread = boost::thread([this]() {preview_thread(); });
 }
 
 Camera::~Camera()
 {
+	m_preview_mailbox.close();
+	m_preview_thread.join();
 
+	FramePool::Instance().unreserve(this);
+	FramePool::Instance().unreserve(&m_preroll);
 }
 
 std::string Camera::toString() const
@@ -78,24 +116,48 @@ void Camera::got_frame_timeout()
 	m_effective_fps = 0.0f;
 }
 
-bool Camera::block_until_next_frame(double timeout_s)
+unsigned long long Camera::frame_sequence() const
 {
-	int current_Frame_index = m_image_counter;
+	std::lock_guard<std::mutex> lock(m_mutex_frame_event);
+	return m_frame_sequence;
+}
+
+bool Camera::wait_for_frame(unsigned long long sequence, double timeout_s)
+{
+	std::unique_lock<std::mutex> lock(m_mutex_frame_event);
 
-	while (timeout_s>0.0) 
-	{
 #ifdef DEBUG_FRAME_TIMINGS		
-		printf("*** Block until next frame (%d)\n", m_image_counter);
+	printf("*** Wait for frame %llu (%llu)\n", sequence, m_frame_sequence);
 #endif // DEBUG_FRAME_TIMINGS		
 
-		if (m_image_counter != current_Frame_index)
-			return true;
-			
-		boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
-		timeout_s -= 0.1;
+	return m_frame_event.wait_for(lock, std::chrono::duration<double>(timeout_s), [this, sequence]() { return m_frame_sequence >= sequence; });
+}
+
+bool Camera::block_until_next_frame(double timeout_s)
+{
+	return wait_for_frame(frame_sequence() + 1, timeout_s);
+}
+
+bool Camera::wait_recording_done(double timeout_s)
+{
+	std::unique_lock<std::mutex> lock(m_mutex_frame_event);
+
+	if (timeout_s < 0.0)
+	{
+		m_frame_event.wait(lock, [this]() { return !m_recording; });
+		return true;
 	}
 
-	return false;
+	return m_frame_event.wait_for(lock, std::chrono::duration<double>(timeout_s), [this]() { return !m_recording; });
+}
+
+void Camera::set_recording(bool recording)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex_frame_event);
+		m_recording = recording;
+	}
+	m_frame_event.notify_all();
 }
 
 int overexposedDisplay(const cv::Mat& source, cv::Mat& output)
@@ -133,10 +195,166 @@ int overexposedDisplay(const cv::Mat& source, cv::Mat& output)
 	return overexposedPixels;
 }
 
+bool Camera::preview_due(double frame_timestamp)
+{
+	// Decimate the previews to m_preview_hz, based on the frame timestamps
+	if (m_preview_hz <= 0.0)
+		return true;
+
+	const double period = 1.0 / m_preview_hz;
+	if (frame_timestamp < m_next_preview_ts && frame_timestamp >= m_next_preview_ts - period)
+		return false;
+
+	// Stay on the same ticks, unless we fell behind or the timestamps restarted
+	if (frame_timestamp >= m_next_preview_ts && frame_timestamp - m_next_preview_ts < period)
+		m_next_preview_ts += period;
+	else
+		m_next_preview_ts = frame_timestamp + period;
+
+	return true;
+}
+
+void Camera::preview_thread()
+{
+	ThreadConfig::WorkerThreadScope thread_scope;
+
+	PreviewFrame frame;
+	while (m_preview_mailbox.wait(frame))
+		generate_preview(frame);
+}
+
+void Camera::store_preview_image(const cv::Mat& img, int index)
+{
+	std::lock_guard<std::mutex> lock(m_mutex_preview_image);
+	preview_image = img;
+	preview_image_index = index;
+	preview_jpeg.clear();
+}
+
+void Camera::generate_preview(const PreviewFrame& frame)
+{
+	// Runs on the preview thread, at its own pace. Frames published while we are busy here are skipped.
+
+	cv::Mat img = frame.frame.mat(); // shared with the recorders, read-only
+	const int black_level = frame.black_level;
+	const int bitcount = frame.bitcount;
+
+	// Exposure statistics are sent as data, the UI draws the histogram
+	if (m_display_histogram)
+	{
+		std::shared_ptr<ImageStats> stats(new ImageStats());
+		image_stats::compute(img, m_color_need_debayer, m_bayerpattern, bitcount, *stats);
+		std::atomic_store(&m_image_stats, std::shared_ptr<const ImageStats>(stats));
+	}
+	else if (std::atomic_load(&m_image_stats))
+	{
+		std::atomic_store(&m_image_stats, std::shared_ptr<const ImageStats>());
+	}
+
+	if (m_display_focus_peak)
+	{
+		cv::Mat overlay;
+		m_focus_peak.process(img, bitcount, overlay);
+		m_sharpness = m_focus_peak.sharpness();
+		img = overlay;
+
+		// Save preview image
+		cv::Mat new_preview_image;
+		cv::resize(img, new_preview_image, cv::Size(m_preview_width, m_preview_height), 0.0, 0.0, cv::INTER_NEAREST);
+		color_correction::linear_to_sRGB(new_preview_image);
+
+		store_preview_image(new_preview_image, frame.index);
+	}
+	else if (m_display_overexposed)
+	{
+		cv::Mat last_image;
+		cv::Mat work;
+
+		if (m_color_need_debayer && img.channels() == 1)
+		{
+			// Need to de-bayer to check overexposure
+			// Important: we need to follow the same post-processing as SimpleImageRecorder::writingThread()
+			cv::cvtColor(img, last_image, m_bayerpattern);
+			color_correction::apply(last_image, m_color_balance, black_level);
+		}
+		else
+		{
+			last_image = img.clone(); // Grayscale or native color camera
+		}
+
+		if (bitcount > 8) // convert the image to 8 bit range, the histogram expects values from 0 to 255
+			last_image.convertTo(last_image, CV_8U, 1.0f / (1 << (bitcount - 8)));
+
+		// Overexposure check : display red overlay for overexposed areas
+		cv::Mat overlay;
+		overexposedDisplay(last_image, overlay);
+		img = overlay;
+
+		cv::Mat new_preview_image;
+		cv::resize(img, new_preview_image, cv::Size(m_preview_width, m_preview_height), 0.0, 0.0, cv::INTER_NEAREST);
+		color_correction::linear_to_sRGB(new_preview_image);
+
+		store_preview_image(new_preview_image, frame.index);
+	}
+	else
+	{
+		// No overlay, the image is raw from the camera
+		// Store smaller resized preview image, only the pixels of the thumbnail are read from the frame
+
+		cv::Mat new_preview_image;
+		const cv::Size size(m_preview_width, m_preview_height);
+
+		if (m_color_need_debayer)
+			preview_kernels::bayer_thumbnail(img, new_preview_image, size, m_bayerpattern, m_color_balance, black_level, bitcount);
+		else
+			preview_kernels::mono_thumbnail(img, new_preview_image, size, bitcount);
+
+		store_preview_image(new_preview_image, frame.index);
+	}
+
+	// Store full resolution preview image, only if a client asked for it recently
+	{
+		std::lock_guard<std::mutex> lock(m_mutex_large_preview_image);
+
+		const auto now = std::chrono::steady_clock::now();
+		if (now < large_preview_demand_until)
+		{
+			large_preview_image = img; // either the pooled frame itself, or the overlay we just computed
+			large_preview_frame = frame.frame;
+			large_preview_image_black_point = black_level;
+			large_preview_index = frame.index;
+			large_preview_jpeg.clear();
+			large_preview_time = now;
+			m_large_preview_cond.notify_all();
+		}
+		else if (!large_preview_image.empty())
+		{
+			// Nobody is watching anymore, give the frame back to the pool
+			large_preview_image.release();
+			large_preview_frame.reset();
+			large_preview_jpeg.clear();
+		}
+	}
+}
+
 void Camera::got_image(cv::Mat img, double ts, int width, int height, int bitcount, int channels, int black_level)
 {
-	// Called by the camera implementation each time we recieve a new image
+	// Called by the camera implementation each time we recieve a new image.
+	// This is the only copy of the image data: the camera buffer is only valid until the next frame,
+	// the pooled copy is shared by the preview, the recorders and the snapshots.
+
+	FrameRef frame = FramePool::Instance().acquire_copy(img);
+	if (frame.empty())
+	{
+		std::cerr << "Camera> Frame pool exhausted, dropped frame" << std::endl;
+		return;
+	}
 
+	got_image(frame, ts, bitcount, channels, black_level);
+}
+
+void Camera::got_image(const FrameRef& frame, double ts, int bitcount, int channels, int black_level)
+{
 	//auto time1 = boost::posix_time::microsec_clock::local_time();
 
 	if (channels != 1) {
@@ -148,6 +366,15 @@ void Camera::got_image(cv::Mat img, double ts, int width, int height, int bitcou
 	assert(m_bitcount >= 8);
 	assert(m_bitcount <= 16);
 
+	if (ts > 0.0)
+	{
+		// The sensor clock has its own epoch: measure the delivery against the fastest frame seen so far
+		const double offset = frame.arrival() - ts;
+		if (m_image_counter == 0 || offset < m_delivery_offset)
+			m_delivery_offset = offset;
+		m_latency->record(LATENCY_DELIVERY, offset - m_delivery_offset);
+	}
+
 	// real representing this frame's time in seconds since the beginning of recording
 	double frame_timestamp = ts > 0.0 ? ts : ((boost::posix_time::microsec_clock::local_time() - boost::posix_time::ptime(boost::gregorian::date(2016, 1, 1))).total_milliseconds() / 1000.0);
 	if (m_image_counter == 0)
@@ -172,217 +399,15 @@ void Camera::got_image(cv::Mat img, double ts, int width, int height, int bitcou
 			m_waiting_for_trigger_hold?"H":".",m_image_counter,ts,frame_timestamp, dt);
 #endif // DEBUG_FRAME_TIMINGS			
 
-	// Generate thumbnail for live preview
-	if (!m_recording && !m_prepare_recording)
+	// Hand the latest frame over to the preview thread, preview work never runs on the capture thread
+	if (!m_recording && !m_prepare_recording && preview_due(frame_timestamp))
 	{
-		if (m_display_focus_peak)
-		{
-			const int FOCUS_THRESHOLD = 50; // on 255
-			const double HEATMAP_SCALE = 2.5;
-			const bool NORMALIZE_BRIGHTNESS = true;
-			const bool TEMPORAL_DENOISE = false; // average 4 frames to reduce noise
-			const int BLUR_SIZE = 151; // must be odd
-			const int BRIGHTNESS_THRESHOLD = 5; // focus peak will not run if mean brightness is less than this value (too dark)
-		
-			cv::Mat last_image;
-			cv::Mat work;
-
-			if (m_color_need_debayer && img.channels() == 1)
-			{
-				cv::Mat tempImage;
-				cv::cvtColor(img, tempImage, m_bayerpattern);
-				cv::cvtColor(tempImage, last_image, cv::COLOR_BGR2GRAY);
-			}
-			else if (img.channels() == 3)
-			{
-				cv::cvtColor(img, last_image, cv::COLOR_BGR2GRAY); // Native Color Camera BGR
-			}
-			else
-			{
-				last_image = img.clone(); // Grayscale camera
-			}
-
-			if (m_bitcount > 8) // convert the image to 8 bit range
-				last_image.convertTo(last_image, CV_8U, 1.0f / (1 << (m_bitcount - 8)));
-
-			// Reduce resolution by 1/2
-			cv::resize(last_image, last_image, cv::Size(0, 0), 0.5, 0.5, cv::INTER_AREA);
-
-			// Average last 4 images to reduce noise
-			if (TEMPORAL_DENOISE)
-			{
-				focus_peak_buffer[focus_peak_buffer_index] = last_image.clone();
-				focus_peak_buffer_count = std::min(focus_peak_buffer_count+1,4);
-				focus_peak_buffer_index = (focus_peak_buffer_index+1)%4;
-				cv::Mat avgImg(cv::Size(last_image.cols, last_image.rows), CV_32FC1, cv::Scalar(0));
-				for (int i=0;i<focus_peak_buffer_count;i++)
-					if (focus_peak_buffer[i].cols==avgImg.cols && focus_peak_buffer[i].rows==avgImg.rows)
-						cv::accumulate(focus_peak_buffer[i], avgImg);
-				avgImg = avgImg / focus_peak_buffer_count;
-				avgImg.convertTo(last_image, CV_8U);
-			}
-			
-			double mean = cv::mean(last_image)[0]; // Mean brightness, only shot focus peak if within range
-			if (mean>BRIGHTNESS_THRESHOLD && mean<256-BRIGHTNESS_THRESHOLD)
-			{
-				// Normalize brightness of the image
-				if (NORMALIZE_BRIGHTNESS)
-					last_image.convertTo(last_image, -1, 128.0/mean);
-			
-				// Compute contrast threshold
-				cv::Mat kernel = cv::Mat::ones(3, 3, CV_8S);
-				kernel.at<char>(1, 1) = -8;
-				cv::filter2D(last_image, work, -1, kernel);
-				cv::threshold(work, work, FOCUS_THRESHOLD, 255, cv::THRESH_BINARY);
-	
-				// Gaussian Blur on the map and apply color ramp
-				cv::GaussianBlur(work,work,cv::Size(BLUR_SIZE,BLUR_SIZE),0);
-				work = work * HEATMAP_SCALE; // Arbitrary scale
-				cv::applyColorMap(work, work, cv::COLORMAP_HOT);
-	
-				// Overlay heat map on top of our original image
-				cv::cvtColor(last_image, last_image, cv::COLOR_GRAY2BGR);
-				cv::addWeighted(last_image, 0.2, work, 1.0, 0.0, img);
-			}
-
-			// Save preview image
-			cv::Mat new_preview_image;
-			cv::resize(img, new_preview_image, cv::Size(m_preview_width, m_preview_height), 0.0, 0.0, cv::INTER_NEAREST);
-			color_correction::linear_to_sRGB(new_preview_image);
-
-			{
-				std::lock_guard<std::mutex> lock(m_mutex_preview_image);
-				preview_image = new_preview_image;
-				preview_image_is_histogram = false;
-			}
-		}
-		else if (m_display_overexposed)
-		{
-			cv::Mat last_image;
-			cv::Mat work;
-
-			if (m_color_need_debayer && img.channels() == 1)
-			{
-				// Need to de-bayer to check overexposure
-				// Important: we need to follow the same post-processing as SimpleImageRecorder::writingThread()
-				cv::cvtColor(img, last_image, m_bayerpattern);
-				color_correction::apply(last_image, m_color_balance, black_level);
-			}
-			else
-			{
-				last_image = img.clone(); // Grayscale or native color camera
-			}
-
-			if (m_bitcount > 8) // convert the image to 8 bit range, the histogram expects values from 0 to 255
-				last_image.convertTo(last_image, CV_8U, 1.0f / (1 << (m_bitcount - 8)));
-
-			// Overexposure check : display red overlay for overexposed areas
-			overexposedDisplay(last_image, img);
-
-			cv::Mat new_preview_image;
-			cv::resize(img, new_preview_image, cv::Size(m_preview_width, m_preview_height), 0.0, 0.0, cv::INTER_NEAREST);
-			color_correction::linear_to_sRGB(new_preview_image);
-
-			{
-				std::lock_guard<std::mutex> lock(m_mutex_preview_image);
-				preview_image = new_preview_image;
-				preview_image_is_histogram = false;
-			}
-		}
-		else if (m_display_histogram)
-		{
-			int histSize = 256;
-			float range[] = { 0, 256 };
-			const float* histRange = { range };
-			bool uniform = true; bool accumulate = false;
-
-			cv::Mat last_image;
-
-			if (m_color_need_debayer && img.channels() == 1)
-				cv::cvtColor(img, last_image, m_bayerpattern);
-			else
-				last_image = img.clone(); // Grayscale camera
-
-			if (m_bitcount > 8) // convert the image to 8 bit range, the histogram expects values from 0 to 255
-				last_image.convertTo(last_image, CV_8U, 1.0f / (1 << (m_bitcount - 8)));
-
-			int hist_w = histSize; 
-			int hist_h = 256;
-			cv::Mat histImage;
-
-			{
-				// Create Histogram
-
-				cv::Mat sourceChannels[3];
-				cv::Mat histChannels[3];
-
-				cv::split(last_image, sourceChannels);
-
-				for (int c = 0; c < last_image.channels(); c++)
-				{
-					histChannels[c] = cv::Mat(hist_h, hist_w, CV_8UC1, cv::Scalar(0));
-
-					cv::Mat b_hist;
-					cv::calcHist(&sourceChannels[c], 1, 0, cv::Mat(), b_hist, 1, &histSize, &histRange, uniform, accumulate);
-					b_hist = b_hist * (32.0 * hist_h / (width*height));
-
-					for (int i = 0; i < histSize; i++)
-					{
-						static const int extreme_width = 4;
-						static const cv::Scalar highlight = cv::Scalar(255, 0, 0);
-						static const cv::Scalar grey = cv::Scalar(200, 0, 0);
-						line(histChannels[c],
-							cv::Point(i, hist_h),
-							cv::Point(i, hist_h - cvRound(b_hist.at<float>(i))),
-							i <= extreme_width || i >= histSize - 1 - extreme_width ? highlight : grey);
-					}
-				}
-
-				cv::merge(histChannels, last_image.channels(), histImage);
-			}
-
-			{
-				std::lock_guard<std::mutex> lock(m_mutex_preview_image);
-				preview_image = histImage;
-				preview_image_is_histogram = true;
-			}
-		}
-		else
-		{
-			// No histogram, the image is raw from the camera, or overexposed/focuspeak
-			// Store smaller resized preview image
-
-			cv::Mat new_preview_image;
-			cv::Mat tempImage = img;
-
-			// Debayer only if this is the raw from camera
-			if (m_color_need_debayer && img.channels()==1)
-				cv::cvtColor(img, tempImage, m_bayerpattern);
-
-			cv::resize(tempImage, new_preview_image, cv::Size(m_preview_width, m_preview_height), 0.0, 0.0, cv::INTER_NEAREST);
-
-			// Color-correct only if this is the raw from camera
-			if (m_color_need_debayer)
-				color_correction::apply(new_preview_image, m_color_balance, black_level);
-
-			if (m_bitcount > 8) // If the image is more than 8 bit, shift values to convert preview to 8 bit range, for JPG encoding	
-				new_preview_image.convertTo(new_preview_image, CV_8U, 1.0f / (1 << (m_bitcount - 8)));
-
-			color_correction::linear_to_sRGB(new_preview_image);
-
-			{
-				std::lock_guard<std::mutex> lock(m_mutex_preview_image);
-				preview_image = new_preview_image;
-				preview_image_is_histogram = false;
-			}
-		}
-
-		// Store full resolution preview image
-		{
-			std::lock_guard<std::mutex> lock(m_mutex_large_preview_image);
-			large_preview_image = img.clone();
-			large_preview_image_black_point = black_level;
-		}
+		m_preview_spare.frame = frame;
+		m_preview_spare.black_level = black_level;
+		m_preview_spare.bitcount = m_bitcount;
+		m_preview_spare.index = m_image_counter;
+		m_preview_mailbox.publish(m_preview_spare);
+		m_preview_spare.frame.reset(); // do not hold on to the frame that was skipped
 	}
 
 	//if (m_debug_in_capture_cycle)
@@ -416,62 +441,211 @@ void Camera::got_image(cv::Mat img, double ts, int width, int height, int bitcou
 				printf("*** %s APPEND %f\n", m_unique_id.c_str(), dt);
 #endif // DEBUG_FRAME_TIMINGS				
 				
-			// Store first frame of each recordings
-			if (recording_first_frame.empty())
+			if (m_recording_preroll && !m_preroll.empty())
 			{
-				recording_first_frame = img.clone();
-				recording_first_frame_black_level = black_level;
-				recording_first_frame_index = m_recorders[0]->frame_count();
-			}				
+				if (recording_first_frame.empty())
+					m_preroll_frames_in_take = m_preroll.size();
 
-			// Accumulate frames only if we are recording, and we are not waiting for the trigger
-			for (auto& r : m_recorders)
+				// The pre-roll is recorded first, live frames queue behind it until the ring is drained
+				drain_preroll(PREROLL_DRAIN_BUFFERS);
+				if (!m_preroll.push(frame, frame_timestamp, black_level))
+					std::cerr << "Camera> Pre-roll ring full while recording, dropped frame" << std::endl;
+			}
+			else
 			{
-				r->append(img, frame_timestamp, black_level);
-
-				if (r->buffers_used(BUFFER_ENCODING) > 0)
-					m_encoding_buffers_used = r->buffers_used(BUFFER_ENCODING);
-				if (r->buffers_used(BUFFER_WRITING) > 0)
-					m_writing_buffers_used = r->buffers_used(BUFFER_WRITING);
+				// Accumulate frames only if we are recording, and we are not waiting for the trigger
+				append_to_recorders(frame, frame_timestamp, black_level);
 			}
-
+		}
+		else if (m_recording_preroll && !m_closing_recorders)
+		{
+			m_preroll.push(frame, frame_timestamp, black_level); // still before the trigger
 		}
 
 		if (m_record_frames_remaining > 0 && m_recorders[0]->frame_count() >= m_record_frames_remaining)
 			stop_recording();
 	}
+	else if (!m_recording && m_preroll.capacity())
+	{
+		m_preroll.push(frame, frame_timestamp, black_level);
+	}
 
 	m_image_counter++;
 
+	{
+		std::lock_guard<std::mutex> lock(m_mutex_frame_event);
+		m_frame_sequence++;
+	}
+	m_frame_event.notify_all();
+
 	//auto time2 = boost::posix_time::microsec_clock::local_time();
 	//std::cout << "Time: " << (time2 - time1) << std::endl;
 }
 
+void Camera::append_to_recorders(const FrameRef& frame, double ts, int black_level)
+{
+	// Store first frame of each recordings
+	if (recording_first_frame.empty())
+	{
+		recording_first_frame = frame;
+		recording_first_frame_black_level = black_level;
+		recording_first_frame_index = m_recorders[0]->frame_count();
+	}				
+
+	for (auto& r : m_recorders)
+	{
+		r->append(frame, ts, black_level);
+
+		if (r->buffers_used(BUFFER_ENCODING) > 0)
+			m_encoding_buffers_used = r->buffers_used(BUFFER_ENCODING);
+		if (r->buffers_used(BUFFER_WRITING) > 0)
+			m_writing_buffers_used = r->buffers_used(BUFFER_WRITING);
+	}
+}
+
+void Camera::drain_preroll(int max_buffers_used)
+{
+	// Feed the encoders no faster than they can take, a burst of the whole ring would overflow their queues
+	PreRollFrame f;
+	while (m_recorders[0]->buffers_used(BUFFER_ENCODING) < max_buffers_used && m_preroll.pop(f))
+		append_to_recorders(f.frame, f.ts, f.black_level);
+}
+
+size_t Camera::preroll_bytes(double seconds) const
+{
+	if (is_audio_only())
+		return 0;
+
+	const size_t frames = (size_t)std::ceil(std::max(0.0, seconds) * framerate());
+	return frames * FramePool::buffer_capacity(m_width, m_height, m_bitcount > 8 ? CV_16UC1 : CV_8UC1);
+}
+
+bool Camera::preroll_outdated() const
+{
+	if (is_audio_only() || m_preroll_seconds <= 0.0)
+		return false;
+	return FramePool::buffer_capacity(m_width, m_height, m_bitcount > 8 ? CV_16UC1 : CV_8UC1) != m_preroll_frame_bytes;
+}
+
+void Camera::set_preroll(double seconds, size_t max_bytes)
+{
+	if (is_audio_only())
+		return;
+
+	const size_t frame_bytes = FramePool::buffer_capacity(m_width, m_height, m_bitcount > 8 ? CV_16UC1 : CV_8UC1);
+	const size_t capacity = std::min(preroll_bytes(seconds), max_bytes) / frame_bytes;
+	const bool resized = frame_bytes != m_preroll_frame_bytes;
+	m_preroll_seconds = seconds;
+	m_preroll_frame_bytes = frame_bytes;
+	if (capacity == m_preroll.capacity() && !resized)
+		return;
+
+	m_preroll.configure(capacity);
+
+	// Buffers for the ring of this camera, on top of the capture buffers and the rings of the other cameras, so that
+	// filling the ring does not allocate during capture. 0 drops the reservation.
+	FramePool::Instance().reserve(&m_preroll, m_width, m_height, m_bitcount > 8 ? CV_16UC1 : CV_8UC1, (int)capacity);
+
+	std::cout << "Camera> " << m_unique_id << " pre-roll " << capacity << " frames (" << (capacity * frame_bytes / 1024 / 1024) << " MB)" << std::endl;
+}
+
+std::shared_ptr<const Camera::ParamMap> Camera::params_cached() const
+{
+	static const std::shared_ptr<const ParamMap> empty = std::make_shared<ParamMap>();
+
+	std::shared_ptr<const ParamMap> params = std::atomic_load(&m_params_cache);
+	return params ? params : empty;
+}
+
+void Camera::poll_params(double volatile_period)
+{
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	// Clear the flag before reading, a write during the refresh triggers another one
+	const bool full = m_params_dirty.exchange(false);
+	if (!full && std::chrono::duration<double>(now - m_params_polled).count() < volatile_period)
+		return;
+	m_params_polled = now;
+
+	std::shared_ptr<const ParamMap> previous = std::atomic_load(&m_params_cache);
+
+	std::shared_ptr<ParamMap> params = std::make_shared<ParamMap>();
+	{
+		std::lock_guard<std::mutex> lock(m_params_mutex);
+		*params = params_list();
+	}
+
+	for (auto& p : *params)
+	{
+		// Settings keep their cached value until they are written, only the volatile ones are read again
+		if (!full && previous && !param_is_volatile(p.first))
+		{
+			auto it = previous->find(p.first);
+			if (it != previous->end())
+			{
+				p.second.last_value = it->second.last_value;
+				continue;
+			}
+		}
+		p.second.last_value = param_get(p.first.c_str());
+	}
+
+	std::atomic_store(&m_params_cache, std::shared_ptr<const ParamMap>(params));
+}
+
 void Camera::remove_recording_hold()
 {
 	m_waiting_for_trigger_hold = false;
 }
 
+void Camera::set_take_estimate(double seconds, double compression_ratio)
+{
+	m_planned_take_seconds = std::max(0.0, seconds);
+	m_expected_compression = std::max(1.0, compression_ratio);
+}
+
 void Camera::start_recording(const std::vector<std::string>& folders, bool wait_for_trigger, int nb_frames)
 {
 	// Start recording frames to the specified file
 	if (!recording())
 	{
-		recording_first_frame.release();
+		recording_first_frame.reset();
 		m_last_summary.reset();
 		m_record_frames_remaining = nb_frames;
 		m_encoding_buffers_used = 0;
 		m_writing_buffers_used = 0;
+		m_latency->reset();
 
 		if (nb_frames>0)
-			m_recorders.push_back(std::make_shared<SimpleImageRecorder>(unique_id(), framerate(), m_width, m_height, m_bitcount, m_color_need_debayer, m_bayerpattern, m_color_balance, folders, m_record_as_raw));
+			m_recorders.push_back(std::make_shared<SimpleImageRecorder>(unique_id(), framerate(), m_width, m_height, m_bitcount, m_color_need_debayer, m_bayerpattern, m_color_balance, folders, m_record_as_raw, m_latency));
 		else
-			m_recorders.push_back(std::make_shared<SimpleMovieRecorder>(unique_id(), framerate(), m_width, m_height, m_bitcount, m_color_need_debayer, m_bayerpattern, m_color_balance, folders, m_record_as_raw));
+		{
+			// Disk space for the planned duration, then large extents in case the take runs longer
+			const double written_per_second = bandwidth() / m_expected_compression;
+			const uint64_t expected_bytes = (uint64_t)(written_per_second * (m_planned_take_seconds + m_preroll.size() / (double)std::max(1, framerate())));
+			const uint64_t extent_bytes = std::max(PREALLOCATE_MIN_EXTENT, (uint64_t)(written_per_second * PREALLOCATE_EXTENT_SECONDS));
+
+			std::string codec;
+			int codec_level;
+			unsigned int filters;
+			{
+				std::lock_guard<std::mutex> lock(m_codec_mutex);
+				codec = m_codec;
+				codec_level = m_codec_level;
+				filters = m_frame_filters;
+			}
+
+			m_recorders.push_back(std::make_shared<SimpleMovieRecorder>(unique_id(), framerate(), m_width, m_height, m_bitcount, m_color_need_debayer, m_bayerpattern, m_color_balance, folders, m_record_as_raw, m_record_staged, m_latency,
+				expected_bytes, extent_bytes, codec, codec_level, filters));
+		}
 		m_recorders.push_back(std::make_shared<MetadataRecorder>(unique_id(), framerate(), m_width, m_height, m_bitcount, m_color_need_debayer, m_color_balance, folders, this));
 
+		m_recording_preroll = nb_frames <= 0 && m_preroll.capacity() > 0; // only continuous recordings start with the pre-roll
+		m_preroll_frames_in_take = 0;
+
 		m_got_trigger_timeout = false;
 		m_closing_recorders = false;
-		m_recording = true;
+		set_recording(true);
 		m_prepare_recording = false;
 		m_waiting_delay = 3.0;
 		m_waiting_for_trigger_hold = true;
@@ -490,6 +664,18 @@ void Camera::stop_recording()
 	{
 		m_closing_recorders = true;
 
+		// Record what is left of the pre-roll, at the pace of the encoders. Nothing was recorded if the trigger never came.
+		if (m_recording_preroll && !recording_first_frame.empty())
+		{
+			drain_preroll(PREROLL_DRAIN_BUFFERS);
+			while (!m_preroll.empty())
+			{
+				boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+				drain_preroll(PREROLL_DRAIN_BUFFERS);
+			}
+		}
+		m_recording_preroll = false;
+
 		// Close all recorders
 		for (auto& r : m_recorders)
 			r->close();
@@ -512,6 +698,7 @@ void Camera::stop_recording()
 			d_camera.AddMember("version", rapidjson::Value(version().c_str(), d->GetAllocator()), d->GetAllocator());
 			d_camera.AddMember("effective_fps", m_effective_fps, d->GetAllocator());
 			d_camera.AddMember("framerate", framerate(), d->GetAllocator());
+			d_camera.AddMember("preroll_frames", (unsigned int)m_preroll_frames_in_take, d->GetAllocator());
 			d_camera.AddMember("width", width(), d->GetAllocator());
 			d_camera.AddMember("height", height(), d->GetAllocator());
 			d_camera.AddMember("using_hardware_sync", using_hardware_sync(), d->GetAllocator());
@@ -520,22 +707,29 @@ void Camera::stop_recording()
 			d->AddMember("camera", d_camera, d->GetAllocator());
 
 			// Add custom parameters
-			auto list = params_list();
+			std::shared_ptr<const ParamMap> list = params_cached();
 			rapidjson::Value d_params(rapidjson::kObjectType);
-			for (auto e : list)
+			for (auto& e : *list)
 			{
 				rapidjson::Value strVal;
 				strVal.SetString(e.first.c_str(), d->GetAllocator());
-				d_params.AddMember(strVal, rapidjson::Value(param_get(e.first.c_str())), d->GetAllocator());
+				d_params.AddMember(strVal, rapidjson::Value(e.second.last_value), d->GetAllocator());
 			}			
 			d->AddMember("camera_params", d_params, d->GetAllocator());	
 
+			// Time spent by the frames of this take in each stage, the writers are closed at this point
+			// (staged takes are still draining, their write stage keeps accumulating until the next take)
+			rapidjson::Value d_latency;
+			m_latency->to_json(d_latency, d->GetAllocator());
+			d->AddMember("latency", d_latency, d->GetAllocator());
+
 			if (!recording_first_frame.empty())
 			{
-				cv::Mat tempImage = recording_first_frame;
+				cv::Mat firstImage = recording_first_frame.mat();
+				cv::Mat tempImage = firstImage;
 
 				if (m_color_need_debayer)
-					cv::cvtColor(recording_first_frame, tempImage, m_bayerpattern);
+					cv::cvtColor(firstImage, tempImage, m_bayerpattern);
 
 				cv::resize(tempImage, tempImage, cv::Size(m_preview_width*2, m_preview_height*2), 0.0, 0.0, cv::INTER_AREA);
 
@@ -575,7 +769,7 @@ void Camera::stop_recording()
 			}
 
 			m_last_summary = d;
-			m_recording = false;
+			set_recording(false);
 			m_waiting_for_trigger = false;
 			m_waiting_for_trigger_hold = false;
 			m_encoding_buffers_used = 0;
@@ -591,48 +785,98 @@ void Camera::updateColorBalance(double r, double g, double b)
 	m_color_balance.kB = b;
 }
 
-bool Camera::get_preview_image(std::vector<unsigned char>& buf, bool* pIsHistogram)
+bool Camera::get_preview_image(std::vector<unsigned char>& buf)
 {
 	std::lock_guard<std::mutex> lock(m_mutex_preview_image);
 
 	if (preview_image.empty())
 		return false;
 
-	if (pIsHistogram)
-		*pIsHistogram = preview_image_is_histogram;
+	if (!preview_jpeg.valid_for(preview_image_index))
+	{
+		if (!cv::imencode(".jpg", preview_image, preview_jpeg.jpeg)) // cv2.IMWRITE_JPEG_QUALITY, 90
+		{
+			preview_jpeg.clear();
+			return false;
+		}
+		preview_jpeg.frame_index = preview_image_index;
+	}
 
-	return cv::imencode(".jpg", preview_image, buf); // cv2.IMWRITE_JPEG_QUALITY, 90
+	buf = preview_jpeg.jpeg;
+	return true;
 }
 bool Camera::get_large_preview_image(std::vector<unsigned char>& buf)
 {
-	cv::Mat tempImage;
+	std::lock_guard<std::mutex> encode_lock(m_mutex_large_preview_encode);
+
+	cv::Mat snapshot;
+	FrameRef snapshot_frame; // keeps the snapshot memory alive while we work outside of the lock
+	int black_point;
+	int snapshot_index;
+	std::chrono::steady_clock::time_point snapshot_time;
 
 	{
-		std::lock_guard<std::mutex> lock(m_mutex_large_preview_image);
+		std::unique_lock<std::mutex> lock(m_mutex_large_preview_image);
+
+		// Ask the preview thread to keep snapshots for the duration of the window
+		const auto now = std::chrono::steady_clock::now();
+		const auto window = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(m_large_preview_window));
+		large_preview_demand_until = now + window;
+
+		// If the last snapshot is too old, wait for the next one. While recording no new snapshot
+		// is taken, so after the timeout we fall back on the last one we have.
+		if (large_preview_image.empty() || now - large_preview_time > window)
+			m_large_preview_cond.wait_for(lock, std::chrono::seconds(1), [this, now]() { return !large_preview_image.empty() && large_preview_time >= now; });
 
 		if (large_preview_image.empty())
 			return false;
 
-		if (m_color_need_debayer && large_preview_image.channels() == 1)
+		// This snapshot was already encoded for another client
+		if (large_preview_jpeg.valid_for(large_preview_index))
 		{
-			cv::cvtColor(large_preview_image, tempImage, m_bayerpattern);
-			color_correction::apply(tempImage, m_color_balance, large_preview_image_black_point);
+			buf = large_preview_jpeg.jpeg;
+			return true;
 		}
+
+		snapshot = large_preview_image;
+		snapshot_frame = large_preview_frame;
+		black_point = large_preview_image_black_point;
+		snapshot_index = large_preview_index;
+		snapshot_time = large_preview_time;
+	}
+
+	cv::Mat tempImage;
+	const cv::Size size(m_width / 4, m_height / 4);
+
+	if (snapshot.channels() == 1)
+	{
+		// Raw frame, sample it directly at a quarter of the resolution
+		if (m_color_need_debayer)
+			preview_kernels::bayer_thumbnail(snapshot, tempImage, size, m_bayerpattern, m_color_balance, black_point, m_bitcount);
 		else
-		{
-			tempImage = large_preview_image;
-		}
+			preview_kernels::mono_thumbnail(snapshot, tempImage, size, m_bitcount);
+	}
+	else
+	{
+		// 8 bit overlay computed by the preview thread
+		cv::resize(snapshot, tempImage, size, 0.0, 0.0, cv::INTER_NEAREST);
+		color_correction::linear_to_sRGB(tempImage);
+	}
+
+	if (!cv::imencode(".jpg", tempImage, buf)) // cv2.IMWRITE_JPEG_QUALITY, 90
+		return false;
 
-		if (m_bitcount > 8 && tempImage.depth() != CV_8U) // If the image is more than 8 bit, shift values to convert preview to 8 bit range, for JPG encoding
+	{
+		// Cache the result, unless the preview thread replaced the snapshot in the meantime
+		std::lock_guard<std::mutex> lock(m_mutex_large_preview_image);
+		if (large_preview_time == snapshot_time && large_preview_index == snapshot_index)
 		{
-			tempImage.convertTo(tempImage, CV_8U, 1.0f / (1 << (m_bitcount - 8)));
+			large_preview_jpeg.jpeg = buf;
+			large_preview_jpeg.frame_index = snapshot_index;
 		}
-
-		cv::resize(tempImage, tempImage, cv::Size(0, 0), 0.25, 0.25, cv::INTER_NEAREST);
 	}
 
-	color_correction::linear_to_sRGB(tempImage);
-	return cv::imencode(".jpg", tempImage, buf); // cv2.IMWRITE_JPEG_QUALITY, 90
+	return true;
 }
 
 WebcamCamera::WebcamCamera(int id) : m_id(id)
@@ -675,6 +919,8 @@ std::vector<std::shared_ptr<Camera> > WebcamCamera::get_webcam_cameras()
 
 void WebcamCamera::captureThread()
 {
+	ThreadConfig::CaptureThreadScope thread_scope(m_unique_id);
+
 	cv::Mat frame;
 	while (m_capturing)
 	{
@@ -711,7 +957,42 @@ void WebcamCamera::stop_capture()
 	}
 }
 
-DummyCamera::DummyCamera(int id) : m_id(id)
+static const size_t DUMMY_NOISE_EXTRA = 1 << 16; // pixels of noise beyond one frame, each frame starts at a random offset in them
+static const double DUMMY_MAX_SLEEP = 0.1; // seconds, so that stop_capture does not wait for a slow framerate
+
+static inline unsigned long long xorshift64(unsigned long long& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ull;
+}
+
+static void add_pixels(const unsigned char * a, const unsigned char * b, unsigned char * dst, size_t bytes, bool is16)
+{
+	// dst = a + b, per 8 or 16 bit pixel. The caller guarantees that the sums do not overflow.
+	size_t i = 0;
+#ifdef CAMERAS_SSE2
+	for (; i + 16 <= bytes; i += 16)
+	{
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		_mm_storeu_si128((__m128i*)(dst + i), is16 ? _mm_add_epi16(va, vb) : _mm_add_epi8(va, vb));
+	}
+#endif
+	if (is16)
+	{
+		for (; i + 2 <= bytes; i += 2)
+			*(unsigned short*)(dst + i) = *(const unsigned short*)(a + i) + *(const unsigned short*)(b + i);
+	}
+	else
+	{
+		for (; i < bytes; i++)
+			dst[i] = a[i] + b[i];
+	}
+}
+
+DummyCamera::DummyCamera(int id, const DummyCameraSettings& settings) : m_id(id)
 {
 	std::stringstream ss;
 	ss << "Dummy" << id;
@@ -720,40 +1001,152 @@ DummyCamera::DummyCamera(int id) : m_id(id)
 	m_model = "Dummy";
 	m_version = "1.0";
 
-	m_width = 320;
-	m_height = 200;
-	m_framerate = 10;
+	m_bitcount = std::min(16, std::max(8, settings.bitcount));
+	m_noise_bits = std::min(m_bitcount, std::max(0, settings.noise_bits));
+	m_color_need_debayer = settings.bayer_pattern >= 0;
+	if (m_color_need_debayer)
+		m_bayerpattern = settings.bayer_pattern;
+
+	m_width = std::max(2, settings.width) & ~1; // whole bayer quads
+	m_height = std::max(2, settings.height) & ~1;
+	m_framerate = std::max(1, settings.framerate);
 
 	m_preview_width = default_preview_res;
 	m_preview_height = m_preview_width*m_height / m_width; // keep aspect ratio for preview
 
+	m_rng_state = 0x9E3779B97F4A7C15ull * (id + 1);
+
+	generate_texture();
+
 	start_capture();
 }
 
-std::vector<std::shared_ptr<Camera> > DummyCamera::get_dummy_cameras(int count)
+std::vector<std::shared_ptr<Camera> > DummyCamera::get_dummy_cameras(const DummyCameraSettings& settings)
 {
 	std::vector<std::shared_ptr<Camera> > v;
 
-	for (int i=0;i<count;i++)
+	for (int i=0;i<settings.count;i++)
 	{
-		v.push_back(std::make_shared<DummyCamera>(i));
+		v.push_back(std::make_shared<DummyCamera>(i, settings));
 	}
 
 	return v;
 }
 
+void DummyCamera::generate_texture()
+{
+	const bool is16 = m_bitcount > 8;
+	const size_t pixels = (size_t)m_width * m_height;
+	const int noise_max = (1 << m_noise_bits) - 1;
+	const int texture_max = (1 << m_bitcount) - 1 - noise_max; // so that texture + noise never overflows
+
+	preview_kernels::BayerLayout l = preview_kernels::bayer_layout(m_bayerpattern);
+
+	// Smooth scene: gradient, rings and vignetting. Bayer cameras get a different gain per color.
+	m_texture.resize(pixels * (is16 ? 2 : 1));
+	for (int y = 0; y < m_height; y++)
+	{
+		for (int x = 0; x < m_width; x++)
+		{
+			const double fx = (double)x / m_width;
+			const double fy = (double)y / m_height;
+			const double r2 = (fx - 0.5) * (fx - 0.5) + (fy - 0.5) * (fy - 0.5);
+			double v = (0.45 + 0.25 * fx - 0.1 * fy + 0.2 * std::cos(60.0 * std::sqrt(r2))) * (1.0 - r2);
+
+			if (m_color_need_debayer)
+			{
+				const int qx = x & 1;
+				const int qy = y & 1;
+				if (qx == l.r_x && qy == l.r_y)
+					v *= 0.7;
+				else if (qx == l.b_x && qy == l.b_y)
+					v *= 0.5;
+			}
+
+			const int value = (int)(std::min(1.0, std::max(0.0, v)) * texture_max);
+			const size_t i = (size_t)y * m_width + x;
+			if (is16)
+				((unsigned short*)&m_texture[0])[i] = (unsigned short)value;
+			else
+				m_texture[i] = (unsigned char)value;
+		}
+	}
+
+	// Uniform noise of noise_bits per pixel
+	const size_t noise_pixels = pixels + DUMMY_NOISE_EXTRA;
+	m_noise.resize(noise_pixels * (is16 ? 2 : 1));
+	for (size_t i = 0; i < noise_pixels; i++)
+	{
+		const unsigned int value = (unsigned int)(xorshift64(m_rng_state) >> 32) & noise_max;
+		if (is16)
+			((unsigned short*)&m_noise[0])[i] = (unsigned short)value;
+		else
+			m_noise[i] = (unsigned char)value;
+	}
+}
+
+void DummyCamera::render_frame(cv::Mat& dst, int frame_index)
+{
+	const bool is16 = m_bitcount > 8;
+	const size_t elem = is16 ? 2 : 1;
+
+	// Consecutive frames get different noise, like a real sensor
+	const size_t offset = (size_t)(xorshift64(m_rng_state) % DUMMY_NOISE_EXTRA) * elem;
+	add_pixels(&m_texture[0], &m_noise[offset], dst.data, m_texture.size(), is16);
+
+	// Moving line, so that the preview shows that frames are flowing
+	const int y = frame_index % m_height;
+	if (is16)
+		dst.row(y).setTo(cv::Scalar((1 << m_bitcount) - 1));
+	else
+		dst.row(y).setTo(cv::Scalar(255));
+}
+
 void DummyCamera::captureThread()
 {
+	ThreadConfig::CaptureThreadScope thread_scope(m_unique_id);
+
+	typedef std::chrono::steady_clock clock;
+	typedef std::chrono::duration<double> seconds;
+
+	const int type = m_bitcount > 8 ? CV_16UC1 : CV_8UC1;
+	const int container_bitcount = m_bitcount > 8 ? 16 : 8;
+
+	// Frames are due on absolute deadlines, the time spent rendering does not make the rate drift
+	clock::time_point deadline = clock::now();
 	int i=0;
-	cv::Mat frame(cv::Size(m_width, m_height), CV_8UC1);
 	while (m_capturing)
 	{
-		cv::line(frame, cv::Point(0, i), cv::Point(m_width-1, i), rand()&0xFF);
+		// Render the frame before its deadline, it is delivered right on time
+		FrameRef frame = FramePool::Instance().acquire(m_width, m_height, type);
+		if (!frame.empty())
+		{
+			cv::Mat dst = frame.mat(); // we are the only owner until got_image
+			render_frame(dst, i);
+		}
 
-		Camera::got_image(frame, 0, m_width, m_height, 8, 1);
+		clock::time_point now = clock::now();
+		while (m_capturing && now < deadline)
+		{
+			std::this_thread::sleep_for(std::min(seconds(deadline - now), seconds(DUMMY_MAX_SLEEP)));
+			now = clock::now();
+		}
+		if (!m_capturing)
+			break;
+
+		// Like a camera that can not keep up: fall behind, but never deliver a burst to catch up
+		if (now - deadline > seconds(1.0 / m_framerate))
+			deadline = now;
 
-		boost::this_thread::sleep_for(boost::chrono::milliseconds((long)(1000.0/m_framerate)));
+		if (frame.empty())
+			std::cerr << "Camera> Frame pool exhausted, dropped frame" << std::endl;
+		else
+		{
+			frame.mark_arrival(); // delivered now, not when it was rendered
+			Camera::got_image(frame, seconds(deadline.time_since_epoch()).count(), container_bitcount, 1);
+		}
 
+		deadline += std::chrono::duration_cast<clock::duration>(seconds(1.0 / m_framerate));
 		i = (i+1) % m_height;
 	}
 }
@@ -872,7 +1265,7 @@ void AudioCamera::start_recording(const std::vector<std::string>& folders, bool
 		rec->stop();
 		rec->start(filename.string().c_str());
 
-		m_recording = true;
+		set_recording(true);
 	}
 }
 
@@ -903,7 +1296,7 @@ void AudioCamera::stop_recording()
 
 		rec->start(0); // start streaming without recording
 		
-		m_recording = false;
+		set_recording(false);
 	}
 }
 
@@ -7,10 +7,18 @@
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 
 #include "json.hpp"
 #include "color_correction.hpp"
 #include "audio.hpp"
+#include "frame_pool.hpp"
+#include "focus_peak.hpp"
+#include "image_stats.hpp"
+#include "preroll.hpp"
+#include "latency_stats.hpp"
 
 #include <opencv2/highgui.hpp>
 
@@ -60,6 +68,77 @@ private:
 	T values[maxValueCount];
 };
 
+template <typename T>
+class LatestFrameMailbox
+{
+	// Single slot handoff between the capture thread and a slower consumer thread.
+	// publish() never waits for the consumer, an item that was not consumed yet is replaced by the newer one.
+	// Items are exchanged with std::swap, so the caller gets back an older item it can reuse.
+public:
+	LatestFrameMailbox() : m_has_item(false), m_closed(false) {}
+
+	void publish(T& item)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::swap(m_item, item);
+			m_has_item = true;
+		}
+		m_cond.notify_one();
+	}
+
+	bool wait(T& item)
+	{
+		// Blocks until an item is available, returns false once the mailbox is closed
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() { return m_has_item || m_closed; });
+		if (m_closed)
+			return false;
+		std::swap(m_item, item);
+		m_has_item = false;
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+		m_cond.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	T m_item;
+	bool m_has_item;
+	bool m_closed;
+};
+
+struct PreviewFrame
+{
+	PreviewFrame() : black_level(0), bitcount(8), index(0) {}
+
+	FrameRef frame;
+	int black_level;
+	int bitcount;
+	int index; // m_image_counter of the frame
+};
+
+struct EncodedImageCache
+{
+	// JPEG bytes of a preview image, so that each preview is encoded at most once no matter how many clients read it.
+	// Cleared whenever the preview image is replaced, because m_image_counter restarts with each acquisition.
+	EncodedImageCache() : frame_index(-1) {}
+
+	void clear() { frame_index = -1; jpeg.clear(); }
+	bool valid_for(int index) const { return frame_index >= 0 && frame_index == index; }
+
+	int frame_index;
+	std::vector<unsigned char> jpeg;
+};
+
 class Camera
 {
 public:
@@ -73,6 +152,7 @@ public:
 	}
 
 	void got_image(cv::Mat img, double ts, int width, int height, int bitcount, int channels, int black_level=0);
+	void got_image(const FrameRef& frame, double ts, int bitcount, int channels, int black_level=0);
 	void got_frame_timeout(); // an image was not recieved
 
 	virtual void set_hardware_sync(bool enable, int framerate)
@@ -101,18 +181,32 @@ public:
 	}
 	virtual void param_set(const char * name, float value) {
 		// Sets the value of this parameter on the camera
+		std::lock_guard<std::mutex> lock(m_params_mutex);
 		m_params[name] = CameraParameter(value);
+		invalidate_params_cache();
 	}
 	virtual float param_get(const char * name) {
 		// Reads the value of this parameter on the camera
+		std::lock_guard<std::mutex> lock(m_params_mutex);
 		if (m_params.count(name)>0)
 			return m_params[name].last_value;
 		return 0.0f;
 	}
 
+	// Status and summary readers use a snapshot of the parameters instead of param_get, which may go to the camera
+	// and compete with the capture thread. The snapshot is refreshed by the poller thread of the CaptureNode:
+	// volatile parameters (temperatures) periodically, the others only after a write invalidated the cache.
+	typedef std::map<std::string, CameraParameter> ParamMap;
+	std::shared_ptr<const ParamMap> params_cached() const; // never null, empty until the first poll
+	void invalidate_params_cache() { m_params_dirty = true; }
+	void poll_params(double volatile_period); // called by the poller thread only
+	virtual bool param_is_volatile(const std::string& name) const { return false; }
+
 	virtual void start_capture()
 	{
 		// Start Capturing Frames and storing the preview image
+		FramePool::Instance().reserve(this, m_width, m_height, m_bitcount > 8 ? CV_16UC1 : CV_8UC1, 8); // on top of the other cameras
+		m_preroll.clear(); // the format of the frames may have changed
 		m_effective_fps = 0;
 		ts_d.clear();
 		m_capturing = true;
@@ -123,6 +217,7 @@ public:
 		// Stop Capturing Frames
 		m_effective_fps = 0;
 		m_capturing = false;
+		m_preroll.clear();
 	}
 
 	virtual bool is_valid() const { return true; } // If a camera becomes invalid it will be removed
@@ -138,7 +233,11 @@ public:
 
 	virtual bool is_audio_only() const { return false; }
 
+	// Frame and state notifications, for orchestration code that needs to wait on the capture thread
+	unsigned long long frame_sequence() const; // number of frames received since the camera was created, never reset
+	bool wait_for_frame(unsigned long long sequence, double timeout_s); // returns false if frame_sequence() did not reach sequence in time
 	bool block_until_next_frame(double timeout_s);
+	bool wait_recording_done(double timeout_s=-1.0); // negative timeout waits forever
 
 	std::string toString() const;
 	std::string unique_id() const { return m_unique_id; }
@@ -159,10 +258,25 @@ public:
 	int encoding_buffers_used() const { return m_encoding_buffers_used; }
 	int writing_buffers_used() const { return m_writing_buffers_used; }
 
-	bool get_preview_image(std::vector<unsigned char>& buf, bool* pIsHistogram=0);
+	bool get_preview_image(std::vector<unsigned char>& buf);
+	std::shared_ptr<const ImageStats> image_stats() const { return std::atomic_load(&m_image_stats); } // only while display_histogram is enabled
+	const LatencyStats& latency_stats() const { return *m_latency; } // since the start of the last recording
 	bool get_large_preview_image(std::vector<unsigned char>& buf);
 
-	void set_display_focus_peak(bool e) { m_display_focus_peak = e&(!is_audio_only()); }
+	// A full resolution snapshot is only kept while clients keep asking for it, for this many seconds after the last request
+	void set_large_preview_window(double seconds) { m_large_preview_window = seconds; }
+
+	// Pre-roll: the frames of the last seconds before a continuous recording is triggered are recorded ahead of the live frames
+	size_t preroll_bytes(double seconds) const; // memory needed to hold this many seconds of frames
+	void set_preroll(double seconds, size_t max_bytes); // the ring is limited to max_bytes, 0 seconds disables it
+	size_t preroll_capacity() const { return m_preroll.capacity(); } // in frames
+	bool preroll_outdated() const; // the ring was sized for another frame size or bit depth, set_preroll again
+
+	void set_preview_hz(double hz) { m_preview_hz = hz; } // 0 to generate a preview for every frame
+	double preview_hz() const { return m_preview_hz; }
+
+	void set_display_focus_peak(bool e) { m_display_focus_peak = e&(!is_audio_only()); if (!m_display_focus_peak) m_sharpness = -1.0f; }
+	float sharpness() const { return m_sharpness; } // focus score computed by the focus peak, -1 when not available
 	void set_display_overexposed(bool e) { m_display_overexposed = e&(!is_audio_only());; }
 	void set_display_histogram(bool e) { m_display_histogram = e&(!is_audio_only());; }
 
@@ -172,6 +286,17 @@ public:
 	void updateColorBalance(double r, double g, double b);
 
 	void set_record_as_raw(bool raw) {m_record_as_raw = raw;}
+	void set_record_staged(bool staged) {m_record_staged = staged;} // continuous recordings go through the StagingArena
+	void set_take_estimate(double seconds, double compression_ratio); // to preallocate the files of continuous recordings
+	void set_codec(const std::string& codec, int level) { // of the .ava recordings, see FrameCodec
+		std::lock_guard<std::mutex> lock(m_codec_mutex);
+		m_codec = codec;
+		m_codec_level = level;
+	}
+	void set_frame_filters(unsigned int filters) { // frame_filters::Filter flags, applied before the codec
+		std::lock_guard<std::mutex> lock(m_codec_mutex);
+		m_frame_filters = filters;
+	}
 
 	shared_json_doc last_summary() { return m_last_summary; }
 
@@ -216,6 +341,13 @@ protected:
 	int m_image_counter;
 
 	bool m_record_as_raw;
+	bool m_record_staged;
+	double m_planned_take_seconds;
+	double m_expected_compression;
+	std::string m_codec;
+	int m_codec_level; // 0 for the default of the codec
+	unsigned int m_frame_filters;
+	std::mutex m_codec_mutex; // guards m_codec, m_codec_level and m_frame_filters, set from the parameter thread
 
 	double m_start_ts;
 	double m_last_ts;
@@ -227,18 +359,58 @@ protected:
 
 	CircularBuffer<double, 10> ts_d;
 
+	void set_recording(bool recording); // wakes up the threads waiting in wait_recording_done
+
+	void append_to_recorders(const FrameRef& frame, double ts, int black_level);
+	void drain_preroll(int max_buffers_used); // record pre-roll frames while the encoders are below max_buffers_used %
+
+	std::shared_ptr<LatencyStats> m_latency; // shared with the recorders and their writers
+	double m_delivery_offset; // smallest host arrival - sensor timestamp since the counter was reset
+
+	PreRollRing m_preroll;
+	double m_preroll_seconds; // last set_preroll
+	size_t m_preroll_frame_bytes; // frame size the ring was sized for
+	bool m_recording_preroll; // the current recording starts with the pre-roll
+	size_t m_preroll_frames_in_take;
+
+	mutable std::mutex m_mutex_frame_event;
+	std::condition_variable m_frame_event; // signaled for each new frame and when recording stops
+	unsigned long long m_frame_sequence;
+
+	// Preview images are generated on their own thread, fed with the latest captured frame
+	bool preview_due(double frame_timestamp);
+	void preview_thread();
+	void generate_preview(const PreviewFrame& frame);
+	void store_preview_image(const cv::Mat& img, int index);
+
+	LatestFrameMailbox<PreviewFrame> m_preview_mailbox;
+	PreviewFrame m_preview_spare; // owned by the capture thread
+	boost::thread m_preview_thread;
+	double m_preview_hz;
+	double m_next_preview_ts;
+
 	// Small preview stream when we are not recording
 	std::mutex m_mutex_preview_image;
 	cv::Mat preview_image;
-	bool preview_image_is_histogram;
+	int preview_image_index;
+	EncodedImageCache preview_jpeg;
+	std::shared_ptr<const ImageStats> m_image_stats; // replaced atomically by the preview thread
 
-	// Large preview image when we are not recording
+	// Large preview image when we are not recording, only stored on demand
 	std::mutex m_mutex_large_preview_image;
+	std::condition_variable m_large_preview_cond;
 	cv::Mat large_preview_image;
+	FrameRef large_preview_frame; // keeps the pooled memory of large_preview_image alive
 	int large_preview_image_black_point;
+	int large_preview_index;
+	EncodedImageCache large_preview_jpeg; // guarded by m_mutex_large_preview_image
+	std::mutex m_mutex_large_preview_encode; // only one client encodes a given snapshot, the others wait for the cached result
+	std::chrono::steady_clock::time_point large_preview_time; // when the snapshot was taken
+	std::chrono::steady_clock::time_point large_preview_demand_until; // snapshots are taken until then
+	double m_large_preview_window;
 	
 	// Store first frame of each recording
-	cv::Mat recording_first_frame;
+	FrameRef recording_first_frame;
 	int recording_first_frame_black_level;
 	int recording_first_frame_index;
 
@@ -247,11 +419,15 @@ protected:
 	std::vector<std::shared_ptr<Recorder> > m_recorders;
 
 	std::map<std::string, CameraParameter> m_params;
+	std::mutex m_params_mutex; // guards m_params
 
-	// work space for focus peak
-	cv::Mat focus_peak_buffer[4];
-	int focus_peak_buffer_index;
-	int focus_peak_buffer_count;
+	std::shared_ptr<const ParamMap> m_params_cache; // accessed with std::atomic_load/atomic_store
+	std::atomic<bool> m_params_dirty;
+	std::chrono::steady_clock::time_point m_params_polled; // last refresh of the volatile parameters
+
+	// work space for focus peak, only used by the preview thread
+	FocusPeak m_focus_peak;
+	std::atomic<float> m_sharpness;
 };
 
 class WebcamCamera : public Camera
@@ -272,21 +448,44 @@ private:
 	boost::thread capture_thread;
 };
 
+struct DummyCameraSettings
+{
+	DummyCameraSettings() : count(2), width(320), height(200), bitcount(8), bayer_pattern(-1), framerate(10), noise_bits(4) {}
+
+	int count;
+	int width;
+	int height;
+	int bitcount; // 8..16, stored as 16 bit above 8
+	int bayer_pattern; // cv::COLOR_BayerXX2RGB, -1 for a mono camera
+	int framerate;
+	int noise_bits; // random bits added to each pixel, from 0 (smooth texture, compresses well) to bitcount (incompressible)
+};
+
 class DummyCamera : public Camera
 {
 public:
-	DummyCamera(int id);
+	DummyCamera(int id, const DummyCameraSettings& settings = DummyCameraSettings());
 
-	static std::vector<std::shared_ptr<Camera> > get_dummy_cameras(int count);
+	static std::vector<std::shared_ptr<Camera> > get_dummy_cameras(const DummyCameraSettings& settings = DummyCameraSettings());
 
 protected:
 	void captureThread();
 	void start_capture() override;
 	void stop_capture() override;
 
+	void generate_texture();
+	void render_frame(cv::Mat& dst, int frame_index);
+
 private:
 	int m_id;
+	int m_noise_bits;
 	boost::thread capture_thread;
+
+	// Synthetic image: a static texture, plus noise read at a random offset of a larger buffer for each frame.
+	// Both are stored in the pixel format of the frames.
+	std::vector<unsigned char> m_texture;
+	std::vector<unsigned char> m_noise;
+	unsigned long long m_rng_state;
 };
 
 #ifdef WITH_PORTAUDIO
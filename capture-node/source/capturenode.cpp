@@ -6,6 +6,12 @@
 #include "drivebench.hpp"
 #include "json.hpp"
 #include "embedded_python.hpp"
+#include "thread_config.hpp"
+#include "staging_arena.hpp"
+#include "direct_file.hpp"
+#include "frame_pool.hpp"
+#include "frame_codec.hpp"
+#include "frame_filters.hpp"
 
 #include <boost/filesystem.hpp>
 
@@ -13,9 +19,12 @@
 #include <iostream>
 #include <iterator>
 
+static const int PARAM_POLL_INTERVAL_MS = 250; // how soon a written parameter shows up in the cache
+static const double PARAM_VOLATILE_PERIOD = 5.0; // seconds between reads of the temperatures
+
 CaptureNode::CaptureNode(
 	bool initializeWebcams, bool initializeAudio, bool initializeDummyCam, 
-	const std::vector<std::string>& recording_folders) 
+	const std::vector<std::string>& recording_folders, const DummyCameraSettings& dummy_settings) 
 	: StateMachine<CaptureNodeState>(STATE_UNKNOWN), m_sync_active(false), m_shutdownrequested(false)
 {
 	m_external_sync_preview = false;
@@ -30,6 +39,12 @@ CaptureNode::CaptureNode(
 
 	m_bitdepth_default = 8;
 	m_bitdepth_maximum = 8;
+
+	m_preroll_seconds = 0.0; // disabled
+	m_preroll_dirty = false;
+	m_preroll_budget = (size_t)2048 * 1024 * 1024;
+	m_planned_take_seconds = 60.0;
+	m_expected_compression = 2.0; // typical LZ4 ratio on raw bayer images
 	m_image_format_raw = false;
 
 	std::cout << "Initializing hardware sync..." << std::endl;
@@ -101,7 +116,7 @@ CaptureNode::CaptureNode(
 	// Initialize a dummy camera for testing
 	if (initializeDummyCam)
 	{ 
-		std::vector<std::shared_ptr<Camera> > dummy_cameras = DummyCamera::get_dummy_cameras(2);
+		std::vector<std::shared_ptr<Camera> > dummy_cameras = DummyCamera::get_dummy_cameras(dummy_settings);
 		std::copy(dummy_cameras.begin(), dummy_cameras.end(), std::back_inserter(m_cameras));
 	}
 
@@ -114,17 +129,53 @@ CaptureNode::CaptureNode(
 	}
 #endif
 
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		publish_cameras();
+	}
+
 	CaptureNode::scan_for_new_devices();
 
+	m_param_thread_stop = false;
+	m_param_thread = boost::thread(&CaptureNode::param_poll_thread, this);
+
 	GotoState(STATE_PREVIEW);
 }
 
 CaptureNode::~CaptureNode()
 {
+	m_param_thread_stop = true;
+	m_param_thread.join();
+
 	for (std::shared_ptr<Camera>& cam : m_cameras)
 		cam->stop_capture();
 }
 
+void CaptureNode::param_poll_thread()
+{
+	// Reading parameters takes the camera locks, keep out of the way of the capture threads
+	ThreadConfig::WorkerThreadScope thread_scope;
+	ThreadConfig::lower_current_thread_priority();
+
+	while (!m_param_thread_stop)
+	{
+		bool preroll_outdated = m_preroll_dirty.exchange(false);
+		for (auto& cam : cameraList())
+		{
+			if (cam->is_valid())
+				cam->poll_params(PARAM_VOLATILE_PERIOD);
+
+			// Bit depth or ROI changed: same budget, another number of frames
+			if (cam->preroll_outdated() && !cam->recording())
+				preroll_outdated = true;
+		}
+		if (preroll_outdated)
+			configure_preroll();
+
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(PARAM_POLL_INTERVAL_MS));
+	}
+}
+
 bool CaptureNode::sync_connected() const 
 { 
 	return (m_sync.get() && m_sync->isOK()); 
@@ -135,9 +186,12 @@ void CaptureNode::remove_invalid_devices()
 	std::lock_guard<std::mutex> lock(m_mutex);
 
 	// Remove any camera that has become invalid (and is not recording)
+	const size_t count = m_cameras.size();
 	m_cameras.erase(
 		std::remove_if(m_cameras.begin(), m_cameras.end(), [](std::shared_ptr<Camera>& it) {return !it->is_valid(); }),
 		m_cameras.end());
+	if (m_cameras.size() != count)
+		publish_cameras();
 }
 
 size_t CaptureNode::scan_for_new_devices()
@@ -169,11 +223,20 @@ size_t CaptureNode::scan_for_new_devices()
 		// New cameras
 		new_count = new_ximea_cameras.size();
 		std::copy(new_ximea_cameras.begin(), new_ximea_cameras.end(), std::back_inserter(m_cameras));
+		publish_cameras();
 	}
 
 	return new_count;
 }
 
+void CaptureNode::add_cameras(const std::vector<std::shared_ptr<Camera> >& cameras)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::copy(cameras.begin(), cameras.end(), std::back_inserter(m_cameras));
+	publish_cameras();
+}
+
 void CaptureNode::setGlobalParams(const std::string& json)
 {
 	if (json.empty())
@@ -202,6 +265,23 @@ void CaptureNode::setGlobalParams(const std::string& json)
 		for (auto& cam : m_cameras)
 			cam->set_display_histogram(doc["display_histogram"].GetBool());
 	}
+	if (doc.HasMember("threads"))
+	{
+		// Scheduling policy and CPU/NUMA placement of the capture and worker threads
+		ThreadConfig::Instance().configure(doc["threads"]);
+	}
+	if (doc.HasMember("preview_hz") && doc["preview_hz"].IsNumber())
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& cam : m_cameras)
+			cam->set_preview_hz(doc["preview_hz"].GetDouble());
+	}
+	if (doc.HasMember("large_preview_window") && doc["large_preview_window"].IsNumber())
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& cam : m_cameras)
+			cam->set_large_preview_window(doc["large_preview_window"].GetDouble());
+	}
 	if (doc.HasMember("bitdepth_avi"))
 	{
 		if (doc["bitdepth_avi"].GetInt() != m_bitdepth_default)
@@ -264,6 +344,27 @@ void CaptureNode::setGlobalParams(const std::string& json)
 			cam->set_hardware_sync_freq(sync_freq);
 	}
 
+	// Codec of the .ava recordings, for all the cameras unless camera_params has another one
+	auto codec_available = [](const std::string& codec) {
+		if (FrameCodec::create(codec))
+			return true;
+		std::cerr << "Codec " << codec << " is not available" << std::endl;
+		return false;
+	};
+	if (doc.HasMember("codec") && doc["codec"].IsString() && codec_available(doc["codec"].GetString()))
+	{
+		const int level = doc.HasMember("codec_level") && doc["codec_level"].IsInt() ? doc["codec_level"].GetInt() : 0;
+		for (auto& cam : cameraList())
+			cam->set_codec(doc["codec"].GetString(), level);
+	}
+	if (doc.HasMember("frame_filters") && doc["frame_filters"].IsString())
+	{
+		// Reversible transforms before the codec, "bayer,delta,shuffle" or "" for none
+		const unsigned int filters = frame_filters::parse(doc["frame_filters"].GetString());
+		for (auto& cam : cameraList())
+			cam->set_frame_filters(filters);
+	}
+
 	if (doc.HasMember("camera_params") && doc["camera_params"].IsArray())
 	{
 		const rapidjson::Value& params = doc["camera_params"];
@@ -286,6 +387,24 @@ void CaptureNode::setGlobalParams(const std::string& json)
 						{
 							it->set_hardware_sync(itr->value.GetBool(), global_framerate());
 						}
+						else if (itr->value.IsNumber() && (strcmp(itr->name.GetString(),"preview_hz"))==0) // special case, overrides the node-wide rate
+						{
+							it->set_preview_hz(itr->value.GetDouble());
+						}
+						else if (itr->value.IsString() && (strcmp(itr->name.GetString(),"codec"))==0) // special case, with codec_level
+						{
+							const int level = params[i].HasMember("codec_level") && params[i]["codec_level"].IsInt() ? params[i]["codec_level"].GetInt() : 0;
+							if (codec_available(itr->value.GetString()))
+								it->set_codec(itr->value.GetString(), level);
+						}
+						else if (itr->value.IsString() && (strcmp(itr->name.GetString(),"frame_filters"))==0) // special case
+						{
+							it->set_frame_filters(frame_filters::parse(itr->value.GetString()));
+						}
+						else if (strcmp(itr->name.GetString(),"codec_level")==0)
+						{
+							// applied with codec
+						}
 						else if (itr->value.IsDouble())
 						{
 							it->param_set(itr->name.GetString(), itr->value.GetDouble());
@@ -300,23 +419,102 @@ void CaptureNode::setGlobalParams(const std::string& json)
 			}
 		}
 	}
-}
 
-std::shared_ptr<Camera> CaptureNode::cameraById(const char * unique_id)
-{
-	for (auto c : m_cameras)
+	if (doc.HasMember("frame_pool_mb") && doc["frame_pool_mb"].IsNumber())
 	{
-		if (c->unique_id() == unique_id)
-			return c;
+		// Limit of the image memory of all the cameras (captured frames, pre-roll, frames waiting for the writers),
+		// frames are dropped when it is reached. 0 for no limit.
+		FramePool::Instance().set_budget((size_t)(doc["frame_pool_mb"].GetDouble() * 1024 * 1024));
 	}
-	return std::shared_ptr<Camera>();
+
+	if (doc.HasMember("staging_mb") && doc["staging_mb"].IsNumber())
+	{
+		// Memory arena for takes that are recorded faster than the drives can write, 0 to disable
+		StagingArena::Instance().configure((size_t)(doc["staging_mb"].GetDouble() * 1024 * 1024));
+	}
+
+	if (doc.HasMember("direct_io") && doc["direct_io"].IsBool())
+	{
+		// Recordings bypass the page cache, applies to the files opened from now on
+		DirectFile::set_direct_io(doc["direct_io"].GetBool());
+	}
+
+	if (doc.HasMember("preroll_seconds") && doc["preroll_seconds"].IsNumber())
+	{
+		m_preroll_seconds = doc["preroll_seconds"].GetDouble();
+	}
+	if (doc.HasMember("preroll_budget_mb") && doc["preroll_budget_mb"].IsNumber())
+	{
+		m_preroll_budget = (size_t)(doc["preroll_budget_mb"].GetDouble() * 1024 * 1024);
+	}
+
+	if (doc.HasMember("planned_take_seconds") && doc["planned_take_seconds"].IsNumber())
+	{
+		m_planned_take_seconds = doc["planned_take_seconds"].GetDouble();
+	}
+	if (doc.HasMember("expected_compression_ratio") && doc["expected_compression_ratio"].IsNumber())
+	{
+		m_expected_compression = doc["expected_compression_ratio"].GetDouble();
+	}
+
+	// Sized last, once the framerate and the bit depth of the cameras are known
+	configure_preroll();
 }
 
-const std::vector<std::shared_ptr<Camera> > CaptureNode::cameraList()
-{ 
+void CaptureNode::configure_preroll()
+{
+	// Split the node-wide budget between the cameras, in proportion to what each one needs for m_preroll_seconds
 	std::lock_guard<std::mutex> lock(m_mutex);
 
-	return  std::vector<std::shared_ptr<Camera> >(m_cameras);
+	size_t needed = 0;
+	for (auto& cam : m_cameras)
+		needed += cam->preroll_bytes(m_preroll_seconds);
+
+	const double share = needed > m_preroll_budget ? (double)m_preroll_budget / needed : 1.0;
+	if (share < 1.0)
+		std::cerr << "Pre-roll of " << m_preroll_seconds << "s needs " << (needed / 1024 / 1024) << " MB, limited to " << (m_preroll_budget / 1024 / 1024) << " MB" << std::endl;
+
+	for (auto& cam : m_cameras)
+		if (!cam->recording()) // do not drop a ring that is being recorded
+			cam->set_preroll(m_preroll_seconds, (size_t)(cam->preroll_bytes(m_preroll_seconds) * share));
+}
+
+CameraList::CameraList() : m_snapshot(std::make_shared<Snapshot>())
+{
+}
+
+CameraList::CameraList(const std::vector<std::shared_ptr<Camera> >& cameras)
+{
+	std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+	snapshot->cameras = cameras;
+	for (auto& cam : cameras)
+		snapshot->by_id.insert(std::make_pair(cam->unique_id(), cam)); // the first camera wins, as the linear search did
+	m_snapshot = snapshot;
+}
+
+std::shared_ptr<Camera> CameraList::find(const std::string& unique_id) const
+{
+	auto it = m_snapshot->by_id.find(unique_id);
+	if (it != m_snapshot->by_id.end())
+		return it->second;
+	return std::shared_ptr<Camera>();
+}
+
+void CaptureNode::publish_cameras()
+{
+	// Readers keep the snapshot they already have, the new one is visible to the next cameraList() or cameraById()
+	std::atomic_store(&m_camera_list, std::shared_ptr<const CameraList>(std::make_shared<CameraList>(m_cameras)));
+	m_preroll_dirty = true; // share of the budget of each camera
+}
+
+std::shared_ptr<Camera> CaptureNode::cameraById(const char * unique_id) const
+{
+	return std::atomic_load(&m_camera_list)->find(unique_id);
+}
+
+CameraList CaptureNode::cameraList() const
+{ 
+	return *std::atomic_load(&m_camera_list);
 }
 
 std::string CaptureNode::sync_port() const
@@ -502,11 +700,7 @@ void CaptureNode::finalize_single()
 	// Block until cameras have stopped recording
 	{
 		for (auto& cam : m_recording_cameras)
-		{
-			while (cam->recording()) {
-				boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
-			}
-		}
+			cam->wait_recording_done();
 	}
 	
 	for (auto& cam : m_recording_cameras)
@@ -560,6 +754,8 @@ void CaptureNode::prepare_multi_stage1()
 				//cam->set_bitdepth(m_bitdepth_default);
 
 				cam->set_record_as_raw(true); // TODO Option to choose between .ava and .avi
+				cam->set_record_staged(StagingArena::Instance().enabled());
+				cam->set_take_estimate(m_planned_take_seconds, m_expected_compression);
 
 				int nthreads = (int)(1 + (cam->bandwidth() / 1024 / 1024 / m_bandwidth_per_thread));
 
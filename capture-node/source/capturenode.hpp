@@ -9,6 +9,8 @@
 #include <memory>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <unordered_map>
 
 enum CaptureNodeState
 {
@@ -36,15 +38,42 @@ enum CaptureNodeState
 
 static const char * stateToString(CaptureNodeState s);
 
+class CameraList
+{
+	// Immutable snapshot of the cameras of a node, with an index by unique id. CaptureNode publishes a new snapshot
+	// whenever cameras are added or removed, readers keep iterating the one they got without any lock.
+public:
+	typedef std::vector<std::shared_ptr<Camera> >::const_iterator const_iterator;
+
+	CameraList();
+	explicit CameraList(const std::vector<std::shared_ptr<Camera> >& cameras);
+
+	const_iterator begin() const { return m_snapshot->cameras.begin(); }
+	const_iterator end() const { return m_snapshot->cameras.end(); }
+	size_t size() const { return m_snapshot->cameras.size(); }
+	bool empty() const { return m_snapshot->cameras.empty(); }
+
+	std::shared_ptr<Camera> find(const std::string& unique_id) const; // null if there is no such camera
+
+private:
+	struct Snapshot
+	{
+		std::vector<std::shared_ptr<Camera> > cameras;
+		std::unordered_map<std::string, std::shared_ptr<Camera> > by_id;
+	};
+	std::shared_ptr<const Snapshot> m_snapshot;
+};
+
 class CaptureNode : public StateMachine<CaptureNodeState>
 {
 public:
 	CaptureNode(bool initializeWebcams, bool initializeAudio, bool initializeDummyCam, 
-		const std::vector<std::string>& recording_folders = std::vector<std::string>());
+		const std::vector<std::string>& recording_folders = std::vector<std::string>(),
+		const DummyCameraSettings& dummy_settings = DummyCameraSettings());
 	~CaptureNode();
 
-	const std::vector<std::shared_ptr<Camera> > cameraList();
-	std::shared_ptr<Camera> cameraById(const char * unique_id);
+	CameraList cameraList() const; // lock-free
+	std::shared_ptr<Camera> cameraById(const char * unique_id) const; // lock-free
 
 	void setGlobalParams(const std::string& json);
 
@@ -81,6 +110,7 @@ public:
 	bool shutdown_requested() const { return m_shutdownrequested; }
 
 	size_t scan_for_new_devices();
+	void add_cameras(const std::vector<std::shared_ptr<Camera> >& cameras); // cameras that are not discovered by scan_for_new_devices
 	void remove_invalid_devices();
 
 	bool can_record() const;
@@ -97,6 +127,12 @@ protected:
 
 	std::vector<std::string> get_take_recording_folders();
 
+	void configure_preroll(); // after the camera list, the pre-roll settings or the frame format of a camera changed
+
+	void param_poll_thread(); // refreshes the parameter cache of the cameras
+
+	void publish_cameras(); // called with m_mutex locked, after m_cameras changed
+
 private:
 	bool m_first_update_sent;
 	size_t m_minimim_drive_speed;
@@ -112,7 +148,14 @@ private:
 	int m_burstCount;
 	bool m_image_format_raw;
 
-	std::vector<std::shared_ptr<Camera> > m_cameras;
+	double m_preroll_seconds;
+	size_t m_preroll_budget; // bytes, for the pre-roll rings of all the cameras
+
+	double m_planned_take_seconds; // expected duration of continuous takes, to preallocate the files
+	double m_expected_compression;
+
+	std::vector<std::shared_ptr<Camera> > m_cameras; // guarded by m_mutex, readers use m_camera_list
+	std::shared_ptr<const CameraList> m_camera_list; // accessed with std::atomic_load/atomic_store
 	std::vector<std::shared_ptr<Camera> > m_recording_cameras; // cameras currently recording
 
 	std::shared_ptr<class IHardwareSync> m_sync;
@@ -123,5 +166,9 @@ private:
 
 	bool m_shutdownrequested;
 
+	boost::thread m_param_thread;
+	std::atomic<bool> m_param_thread_stop;
+	std::atomic<bool> m_preroll_dirty; // the camera list changed, the poller thread sizes the pre-roll rings again
+
 	shared_json_doc m_last_summary;
 };
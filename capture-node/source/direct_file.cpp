@@ -0,0 +1,599 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "direct_file.hpp"
+#include "thread_config.hpp"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#ifdef WIN32
+	#include <windows.h>
+	#include <malloc.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+#endif
+
+#ifdef WITH_LIBURING
+	#include <liburing.h>
+#endif
+
+const size_t DirectFile::alignment;
+const size_t DirectFile::buffer_size;
+const int DirectFile::queue_depth;
+
+static const int POOL_THREADS = 8; // pwrite threads shared by all the files, when io_uring is not available
+
+static std::atomic<bool> s_direct_io(true);
+
+static unsigned char * allocate_aligned(size_t size)
+{
+#ifdef WIN32
+	return (unsigned char *)_aligned_malloc(size, DirectFile::alignment);
+#else
+	void * p = 0;
+	if (posix_memalign(&p, DirectFile::alignment, size) != 0)
+		return 0;
+	return (unsigned char *)p;
+#endif
+}
+
+static void free_aligned(unsigned char * p)
+{
+#ifdef WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static bool write_at_offset(DirectFile::native_file fd, const void * data, size_t size, uint64_t offset)
+{
+#ifdef WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD written = 0;
+	return WriteFile(fd, data, (DWORD)size, &written, &ov) && written == size;
+#else
+	const unsigned char * p = (const unsigned char *)data;
+	while (size)
+	{
+		ssize_t n = ::pwrite(fd, p, size, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+#endif
+}
+
+class DirectWritePool
+{
+	// Threads shared by all the DirectFiles that do not use io_uring, each thread has one write in flight
+public:
+	static DirectWritePool& Instance()
+	{
+		static DirectWritePool instance;
+		return instance;
+	}
+
+	~DirectWritePool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		m_threads.join_all();
+	}
+
+	void write(DirectFile * file, int index)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back(std::make_pair(file, index));
+		}
+		m_cond.notify_one();
+	}
+
+protected:
+	DirectWritePool() : m_stop(false)
+	{
+		for (int i = 0; i < POOL_THREADS; i++)
+			m_threads.create_thread([this]() { run(); });
+	}
+
+private:
+	void run()
+	{
+		ThreadConfig::WorkerThreadScope thread_scope;
+
+		while (true)
+		{
+			std::pair<DirectFile *, int> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait(lock, [this]() { return !m_jobs.empty() || m_stop; });
+				if (m_jobs.empty())
+					return;
+				job = m_jobs.front();
+				m_jobs.pop_front();
+			}
+
+			const DirectFile::Buffer& b = job.first->m_buffers[job.second];
+			const bool ok = write_at_offset(job.first->m_fd, b.data, b.fill, b.offset);
+			job.first->completed(job.second, ok);
+		}
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<std::pair<DirectFile *, int> > m_jobs;
+	bool m_stop;
+	boost::thread_group m_threads;
+};
+
+void DirectFile::set_direct_io(bool enabled)
+{
+	s_direct_io = enabled;
+}
+
+bool DirectFile::direct_io()
+{
+	return s_direct_io;
+}
+
+DirectFile::DirectFile()
+	: m_open(false), m_direct(false), m_uring(false), m_failed(false), m_current(0), m_size(0), m_in_flight(0),
+	m_submitted_end(0), m_durable(0), m_allocated(0), m_extent(0), m_ring(0)
+{
+#ifdef WIN32
+	m_fd = INVALID_HANDLE_VALUE;
+	m_patch_fd = INVALID_HANDLE_VALUE;
+#else
+	m_fd = -1;
+	m_patch_fd = -1;
+#endif
+}
+
+DirectFile::~DirectFile()
+{
+	if (m_open)
+		close();
+}
+
+bool DirectFile::is_open() const
+{
+	return m_open;
+}
+
+const char * DirectFile::backend() const
+{
+	if (m_uring)
+		return m_direct ? "io_uring, O_DIRECT" : "io_uring";
+	return m_direct ? "pwrite, O_DIRECT" : "pwrite";
+}
+
+bool DirectFile::open(const std::string& filename)
+{
+	m_filename = filename;
+	m_failed = false;
+	m_size = 0;
+	m_in_flight = 0;
+	m_submitted_end = 0;
+	m_durable = 0;
+	m_allocated = 0;
+	m_extent = 0;
+
+#ifdef WIN32
+	m_fd = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_fd == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "DirectFile> Could not open " << filename << std::endl;
+		return false;
+	}
+	m_direct = false;
+#else
+	m_direct = false;
+	if (direct_io())
+	{
+		m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		m_direct = m_fd >= 0;
+	}
+	if (m_fd < 0)
+		m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644); // some file systems (tmpfs) do not support O_DIRECT
+	if (m_fd < 0)
+	{
+		std::cerr << "DirectFile> Could not open " << filename << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+#endif
+
+	// One buffer being filled, the others in flight
+	m_buffers.resize(queue_depth + 1);
+	for (auto& b : m_buffers)
+	{
+		b.data = allocate_aligned(buffer_size);
+		b.fill = 0;
+		b.offset = 0;
+		b.in_flight = false;
+		if (!b.data)
+		{
+			std::cerr << "DirectFile> Could not allocate staging buffers for " << filename << std::endl;
+			m_failed = true;
+		}
+	}
+	m_current = 0;
+
+#ifdef WITH_LIBURING
+	m_ring = new io_uring;
+	if (io_uring_queue_init(queue_depth, m_ring, 0) == 0)
+	{
+		m_uring = true;
+	}
+	else
+	{
+		delete m_ring; // kernel without io_uring, or not allowed in this process
+		m_ring = 0;
+	}
+#endif
+
+	m_open = true;
+
+	if (m_failed)
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+bool DirectFile::write(const void * data, size_t size)
+{
+	if (!m_open || m_failed)
+		return false;
+
+	if (m_uring && m_in_flight)
+		reap_ready(); // otherwise completions are only seen when a buffer is needed again
+
+	const unsigned char * p = (const unsigned char *)data;
+	while (size)
+	{
+		Buffer& b = m_buffers[m_current];
+		const size_t n = std::min(size, buffer_size - b.fill);
+		memcpy(b.data + b.fill, p, n);
+		b.fill += n;
+		p += n;
+		size -= n;
+		m_size += n;
+
+		if (b.fill == buffer_size)
+		{
+			const uint64_t next_offset = b.offset + buffer_size;
+			if (m_extent && next_offset > m_allocated)
+				reserve(next_offset);
+			if (!submit(m_current))
+				return false;
+
+			m_current = (m_current + 1) % (int)m_buffers.size();
+			if (!wait_for_buffer(m_current))
+				return false;
+
+			m_buffers[m_current].fill = 0;
+			m_buffers[m_current].offset = next_offset;
+		}
+	}
+
+	return true;
+}
+
+bool DirectFile::write_at(uint64_t offset, const void * data, size_t size)
+{
+	if (!m_open || m_failed)
+		return false;
+
+	if (offset + size > m_size)
+	{
+		std::cerr << "DirectFile> Cannot patch beyond the end of " << m_filename << std::endl;
+		return false;
+	}
+
+	// The part that is still in the buffer being filled is patched in memory
+	const Buffer& cur = m_buffers[m_current];
+	if (offset + size > cur.offset)
+	{
+		const uint64_t start = std::max(offset, cur.offset);
+		memcpy(cur.data + (start - cur.offset), (const unsigned char *)data + (start - offset), (size_t)(offset + size - start));
+		size = (size_t)(start - offset);
+	}
+	if (!size)
+		return true;
+
+	// The rest was submitted: wait until it is written and overwrite it. Submitted data ends on an aligned offset,
+	// later direct writes never touch the pages written here.
+	if (!wait_all())
+		return false;
+
+	native_file fd = m_fd;
+#ifndef WIN32
+	if (m_direct)
+	{
+		if (m_patch_fd < 0)
+			m_patch_fd = ::open(m_filename.c_str(), O_WRONLY);
+		fd = m_patch_fd;
+	}
+#endif
+
+	if (!write_at_offset(fd, data, size, offset))
+	{
+		std::cerr << "DirectFile> Could not patch " << m_filename << std::endl;
+		m_failed = true;
+		return false;
+	}
+
+	return true;
+}
+
+bool DirectFile::close()
+{
+	if (!m_open)
+		return !m_failed;
+
+	bool ok = wait_all();
+
+	// The last buffer is partial, its size is not aligned: write it without O_DIRECT
+	Buffer& cur = m_buffers[m_current];
+#ifndef WIN32
+	if (m_direct)
+	{
+		int flags = fcntl(m_fd, F_GETFL);
+		if (flags == -1 || fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) == -1)
+			ok = false;
+		m_direct = false;
+	}
+#endif
+	if (ok && cur.fill)
+		ok = write_at_offset(m_fd, cur.data, cur.fill, cur.offset);
+	if (ok && m_on_durable && m_size > m_durable)
+		m_on_durable(m_size);
+
+	// Release the space that was reserved but not used
+	if (m_allocated > m_size)
+	{
+#ifdef WIN32
+		LARGE_INTEGER end;
+		end.QuadPart = (LONGLONG)m_size;
+		if (!SetFilePointerEx(m_fd, end, NULL, FILE_BEGIN) || !SetEndOfFile(m_fd))
+			ok = false;
+#else
+		if (ftruncate(m_fd, (off_t)m_size) != 0)
+			ok = false;
+#endif
+	}
+	m_allocated = 0;
+
+#ifdef WIN32
+	CloseHandle(m_fd);
+	m_fd = INVALID_HANDLE_VALUE;
+#else
+	if (m_patch_fd >= 0)
+		::close(m_patch_fd);
+	m_patch_fd = -1;
+	if (::close(m_fd) != 0)
+		ok = false;
+	m_fd = -1;
+#endif
+
+#ifdef WITH_LIBURING
+	if (m_ring)
+	{
+		io_uring_queue_exit(m_ring);
+		delete m_ring;
+		m_ring = 0;
+	}
+#endif
+	m_uring = false;
+
+	for (auto& b : m_buffers)
+		free_aligned(b.data);
+	m_buffers.clear();
+
+	m_open = false;
+
+	if (!ok && !m_failed)
+		std::cerr << "DirectFile> Could not finish writing " << m_filename << std::endl;
+	if (!ok)
+		m_failed = true;
+
+	return !m_failed;
+}
+
+void DirectFile::preallocate(uint64_t expected_size, uint64_t extent)
+{
+	if (!m_open || m_failed)
+		return;
+
+	m_extent = (extent + buffer_size - 1) / buffer_size * buffer_size;
+	if (expected_size || m_extent)
+		reserve(std::max(expected_size, m_size + buffer_size));
+}
+
+bool DirectFile::reserve(uint64_t end)
+{
+	// Grow by at least one extent, so that the file system is only asked every few seconds of recording
+	const uint64_t size = std::max(end, m_allocated + m_extent) - m_allocated;
+
+#ifdef WIN32
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG)(m_allocated + size);
+	bool ok = SetFileInformationByHandle(m_fd, FileAllocationInfo, &info, sizeof(info)) != 0;
+#elif defined(__linux__)
+	// The file size grows with the reservation, direct writes inside the file size do not update the inode
+	int ret;
+	do {
+		ret = fallocate(m_fd, 0, (off_t)m_allocated, (off_t)size);
+	} while (ret != 0 && errno == EINTR);
+	bool ok = ret == 0;
+#else
+	bool ok = false;
+#endif
+
+	if (!ok)
+	{
+		// Not supported by this file system, or the drive is full: the writes will tell
+		m_extent = 0;
+		return false;
+	}
+
+	m_allocated += size;
+	return true;
+}
+
+bool DirectFile::submit(int index)
+{
+	Buffer& b = m_buffers[index];
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		b.in_flight = true;
+		m_in_flight++;
+		m_submitted_end = b.offset + b.fill;
+	}
+
+#ifdef WITH_LIBURING
+	if (m_uring)
+	{
+		// At most queue_depth buffers are in flight, there is always a free entry
+		io_uring_sqe * sqe = io_uring_get_sqe(m_ring);
+		if (sqe)
+		{
+			io_uring_prep_write(sqe, m_fd, b.data, (unsigned int)b.fill, b.offset);
+			io_uring_sqe_set_data(sqe, (void *)(intptr_t)index);
+		}
+		if (!sqe || io_uring_submit(m_ring) < 0)
+		{
+			completed(index, false);
+			return false;
+		}
+		return true;
+	}
+#endif
+
+	DirectWritePool::Instance().write(this, index);
+	return true;
+}
+
+void DirectFile::completed(int index, bool ok)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_buffers[index].in_flight = false;
+		m_in_flight--;
+		if (!ok && !m_failed)
+		{
+			m_failed = true;
+			std::cerr << "DirectFile> Write failed at offset " << m_buffers[index].offset << " in " << m_filename << std::endl;
+		}
+
+		// Writes complete out of order, all of them did up to the first buffer still in flight
+		uint64_t durable = m_submitted_end;
+		for (const Buffer& b : m_buffers)
+			if (b.in_flight)
+				durable = std::min(durable, b.offset);
+		if (ok && durable > m_durable)
+		{
+			m_durable = durable;
+			if (m_on_durable)
+				m_on_durable(durable);
+		}
+
+		// Still locked: once a waiter sees the buffer done, this thread does not touch the file anymore (close()
+		// may return and the file be destroyed), and the callback has returned
+		m_cond.notify_all();
+	}
+}
+
+bool DirectFile::reap_one()
+{
+#ifdef WITH_LIBURING
+	io_uring_cqe * cqe = 0;
+	int ret = io_uring_wait_cqe(m_ring, &cqe);
+	if (ret == -EINTR)
+		return true;
+	if (ret < 0)
+	{
+		std::cerr << "DirectFile> io_uring wait failed: " << strerror(-ret) << std::endl;
+		return false;
+	}
+
+	reaped(cqe);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void DirectFile::reap_ready()
+{
+#ifdef WITH_LIBURING
+	io_uring_cqe * cqe = 0;
+	while (m_in_flight && io_uring_peek_cqe(m_ring, &cqe) == 0 && cqe)
+		reaped(cqe);
+#endif
+}
+
+void DirectFile::reaped(struct io_uring_cqe * cqe)
+{
+#ifdef WITH_LIBURING
+	const int index = (int)(intptr_t)io_uring_cqe_get_data(cqe);
+	const bool ok = cqe->res == (int)m_buffers[index].fill; // a short write is an error (disk full)
+	io_uring_cqe_seen(m_ring, cqe);
+
+	completed(index, ok);
+#endif
+}
+
+bool DirectFile::wait_for_buffer(int index)
+{
+	if (m_uring)
+	{
+		// Completions are only reaped by the writing thread
+		while (m_buffers[index].in_flight)
+			if (!reap_one())
+				return false;
+		return !m_failed;
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this, index]() { return !m_buffers[index].in_flight; });
+	return !m_failed;
+}
+
+bool DirectFile::wait_all()
+{
+	if (m_uring)
+	{
+		while (m_in_flight)
+			if (!reap_one())
+				return false;
+		return !m_failed;
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]() { return m_in_flight == 0; });
+	return !m_failed;
+}
@@ -0,0 +1,104 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+class DirectFile
+{
+	// Sequential file writer for the recordings. Data is copied into aligned staging buffers, full buffers are
+	// written asynchronously with several writes in flight, the caller only blocks when every buffer is in flight.
+	// On Linux the file is opened with O_DIRECT so that recordings do not go through the page cache, the writes are
+	// submitted with io_uring when built WITH_LIBURING, otherwise by a shared pool of pwrite threads.
+	// Falls back to buffered writes when the file system does not support O_DIRECT, or when direct I/O is disabled.
+public:
+	DirectFile();
+	~DirectFile();
+
+	bool open(const std::string& filename);
+	bool is_open() const;
+
+	bool write(const void * data, size_t size); // append at the end of the file
+	bool write_at(uint64_t offset, const void * data, size_t size); // patch data already written, within size()
+	bool close(); // writes what is left, and sets the file to its exact size
+
+	// Reserve disk space for the file: expected_size up front, then extents of extent bytes as the writes reach the
+	// end of the reserved space. Large extents keep the file contiguous when many cameras share a drive, and the
+	// file system does not allocate blocks during the take. What was not used is released by close().
+	void preallocate(uint64_t expected_size, uint64_t extent);
+	uint64_t allocated() const { return m_allocated; }
+
+	// Called each time more of the file is written, with the size of the part that is: every write below it completed.
+	// With O_DIRECT the data went to the drive, on the buffered fallback only to the page cache (there is no fsync).
+	// Runs on the thread that completes the writes (a pool thread, or the writing thread with io_uring), set it before
+	// the first write.
+	void set_durable_callback(std::function<void(uint64_t)> callback) { m_on_durable = callback; }
+
+	uint64_t size() const { return m_size; }
+	bool failed() const { return m_failed; }
+	const char * backend() const;
+
+	static void set_direct_io(bool enabled); // global param "direct_io", default on
+	static bool direct_io();
+
+	static const size_t alignment = 4096; // O_DIRECT offsets, sizes and memory must be aligned to the logical block size
+	static const size_t buffer_size = 2 * 1024 * 1024;
+	static const int queue_depth = 4; // writes in flight per file
+
+#ifdef WIN32
+	typedef void * native_file;
+#else
+	typedef int native_file;
+#endif
+
+private:
+	friend class DirectWritePool;
+
+	struct Buffer
+	{
+		unsigned char * data;
+		size_t fill;
+		uint64_t offset; // in the file
+		bool in_flight;
+	};
+
+	bool submit(int index); // write a full (or final) buffer
+	bool wait_for_buffer(int index); // until this buffer is not in flight anymore
+	bool wait_all();
+	void completed(int index, bool ok); // called by the pool threads, or when reaping io_uring completions
+	bool reap_one(); // io_uring: wait for one completion
+	void reap_ready(); // io_uring: the completions that are already there, without waiting
+	void reaped(struct io_uring_cqe * cqe);
+	bool reserve(uint64_t end); // make sure the disk space up to end is allocated
+
+	std::string m_filename;
+	native_file m_fd;
+	native_file m_patch_fd; // without O_DIRECT, for write_at on data that was already submitted
+	bool m_open;
+	bool m_direct; // currently opened with O_DIRECT
+	bool m_uring;
+	std::atomic<bool> m_failed;
+
+	std::vector<Buffer> m_buffers;
+	int m_current; // buffer being filled
+	uint64_t m_size; // bytes written by the caller
+	int m_in_flight;
+	uint64_t m_submitted_end; // end of the last buffer submitted
+	uint64_t m_durable; // all the writes below completed, see set_durable_callback
+	std::function<void(uint64_t)> m_on_durable;
+
+	uint64_t m_allocated; // disk space reserved with preallocate(), 0 when the file grows with the writes
+	uint64_t m_extent;
+
+	std::mutex m_mutex; // m_buffers in_flight flags and m_in_flight, shared with the pool threads
+	std::condition_variable m_cond;
+
+	struct io_uring * m_ring;
+};
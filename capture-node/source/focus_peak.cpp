@@ -0,0 +1,159 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "focus_peak.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define FOCUS_PEAK_SSE2
+#endif
+
+const int FocusPeak::WORK_WIDTH;
+const int FocusPeak::FOCUS_THRESHOLD;
+const int FocusPeak::BRIGHTNESS_THRESHOLD;
+const int FocusPeak::DENOISE_FRAMES;
+const bool FocusPeak::TEMPORAL_DENOISE;
+
+static const double HEATMAP_SCALE = 2.5;
+static const double BLUR_SIGMA = 0.3 * ((151 - 1) * 0.5 - 1) + 0.8; // of the former 151x151 gaussian (cv::getGaussianKernel), in pixels of the half resolution image
+
+FocusPeak::FocusPeak() : m_history_index(0), m_history_count(0), m_sharpness(-1.0f)
+{
+}
+
+void FocusPeak::reset()
+{
+	for (int i = 0; i < DENOISE_FRAMES; i++)
+		m_history[i].release();
+	m_history_sum.release();
+	m_history_index = 0;
+	m_history_count = 0;
+	m_sharpness = -1.0f;
+}
+
+static uint64_t laplacian_threshold(const cv::Mat& src, cv::Mat& dst, int threshold)
+{
+	// dst = |up + down + left + right - 4 * center| > threshold ? 255 : 0, on a CV_8UC1 image.
+	// Returns the sum of the Laplacian magnitudes.
+
+	dst.create(src.size(), CV_8UC1);
+	dst.setTo(0);
+
+	uint64_t total = 0;
+
+	for (int y = 1; y < src.rows - 1; y++)
+	{
+		const unsigned char * up = src.ptr<unsigned char>(y - 1);
+		const unsigned char * row = src.ptr<unsigned char>(y);
+		const unsigned char * down = src.ptr<unsigned char>(y + 1);
+		unsigned char * out = dst.ptr<unsigned char>(y);
+
+		int x = 1;
+#ifdef FOCUS_PEAK_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i thr = _mm_set1_epi16((short)threshold);
+		__m128i row_total = _mm_setzero_si128();
+		for (; x + 8 <= src.cols - 1; x += 8)
+		{
+			const __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x)), zero);
+			const __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x - 1)), zero);
+			const __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row + x + 1)), zero);
+			const __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(up + x)), zero);
+			const __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(down + x)), zero);
+
+			const __m128i sum = _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d));
+			const __m128i diff = _mm_sub_epi16(sum, _mm_slli_epi16(c, 2));
+			const __m128i mag = _mm_max_epi16(diff, _mm_sub_epi16(zero, diff));
+
+			const __m128i mask = _mm_cmpgt_epi16(mag, thr);
+			_mm_storel_epi64((__m128i*)(out + x), _mm_packs_epi16(mask, mask));
+
+			row_total = _mm_add_epi32(row_total, _mm_madd_epi16(mag, ones));
+		}
+		int lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, row_total);
+		total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+		for (; x < src.cols - 1; x++)
+		{
+			const int mag = std::abs((int)row[x - 1] + row[x + 1] + up[x] + down[x] - 4 * (int)row[x]);
+			out[x] = mag > threshold ? 255 : 0;
+			total += mag;
+		}
+	}
+
+	return total;
+}
+
+bool FocusPeak::process(const cv::Mat& raw, int bitcount, cv::Mat& overlay)
+{
+	// Pyramid level: average blocks of a power of two size, so that each block holds whole bayer quads.
+	// This is a box filter, the color information is lost which is what we want for a luminance measure.
+	int factor = 2;
+	while (raw.cols / factor > WORK_WIDTH)
+		factor *= 2;
+
+	cv::Mat gray = raw;
+	if (raw.channels() == 3)
+		cv::cvtColor(raw, gray, cv::COLOR_BGR2GRAY);
+
+	cv::resize(gray, m_level, cv::Size(raw.cols / factor, raw.rows / factor), 0.0, 0.0, cv::INTER_AREA);
+	if (m_level.depth() != CV_8U) // convert the image to 8 bit range
+		m_level.convertTo(m_level, CV_8U, bitcount > 8 ? 1.0f / (1 << (bitcount - 8)) : 1.0f);
+
+	// Average the last frames to reduce noise, the running sum avoids re-reading every frame of the history
+	if (TEMPORAL_DENOISE)
+	{
+		if (m_history_sum.size() != m_level.size())
+		{
+			reset();
+			m_history_sum = cv::Mat::zeros(m_level.size(), CV_16UC1);
+		}
+
+		cv::Mat& slot = m_history[m_history_index];
+		if (m_history_count == DENOISE_FRAMES)
+			cv::subtract(m_history_sum, slot, m_history_sum, cv::noArray(), CV_16U);
+		m_level.copyTo(slot);
+		cv::add(m_history_sum, slot, m_history_sum, cv::noArray(), CV_16U);
+
+		m_history_count = std::min(m_history_count + 1, (int)DENOISE_FRAMES);
+		m_history_index = (m_history_index + 1) % DENOISE_FRAMES;
+
+		m_history_sum.convertTo(m_level, CV_8U, 1.0 / m_history_count);
+	}
+
+	cv::cvtColor(m_level, overlay, cv::COLOR_GRAY2BGR);
+
+	const double mean = cv::mean(m_level)[0]; // Mean brightness, only show focus peak if within range
+	if (mean <= BRIGHTNESS_THRESHOLD || mean >= 256 - BRIGHTNESS_THRESHOLD)
+	{
+		m_sharpness = -1.0f;
+		return false;
+	}
+
+	// Contrast threshold, normalized for brightness: same as scaling the image to a mean of 128
+	const double normalize = 128.0 / mean;
+	const int threshold = std::max(1, (int)(FOCUS_THRESHOLD / normalize));
+	const uint64_t total = laplacian_threshold(m_level, m_edges, threshold);
+	m_sharpness = (float)(total * normalize / std::max(1, (m_level.cols - 2) * (m_level.rows - 2)));
+
+	// Two box filters approximate the gaussian, each one is a running sum independent of the kernel size.
+	// For a box of size w, the variance is (w*w-1)/12.
+	const double sigma = BLUR_SIGMA * 2.0 * m_level.cols / raw.cols; // same blur of the full resolution image at any width
+	const int box = std::max(3, (int)std::sqrt(6.0 * sigma * sigma + 1.0) | 1);
+	cv::boxFilter(m_edges, m_heat, -1, cv::Size(box, box));
+	cv::boxFilter(m_heat, m_heat, -1, cv::Size(box, box));
+
+	// Color ramp, then overlay heat map on top of our image
+	m_heat.convertTo(m_heat, CV_8U, HEATMAP_SCALE); // Arbitrary scale
+	cv::applyColorMap(m_heat, m_heat, cv::COLORMAP_HOT);
+	cv::addWeighted(overlay, 0.2, m_heat, 1.0, 0.0, overlay);
+
+	return true;
+}
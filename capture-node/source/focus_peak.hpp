@@ -0,0 +1,41 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <opencv2/core.hpp>
+
+class FocusPeak
+{
+	// Focus peak heat map, computed on a small box-filtered pyramid level of the raw frame.
+	// Keeps its work buffers between frames, one instance per camera.
+public:
+	FocusPeak();
+
+	// raw is the frame from the camera (CV_8UC1 or CV_16UC1 with bitcount significant bits, bayer or mono).
+	// Returns false if the image is too dark or too bright, in which case overlay is the plain gray image.
+	bool process(const cv::Mat& raw, int bitcount, cv::Mat& overlay);
+
+	// Mean Laplacian magnitude of the last processed frame, normalized for brightness. Higher is sharper, -1 if unknown.
+	float sharpness() const { return m_sharpness; }
+
+	void reset();
+
+	static const int WORK_WIDTH = 640; // the pyramid level we work on is at most this wide
+	static const int FOCUS_THRESHOLD = 50; // on 255
+	static const int BRIGHTNESS_THRESHOLD = 5; // focus peak will not run if mean brightness is less than this value (too dark)
+	static const int DENOISE_FRAMES = 4;
+	static const bool TEMPORAL_DENOISE = false; // average the last DENOISE_FRAMES frames to reduce noise
+
+private:
+	cv::Mat m_level; // 8 bit gray pyramid level
+	cv::Mat m_edges;
+	cv::Mat m_heat;
+
+	// Temporal denoise: ring of the last frames and their running sum
+	cv::Mat m_history[DENOISE_FRAMES];
+	cv::Mat m_history_sum; // CV_16UC1
+	int m_history_index;
+	int m_history_count;
+
+	float m_sharpness;
+};
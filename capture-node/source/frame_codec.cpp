@@ -0,0 +1,142 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "frame_codec.hpp"
+
+#include <lz4.h>
+#include <lz4hc.h>
+#ifdef WITH_ZSTD
+	#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+class Lz4Codec : public FrameCodec
+{
+public:
+	virtual const char * tag() const override { return "LZ4"; }
+	virtual size_t bound(size_t size) const override { return LZ4_compressBound((int)size); }
+
+	virtual size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity) const override
+	{
+		return std::max(0, LZ4_compress_default((const char *)src, (char *)dst, (int)size, (int)std::min<size_t>(capacity, INT_MAX)));
+	}
+
+	virtual bool decompress(const unsigned char * src, size_t size, unsigned char * dst, size_t frame_size) const override
+	{
+		return LZ4_decompress_safe((const char *)src, (char *)dst, (int)size, (int)frame_size) == (int)frame_size;
+	}
+};
+
+class Lz4HcCodec : public Lz4Codec
+{
+	// Same stream format as LZ4, slower to compress, decompresses as fast
+public:
+	Lz4HcCodec(int level) : m_level(level ? std::min(std::max(level, LZ4HC_CLEVEL_MIN), LZ4HC_CLEVEL_MAX) : LZ4HC_CLEVEL_DEFAULT) {}
+
+	virtual const char * tag() const override { return "LZ4H"; }
+
+	virtual size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity) const override
+	{
+		return std::max(0, LZ4_compress_HC((const char *)src, (char *)dst, (int)size, (int)std::min<size_t>(capacity, INT_MAX), m_level));
+	}
+
+private:
+	int m_level;
+};
+
+#ifdef WITH_ZSTD
+class ZstdCodec : public FrameCodec
+{
+public:
+	ZstdCodec(int level) : m_level(level ? std::min(std::max(level, 1), ZSTD_maxCLevel()) : ZSTD_CLEVEL_DEFAULT) {}
+
+	virtual const char * tag() const override { return "ZSTD"; }
+	virtual size_t bound(size_t size) const override { return ZSTD_compressBound(size); }
+
+	virtual size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity) const override
+	{
+		// One context per encoding thread, they keep their buffers from frame to frame
+		static thread_local Context<ZSTD_CCtx, ZSTD_createCCtx, ZSTD_freeCCtx> ctx;
+		if (!ctx.p)
+			return 0;
+
+		const size_t len = ZSTD_compressCCtx(ctx.p, dst, capacity, src, size, m_level);
+		return ZSTD_isError(len) ? 0 : len;
+	}
+
+	virtual bool decompress(const unsigned char * src, size_t size, unsigned char * dst, size_t frame_size) const override
+	{
+		static thread_local Context<ZSTD_DCtx, ZSTD_createDCtx, ZSTD_freeDCtx> ctx;
+		if (!ctx.p)
+			return false;
+
+		return ZSTD_decompressDCtx(ctx.p, dst, frame_size, src, size) == frame_size;
+	}
+
+private:
+	template<class T, T * (*Create)(), size_t (*Free)(T *)>
+	struct Context
+	{
+		Context() : p(Create()) {}
+		~Context() { Free(p); }
+		T * p;
+	};
+
+	int m_level;
+};
+#endif
+
+class RawCodec : public FrameCodec
+{
+	// No compression, for cameras that are limited by the CPU rather than by the drives
+public:
+	virtual const char * tag() const override { return "RAW"; }
+	virtual size_t bound(size_t size) const override { return size; }
+
+	virtual size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity) const override
+	{
+		if (size > capacity)
+			return 0;
+		memcpy(dst, src, size);
+		return size;
+	}
+
+	virtual bool decompress(const unsigned char * src, size_t size, unsigned char * dst, size_t frame_size) const override
+	{
+		if (size != frame_size)
+			return false;
+		memcpy(dst, src, size);
+		return true;
+	}
+};
+
+std::unique_ptr<FrameCodec> FrameCodec::create(const std::string& name, int level)
+{
+	if (name == "lz4")
+		return std::unique_ptr<FrameCodec>(new Lz4Codec());
+	if (name == "lz4hc")
+		return std::unique_ptr<FrameCodec>(new Lz4HcCodec(level));
+#ifdef WITH_ZSTD
+	if (name == "zstd")
+		return std::unique_ptr<FrameCodec>(new ZstdCodec(level));
+#endif
+	if (name == "raw")
+		return std::unique_ptr<FrameCodec>(new RawCodec());
+	return std::unique_ptr<FrameCodec>();
+}
+
+std::unique_ptr<FrameCodec> FrameCodec::from_tag(const char * tag)
+{
+	// The level is only needed to compress
+	if (strncmp(tag, "LZ4H", 4) == 0)
+		return create("lz4hc");
+	if (strncmp(tag, "LZ4", 3) == 0)
+		return create("lz4");
+	if (strncmp(tag, "ZSTD", 4) == 0)
+		return create("zstd");
+	if (strncmp(tag, "RAW", 3) == 0)
+		return create("raw");
+	return std::unique_ptr<FrameCodec>();
+}
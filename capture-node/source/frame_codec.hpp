@@ -0,0 +1,28 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <cstddef>
+
+class FrameCodec
+{
+	// Compression of the frames of the .ava recordings. compress() is called concurrently from the parallel stage
+	// of the AvaVideoWriter pipeline, the codecs keep their per-thread state in thread_local contexts.
+public:
+	virtual ~FrameCodec() {}
+
+	virtual const char * tag() const = 0; // compression field of the .ava header, up to 4 characters
+	virtual size_t bound(size_t size) const = 0; // worst case compressed size
+
+	// Returns the compressed size, 0 on error
+	virtual size_t compress(const unsigned char * src, size_t size, unsigned char * dst, size_t capacity) const = 0;
+	// The frame must decompress to exactly frame_size bytes
+	virtual bool decompress(const unsigned char * src, size_t size, unsigned char * dst, size_t frame_size) const = 0;
+
+	// "lz4", "lz4hc", "zstd" or "raw", level 0 for the default of the codec. Null if unknown or not built in.
+	static std::unique_ptr<FrameCodec> create(const std::string& name, int level = 0);
+	// From the compression field of an .ava header. Null if unknown or not built in.
+	static std::unique_ptr<FrameCodec> from_tag(const char * tag);
+};
@@ -0,0 +1,331 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "frame_filters.hpp"
+
+#include <boost/algorithm/string.hpp>
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define FRAME_FILTERS_SSE2
+#endif
+
+namespace frame_filters
+{
+	static void split_bytes(const unsigned char * src, size_t count, unsigned char * even, unsigned char * odd)
+	{
+		// count pairs of bytes: even[i] = src[2i], odd[i] = src[2i+1]
+		size_t i = 0;
+#ifdef FRAME_FILTERS_SSE2
+		const __m128i low = _mm_set1_epi16(0xFF);
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+			const __m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * i + 16));
+			_mm_storeu_si128((__m128i*)(even + i), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+			_mm_storeu_si128((__m128i*)(odd + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			even[i] = src[2 * i];
+			odd[i] = src[2 * i + 1];
+		}
+	}
+
+	static void merge_bytes(const unsigned char * even, const unsigned char * odd, size_t count, unsigned char * dst)
+	{
+		size_t i = 0;
+#ifdef FRAME_FILTERS_SSE2
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i e = _mm_loadu_si128((const __m128i*)(even + i));
+			const __m128i o = _mm_loadu_si128((const __m128i*)(odd + i));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi8(e, o));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi8(e, o));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			dst[2 * i] = even[i];
+			dst[2 * i + 1] = odd[i];
+		}
+	}
+
+	static void split_words(const uint16_t * src, size_t count, uint16_t * even, uint16_t * odd)
+	{
+		size_t i = 0;
+#ifdef FRAME_FILTERS_SSE2
+		for (; i + 8 <= count; i += 8)
+		{
+			// Evens in the low half, odds in the high half of each register
+			__m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * i + 8));
+			a = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+			b = _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0)), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm_storeu_si128((__m128i*)(even + i), _mm_unpacklo_epi64(a, b));
+			_mm_storeu_si128((__m128i*)(odd + i), _mm_unpackhi_epi64(a, b));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			even[i] = src[2 * i];
+			odd[i] = src[2 * i + 1];
+		}
+	}
+
+	static void merge_words(const uint16_t * even, const uint16_t * odd, size_t count, uint16_t * dst)
+	{
+		size_t i = 0;
+#ifdef FRAME_FILTERS_SSE2
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m128i e = _mm_loadu_si128((const __m128i*)(even + i));
+			const __m128i o = _mm_loadu_si128((const __m128i*)(odd + i));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi16(e, o));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i + 8), _mm_unpackhi_epi16(e, o));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			dst[2 * i] = even[i];
+			dst[2 * i + 1] = odd[i];
+		}
+	}
+
+	template <typename T>
+	static void split_planes(const T * src, T * dst, int width, int height)
+	{
+		// Plane (row parity * 2 + column parity), each width/2 x height/2
+		const size_t plane = (size_t)(width / 2) * (height / 2);
+		for (int y = 0; y < height; y++)
+		{
+			T * even = dst + (y & 1) * 2 * plane + (size_t)(y / 2) * (width / 2);
+			if (sizeof(T) == 2)
+				split_words((const uint16_t *)src + (size_t)y * width, width / 2, (uint16_t *)even, (uint16_t *)(even + plane));
+			else
+				split_bytes((const unsigned char *)src + (size_t)y * width, width / 2, (unsigned char *)even, (unsigned char *)(even + plane));
+		}
+	}
+
+	template <typename T>
+	static void merge_planes(const T * src, T * dst, int width, int height)
+	{
+		const size_t plane = (size_t)(width / 2) * (height / 2);
+		for (int y = 0; y < height; y++)
+		{
+			const T * even = src + (y & 1) * 2 * plane + (size_t)(y / 2) * (width / 2);
+			if (sizeof(T) == 2)
+				merge_words((const uint16_t *)even, (const uint16_t *)(even + plane), width / 2, (uint16_t *)dst + (size_t)y * width);
+			else
+				merge_bytes((const unsigned char *)even, (const unsigned char *)(even + plane), width / 2, (unsigned char *)dst + (size_t)y * width);
+		}
+	}
+
+	template <typename T>
+	static T zigzag(T delta)
+	{
+		// 0, -1, 1, -2, 2... to 0, 1, 2, 3, 4...: small negative differences have no high bits set either, for the
+		// shuffle and the codec
+		return (T)((T)(delta << 1) ^ (T)(0 - (delta >> (sizeof(T) * 8 - 1))));
+	}
+
+	template <typename T>
+	static T unzigzag(T code)
+	{
+		return (T)((code >> 1) ^ (T)(0 - (code & 1)));
+	}
+
+	template <typename T>
+	static void delta_encode(const T * src, T * dst, size_t row_length, size_t rows)
+	{
+		// Differences wrap around, the decoder wraps back
+		for (size_t r = 0; r < rows; r++)
+		{
+			const T * s = src + r * row_length;
+			T * d = dst + r * row_length;
+			d[0] = s[0];
+
+			size_t i = 1;
+#ifdef FRAME_FILTERS_SSE2
+			const size_t lanes = 16 / sizeof(T);
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + lanes <= row_length; i += lanes)
+			{
+				const __m128i cur = _mm_loadu_si128((const __m128i*)(s + i));
+				const __m128i prev = _mm_loadu_si128((const __m128i*)(s + i - 1));
+				__m128i code;
+				if (sizeof(T) == 2)
+				{
+					const __m128i delta = _mm_sub_epi16(cur, prev);
+					code = _mm_xor_si128(_mm_slli_epi16(delta, 1), _mm_srai_epi16(delta, 15));
+				}
+				else
+				{
+					const __m128i delta = _mm_sub_epi8(cur, prev);
+					code = _mm_xor_si128(_mm_add_epi8(delta, delta), _mm_cmpgt_epi8(zero, delta));
+				}
+				_mm_storeu_si128((__m128i*)(d + i), code);
+			}
+#endif
+			for (; i < row_length; i++)
+				d[i] = zigzag((T)(s[i] - s[i - 1]));
+		}
+	}
+
+	template <typename T>
+	static void delta_decode(const T * src, T * dst, size_t row_length, size_t rows)
+	{
+		// Running sum, sequential on each row
+		for (size_t r = 0; r < rows; r++)
+		{
+			const T * s = src + r * row_length;
+			T * d = dst + r * row_length;
+			T sum = d[0] = s[0];
+			for (size_t i = 1; i < row_length; i++)
+				d[i] = sum = (T)(sum + unzigzag(s[i]));
+		}
+	}
+
+	template <typename T>
+	class Steps
+	{
+		// Each step reads the output of the previous one, the last one writes to dst
+	public:
+		Steps(unsigned int filters, T * dst, size_t samples) : m_dst(dst), m_samples(samples), m_index(0)
+		{
+			m_remaining = ((filters & BAYER_PLANES) ? 1 : 0) + ((filters & DELTA) ? 1 : 0) + ((filters & SHUFFLE) ? 1 : 0);
+		}
+
+		T * output()
+		{
+			if (--m_remaining == 0)
+				return m_dst;
+			static thread_local std::vector<T> scratch[2];
+			std::vector<T>& buf = scratch[m_index++ & 1];
+			buf.resize(m_samples);
+			return &buf[0];
+		}
+
+	private:
+		T * m_dst;
+		size_t m_samples;
+		int m_remaining;
+		int m_index;
+	};
+
+	template <typename T>
+	static void encode_impl(unsigned int filters, const T * src, T * dst, int width, int height)
+	{
+		const size_t samples = (size_t)width * height;
+
+		Steps<T> steps(filters, dst, samples);
+
+		const T * in = src;
+		if (filters & BAYER_PLANES)
+		{
+			T * out = steps.output();
+			split_planes(in, out, width, height);
+			in = out;
+		}
+		if (filters & DELTA)
+		{
+			T * out = steps.output();
+			const size_t row_length = (filters & BAYER_PLANES) ? width / 2 : width;
+			delta_encode(in, out, row_length, samples / row_length);
+			in = out;
+		}
+		if (filters & SHUFFLE)
+		{
+			T * out = steps.output();
+			split_bytes((const unsigned char *)in, samples, (unsigned char *)out, (unsigned char *)out + samples);
+			in = out;
+		}
+		if (in == src)
+			memcpy(dst, src, samples * sizeof(T));
+	}
+
+	template <typename T>
+	static void decode_impl(unsigned int filters, const T * src, T * dst, int width, int height)
+	{
+		const size_t samples = (size_t)width * height;
+
+		// Same steps in reverse order
+		Steps<T> steps(filters, dst, samples);
+
+		const T * in = src;
+		if (filters & SHUFFLE)
+		{
+			T * out = steps.output();
+			merge_bytes((const unsigned char *)in, (const unsigned char *)in + samples, samples, (unsigned char *)out);
+			in = out;
+		}
+		if (filters & DELTA)
+		{
+			T * out = steps.output();
+			const size_t row_length = (filters & BAYER_PLANES) ? width / 2 : width;
+			delta_decode(in, out, row_length, samples / row_length);
+			in = out;
+		}
+		if (filters & BAYER_PLANES)
+		{
+			T * out = steps.output();
+			merge_planes(in, out, width, height);
+			in = out;
+		}
+		if (in == src)
+			memcpy(dst, src, samples * sizeof(T));
+	}
+
+	unsigned int supported(unsigned int filters, int width, int height, int bitcount, bool bayer)
+	{
+		if (!bayer || width % 2 || height % 2)
+			filters &= ~BAYER_PLANES;
+		if (bitcount <= 8)
+			filters &= ~SHUFFLE;
+		if (width < 2)
+			filters &= ~DELTA;
+		return filters & (BAYER_PLANES | DELTA | SHUFFLE);
+	}
+
+	unsigned int parse(const std::string& names)
+	{
+		std::vector<std::string> list;
+		boost::split(list, names, boost::is_any_of(","));
+
+		unsigned int filters = 0;
+		for (auto& name : list)
+		{
+			boost::trim(name);
+			if (name == "bayer")
+				filters |= BAYER_PLANES;
+			else if (name == "delta")
+				filters |= DELTA;
+			else if (name == "shuffle")
+				filters |= SHUFFLE;
+			else if (!name.empty())
+				std::cerr << "Unknown frame filter " << name << std::endl;
+		}
+		return filters;
+	}
+
+	void encode(unsigned int filters, const unsigned char * src, unsigned char * dst, int width, int height, int bitcount)
+	{
+		if (bitcount > 8)
+			encode_impl(filters, (const uint16_t *)src, (uint16_t *)dst, width, height);
+		else
+			encode_impl(filters & ~SHUFFLE, src, dst, width, height);
+	}
+
+	void decode(unsigned int filters, const unsigned char * src, unsigned char * dst, int width, int height, int bitcount)
+	{
+		if (bitcount > 8)
+			decode_impl(filters, (const uint16_t *)src, (uint16_t *)dst, width, height);
+		else
+			decode_impl(filters & ~SHUFFLE, src, dst, width, height);
+	}
+}
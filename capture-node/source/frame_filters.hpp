@@ -0,0 +1,28 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <string>
+
+namespace frame_filters
+{
+	// Reversible transforms of the frames of the .ava recordings, applied before the codec to make the data easier
+	// to compress. The filters used are flagged in the header (ava_raw_info::filters) and undone by the reader.
+	enum Filter
+	{
+		BAYER_PLANES = 1, // the 4 positions of the bayer quads in 4 separate planes, the neighbors of a sample have the same color
+		DELTA = 2,        // each sample minus the previous one on the row (of the plane), zigzag coded: small values on smooth images
+		SHUFFLE = 4       // 16 bit samples: all the low bytes, then all the high bytes (mostly 0 with 10 or 12 bit data)
+	};
+
+	// The filters that apply to this image format, out of the requested ones
+	unsigned int supported(unsigned int filters, int width, int height, int bitcount, bool bayer);
+
+	// Comma separated names: "bayer", "delta", "shuffle". Unknown names are reported and ignored.
+	unsigned int parse(const std::string& names);
+
+	// src and dst are frames of width * height samples, 1 byte per sample up to 8 bits, 2 above. They must not overlap.
+	// The intermediate steps use per-thread buffers, both can be called from the parallel stage of the writer.
+	void encode(unsigned int filters, const unsigned char * src, unsigned char * dst, int width, int height, int bitcount);
+	void decode(unsigned int filters, const unsigned char * src, unsigned char * dst, int width, int height, int bitcount);
+}
@@ -0,0 +1,266 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "frame_pool.hpp"
+#include "latency_stats.hpp"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef WIN32
+	#include <malloc.h>
+#endif
+
+const size_t FramePool::alignment;
+
+void FrameRef::reset()
+{
+	if (m_buf)
+	{
+		if (--m_buf->refcount == 0)
+			m_buf->pool->release(m_buf);
+		m_buf = 0;
+	}
+}
+
+void FrameRef::mark_arrival()
+{
+	if (m_buf)
+		m_buf->arrival = LatencyStats::now();
+}
+
+cv::Mat FrameRef::mat() const
+{
+	if (!m_buf)
+		return cv::Mat();
+	return cv::Mat(m_buf->height, m_buf->width, m_buf->type, m_buf->data, m_buf->step);
+}
+
+FramePool& FramePool::Instance()
+{
+	static FramePool s_instance;
+	return s_instance;
+}
+
+FramePool::FramePool() : m_allocated(0), m_in_use(0), m_budget(0)
+{
+}
+
+FramePool::~FramePool()
+{
+	release_unused();
+}
+
+static size_t round_to_alignment(size_t size)
+{
+	return (size + FramePool::alignment - 1) / FramePool::alignment * FramePool::alignment;
+}
+
+size_t FramePool::buffer_capacity(int width, int height, int type)
+{
+	return round_to_alignment((size_t)width * CV_ELEM_SIZE(type) * height);
+}
+
+FrameBuffer* FramePool::allocate_buffer(size_t capacity)
+{
+	void * ptr = 0;
+#ifdef WIN32
+	ptr = _aligned_malloc(capacity, alignment);
+#else
+	if (posix_memalign(&ptr, alignment, capacity) != 0)
+		ptr = 0;
+#endif
+	if (!ptr)
+		return 0;
+
+	// Touch the pages now, the capture thread should not take page faults on a new buffer. Called without m_mutex:
+	// this takes a while for large frames, the other cameras keep acquiring and releasing.
+	memset(ptr, 0, capacity);
+
+	FrameBuffer* buf = new FrameBuffer;
+	buf->refcount = 0;
+	buf->data = (unsigned char *)ptr;
+	buf->capacity = capacity;
+	buf->pool = this;
+	buf->width = buf->height = buf->type = 0;
+	buf->step = 0;
+
+	return buf;
+}
+
+void FramePool::free_buffer(FrameBuffer* buf)
+{
+	// m_allocated is updated by the caller, with m_mutex locked
+#ifdef WIN32
+	_aligned_free(buf->data);
+#else
+	free(buf->data);
+#endif
+	delete buf;
+}
+
+bool FramePool::trim_unused(size_t needed, std::vector<FrameBuffer*>& trimmed)
+{
+	// Called with m_mutex locked, the caller frees the trimmed buffers once it is unlocked
+	for (auto it = m_unused.begin(); it != m_unused.end() && m_allocated + needed > m_budget; )
+	{
+		while (!it->second.empty() && m_allocated + needed > m_budget)
+		{
+			m_allocated -= it->second.back()->capacity;
+			m_buffer_count[it->first]--;
+			trimmed.push_back(it->second.back());
+			it->second.pop_back();
+		}
+		if (it->second.empty())
+			it = m_unused.erase(it);
+		else
+			++it;
+	}
+
+	return m_allocated + needed <= m_budget;
+}
+
+FrameBuffer* FramePool::new_buffer(size_t capacity)
+{
+	std::vector<FrameBuffer*> trimmed;
+	bool over_budget = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_budget && m_allocated + capacity > m_budget && !trim_unused(capacity, trimmed))
+			over_budget = true;
+		else
+		{
+			m_allocated += capacity; // counted now so that concurrent misses respect the budget
+			m_buffer_count[capacity]++;
+		}
+	}
+
+	// Memory is freed and allocated without the lock
+	for (FrameBuffer* b : trimmed)
+		free_buffer(b);
+	if (over_budget)
+		return 0;
+
+	FrameBuffer* buf = allocate_buffer(capacity);
+	if (!buf)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_allocated -= capacity;
+		m_buffer_count[capacity]--;
+		std::cerr << "FramePool> Could not allocate " << capacity << " bytes" << std::endl;
+	}
+	return buf;
+}
+
+FrameRef FramePool::acquire(int width, int height, int type)
+{
+	const size_t step = (size_t)width * CV_ELEM_SIZE(type);
+	const size_t capacity = buffer_capacity(width, height, type);
+
+	FrameBuffer* buf = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto it = m_unused.find(capacity);
+		if (it != m_unused.end() && !it->second.empty())
+		{
+			buf = it->second.back();
+			it->second.pop_back();
+		}
+	}
+
+	if (!buf)
+	{
+		buf = new_buffer(capacity);
+		if (!buf)
+			return FrameRef();
+	}
+
+	buf->refcount = 1;
+	buf->width = width;
+	buf->height = height;
+	buf->type = type;
+	buf->step = step;
+	buf->arrival = LatencyStats::now(); // the producer fills the buffer right away
+
+	m_in_use += buf->capacity;
+
+	return FrameRef(buf);
+}
+
+FrameRef FramePool::acquire_copy(const cv::Mat& img)
+{
+	FrameRef frame = acquire(img.cols, img.rows, img.type());
+	if (!frame.empty())
+	{
+		cv::Mat dst = frame.mat();
+		img.copyTo(dst);
+	}
+	return frame;
+}
+
+void FramePool::reserve(const void * owner, int width, int height, int type, int count)
+{
+	// Pre-allocate buffers so that the first frames do not pay for the allocation
+	const size_t capacity = buffer_capacity(width, height, type);
+
+	int missing = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (count > 0)
+			m_reservations[owner] = Reservation{ capacity, count };
+		else
+			m_reservations.erase(owner);
+
+		for (auto& it : m_reservations)
+			if (it.second.capacity == capacity)
+				missing += it.second.count;
+		missing -= m_buffer_count[capacity];
+	}
+
+	for (int i = 0; i < missing; i++)
+	{
+		FrameBuffer* buf = new_buffer(capacity);
+		if (!buf)
+			break;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_unused[capacity].push_back(buf);
+	}
+}
+
+void FramePool::unreserve(const void * owner)
+{
+	// The buffers stay in the pool, release_unused() or the budget frees them
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_reservations.erase(owner);
+}
+
+void FramePool::release_unused()
+{
+	std::map<size_t, std::vector<FrameBuffer*> > unused;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		unused.swap(m_unused);
+		for (auto& it : unused)
+		{
+			m_allocated -= it.first * it.second.size();
+			m_buffer_count[it.first] -= (int)it.second.size();
+		}
+	}
+
+	for (auto& it : unused)
+		for (FrameBuffer* buf : it.second)
+			free_buffer(buf);
+}
+
+void FramePool::release(FrameBuffer* buf)
+{
+	m_in_use -= buf->capacity;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_unused[buf->capacity].push_back(buf);
+}
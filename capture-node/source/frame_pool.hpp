@@ -0,0 +1,125 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <cstddef>
+
+#include <opencv2/core.hpp>
+
+class FramePool;
+
+struct FrameBuffer
+{
+	// Block of image memory owned by the FramePool. The refcount is intrusive so that
+	// handing a frame to another consumer never allocates.
+
+	std::atomic<int> refcount;
+	unsigned char * data;
+	size_t capacity;
+	FramePool * pool;
+
+	// Layout of the image currently stored in this buffer
+	int width;
+	int height;
+	int type;
+	size_t step;
+
+	double arrival; // steady clock seconds when the buffer was acquired for this image, see LatencyStats
+};
+
+class FrameRef
+{
+	// Shared, read-only reference to one captured frame. Copying a FrameRef only increments the refcount,
+	// the memory goes back to the pool when the last reference is released.
+public:
+	FrameRef() : m_buf(0) {}
+	FrameRef(const FrameRef& other) : m_buf(other.m_buf) { if (m_buf) m_buf->refcount++; }
+	FrameRef(FrameRef&& other) : m_buf(other.m_buf) { other.m_buf = 0; }
+	~FrameRef() { reset(); }
+
+	FrameRef& operator=(FrameRef other)
+	{
+		std::swap(m_buf, other.m_buf);
+		return *this;
+	}
+
+	void reset();
+	bool empty() const { return m_buf == 0; }
+
+	// OpenCV header on the pooled memory, only valid while this FrameRef is alive. Consumers must not write to it.
+	cv::Mat mat() const;
+
+	const unsigned char * data() const { return m_buf ? m_buf->data : 0; }
+	size_t size() const { return m_buf ? m_buf->step * m_buf->height : 0; }
+	int width() const { return m_buf ? m_buf->width : 0; }
+	int height() const { return m_buf ? m_buf->height : 0; }
+	int type() const { return m_buf ? m_buf->type : 0; }
+	double arrival() const { return m_buf ? m_buf->arrival : 0.0; }
+	void mark_arrival(); // now, for producers that fill the buffer ahead of its delivery (while they are the only owner)
+
+private:
+	friend class FramePool;
+	explicit FrameRef(FrameBuffer* buf) : m_buf(buf) {} // takes over one reference
+
+	FrameBuffer* m_buf;
+};
+
+class FramePool
+{
+	// Node-wide pool of pre-allocated, aligned frame buffers shared by all cameras.
+	// Buffers are recycled by size, so a camera running at a fixed resolution never allocates after warm-up.
+public:
+	static FramePool& Instance();
+
+	~FramePool();
+
+	// Returns an empty FrameRef when the memory budget does not allow a new buffer
+	FrameRef acquire(int width, int height, int type);
+	FrameRef acquire_copy(const cv::Mat& img);
+
+	// Reservations of the different owners (any address that identifies the consumer) add up: the pool keeps at least
+	// the sum of their counts of buffers of each size, in use or not. A new call replaces the one of the same owner.
+	void reserve(const void * owner, int width, int height, int type, int count);
+	void unreserve(const void * owner);
+	void release_unused(); // free all the buffers that are not in use
+
+	void set_budget(size_t bytes) { m_budget = bytes; } // global param "frame_pool_mb", 0 for no limit
+	size_t budget() const { return m_budget; }
+	size_t bytes_allocated() const { return m_allocated; }
+	size_t bytes_in_use() const { return m_in_use; }
+
+	static size_t buffer_capacity(int width, int height, int type); // memory used by one frame of this format
+
+	static const size_t alignment = 4096;
+
+protected:
+	FramePool();
+
+private:
+	friend class FrameRef;
+	void release(FrameBuffer* buf);
+
+	FrameBuffer* new_buffer(size_t capacity); // within the budget, 0 if it does not allow it
+	FrameBuffer* allocate_buffer(size_t capacity);
+	void free_buffer(FrameBuffer* buf);
+	bool trim_unused(size_t needed, std::vector<FrameBuffer*>& trimmed); // unused buffers of other sizes to free, to make room in the budget
+
+	struct Reservation
+	{
+		size_t capacity;
+		int count;
+	};
+
+	std::mutex m_mutex; // m_unused, m_buffer_count, m_reservations, and m_allocated when it is compared to the budget
+	std::map<size_t, std::vector<FrameBuffer*> > m_unused;
+	std::map<size_t, int> m_buffer_count; // buffers of each capacity, in use or not
+	std::map<const void *, Reservation> m_reservations;
+
+	std::atomic<size_t> m_allocated;
+	std::atomic<size_t> m_in_use;
+	std::atomic<size_t> m_budget;
+};
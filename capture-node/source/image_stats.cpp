@@ -0,0 +1,193 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "image_stats.hpp"
+#include "preview_kernels.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define IMAGE_STATS_SSE2
+#endif
+
+namespace image_stats
+{
+	static void to_bins(const unsigned short * src, unsigned char * dst, int count, int shift)
+	{
+		// dst = min(src >> shift, 255)
+		int i = 0;
+#ifdef IMAGE_STATS_SSE2
+		const __m128i v_shift = _mm_cvtsi32_si128(shift);
+		for (; i + 16 <= count; i += 16)
+		{
+			const __m128i a = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(src + i)), v_shift);
+			const __m128i b = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(src + i + 8)), v_shift);
+			// values are below 32768 after the shift, the signed saturation of packus is safe
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+		}
+#endif
+		for (; i < count; i++)
+			dst[i] = (unsigned char)std::min(src[i] >> shift, 255);
+	}
+
+	static void count_bins(const unsigned char * bins, int count, unsigned int hist[4][256])
+	{
+		// Four interleaved sub-histograms, so that runs of identical values do not serialize on one counter
+		int i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			hist[0][bins[i + 0]]++;
+			hist[1][bins[i + 1]]++;
+			hist[2][bins[i + 2]]++;
+			hist[3][bins[i + 3]]++;
+		}
+		for (; i < count; i++)
+			hist[0][bins[i]]++;
+	}
+
+	struct ChannelAccumulator
+	{
+		ChannelAccumulator() { memset(hist, 0, sizeof(hist)); }
+
+		void add_row(const std::vector<unsigned short>& values, int count, int shift, std::vector<unsigned char>& bins)
+		{
+			to_bins(&values[0], &bins[0], count, shift);
+			count_bins(&bins[0], count, hist);
+		}
+
+		void finish(char name, ChannelStats& s) const
+		{
+			s.name = name;
+			s.samples = 0;
+			double sum = 0.0;
+			for (int i = 0; i < 256; i++)
+			{
+				s.histogram[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+				s.samples += s.histogram[i];
+				sum += (double)i * s.histogram[i];
+			}
+			if (s.samples)
+			{
+				s.mean = (float)(sum / s.samples);
+				s.clipped_low = 100.0f * s.histogram[0] / s.samples;
+				s.clipped_high = 100.0f * s.histogram[255] / s.samples;
+			}
+		}
+
+		unsigned int hist[4][256];
+	};
+
+	void compute(const cv::Mat& raw, bool bayer, int bayer_pattern, int bitcount, ImageStats& stats, int max_samples)
+	{
+		stats = ImageStats();
+		if (raw.empty() || raw.channels() != 1 || (bayer && (raw.cols < 2 || raw.rows < 2)))
+			return;
+
+		// Sampling grid, in pixels for mono and in quads for bayer
+		const int unit = bayer ? 2 : 1;
+		const int cols = raw.cols / unit;
+		const int rows = raw.rows / unit;
+		const int step = std::max(1, (int)std::sqrt((double)cols * rows / std::max(1, max_samples)));
+		const int count = (cols + step - 1) / step;
+
+		const bool is16 = raw.depth() == CV_16U;
+		const int shift = is16 && bitcount > 8 ? bitcount - 8 : 0;
+
+		preview_kernels::BayerLayout l = preview_kernels::bayer_layout(bayer_pattern);
+		if (!bayer)
+			l.r_x = l.r_y = l.b_x = l.b_y = l.g1_x = l.g1_y = l.g2_x = l.g2_y = 0;
+
+		std::vector<unsigned short> r(count), g(count * 2), b(count);
+		std::vector<unsigned char> bins(count * 2);
+		ChannelAccumulator acc_r, acc_g, acc_b;
+
+		auto at = [&](int x, int y) -> unsigned short {
+			return is16 ? raw.ptr<unsigned short>(y)[x] : raw.ptr<unsigned char>(y)[x];
+		};
+
+		for (int qy = 0; qy < rows; qy += step)
+		{
+			const int y = qy * unit;
+
+			// Gather the samples of this row
+			int n = 0;
+			for (int qx = 0; qx < cols; qx += step, n++)
+			{
+				const int x = qx * unit;
+				if (bayer)
+				{
+					r[n] = at(x + l.r_x, y + l.r_y);
+					b[n] = at(x + l.b_x, y + l.b_y);
+					g[n * 2 + 0] = at(x + l.g1_x, y + l.g1_y);
+					g[n * 2 + 1] = at(x + l.g2_x, y + l.g2_y);
+				}
+				else
+				{
+					g[n] = at(x, y);
+				}
+			}
+
+			if (bayer)
+			{
+				acc_r.add_row(r, n, shift, bins);
+				acc_g.add_row(g, n * 2, shift, bins);
+				acc_b.add_row(b, n, shift, bins);
+			}
+			else
+			{
+				acc_g.add_row(g, n, shift, bins);
+			}
+		}
+
+		if (bayer)
+		{
+			stats.channels = 3;
+			acc_r.finish('R', stats.channel[0]);
+			acc_g.finish('G', stats.channel[1]);
+			acc_b.finish('B', stats.channel[2]);
+		}
+		else
+		{
+			stats.channels = 1;
+			acc_g.finish('Y', stats.channel[0]);
+		}
+	}
+}
+
+void ImageStats::to_json(rapidjson::Value& v, rapidjson::Document::AllocatorType& allocator) const
+{
+	v.SetArray();
+
+	for (int c = 0; c < channels; c++)
+	{
+		const ChannelStats& s = channel[c];
+
+		unsigned int reduced[json_bins];
+		unsigned int peak = 1;
+		for (int i = 0; i < json_bins; i++)
+		{
+			reduced[i] = 0;
+			for (int j = 0; j < 256 / json_bins; j++)
+				reduced[i] += s.histogram[i * (256 / json_bins) + j];
+			peak = std::max(peak, reduced[i]);
+		}
+
+		rapidjson::Value bins(rapidjson::kArrayType);
+		for (int i = 0; i < json_bins; i++)
+			bins.PushBack((unsigned int)((reduced[i] * 255ull + peak - 1) / peak), allocator);
+
+		const char name[2] = { s.name, 0 };
+
+		rapidjson::Value ch(rapidjson::kObjectType);
+		ch.AddMember("channel", rapidjson::Value(name, allocator), allocator);
+		ch.AddMember("bins", bins, allocator);
+		ch.AddMember("mean", s.mean, allocator);
+		ch.AddMember("clipped_low", s.clipped_low, allocator);
+		ch.AddMember("clipped_high", s.clipped_high, allocator);
+		ch.AddMember("samples", s.samples, allocator);
+		v.PushBack(ch, allocator);
+	}
+}
@@ -0,0 +1,47 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "json.hpp"
+
+#include <opencv2/core.hpp>
+
+struct ChannelStats
+{
+	ChannelStats() : name(' '), samples(0), mean(0.0f), clipped_low(0.0f), clipped_high(0.0f)
+	{
+		for (int i = 0; i < 256; i++)
+			histogram[i] = 0;
+	}
+
+	char name; // 'R', 'G', 'B' or 'Y'
+	unsigned int histogram[256]; // raw values scaled to 8 bit, before black level and white balance
+	unsigned int samples;
+	float mean; // on 255
+	float clipped_low; // percentage of samples in the first bin
+	float clipped_high; // percentage of samples in the last bin
+};
+
+struct ImageStats
+{
+	// Exposure statistics of one frame, computed on a subsampled grid of the raw bayer data
+	ImageStats() : channels(0) {}
+
+	int channels;
+	ChannelStats channel[3];
+
+	bool empty() const { return channels == 0; }
+
+	// Compact form for the UI: each channel has its histogram reduced to json_bins bins and scaled so that the highest bin is 255
+	void to_json(rapidjson::Value& v, rapidjson::Document::AllocatorType& allocator) const;
+
+	static const int json_bins = 64;
+};
+
+namespace image_stats
+{
+	// raw is CV_8UC1 or CV_16UC1 with bitcount significant bits. For bayer frames, bayer_pattern is one of the
+	// cv::COLOR_BayerXX2RGB codes and the statistics are per color, otherwise a single 'Y' channel is computed.
+	// About max_samples pixels (or quads) are read, spread evenly over the frame.
+	void compute(const cv::Mat& raw, bool bayer, int bayer_pattern, int bitcount, ImageStats& stats, int max_samples = 65536);
+}
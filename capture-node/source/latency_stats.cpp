@@ -0,0 +1,155 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "latency_stats.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+int LatencyHistogram::bucket_index(uint64_t us)
+{
+	// Values below SUB_BUCKETS get one bucket each, above that each power of two is split in SUB_BUCKETS
+	if (us < SUB_BUCKETS)
+		return (int)us;
+
+	int shift = 0;
+	while ((us >> shift) >= 2 * SUB_BUCKETS)
+		shift++;
+
+	const int index = SUB_BUCKETS + shift * SUB_BUCKETS + (int)((us >> shift) - SUB_BUCKETS);
+	return index < BUCKET_COUNT ? index : BUCKET_COUNT - 1;
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(int index)
+{
+	if (index < SUB_BUCKETS)
+		return index;
+
+	const int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+	const uint64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+	return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(double seconds)
+{
+	const uint64_t us = seconds > 0.0 ? (uint64_t)(seconds * 1e6) : 0;
+
+	m_buckets[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum_us.fetch_add(us, std::memory_order_relaxed);
+
+	uint64_t prev = m_max_us.load(std::memory_order_relaxed);
+	while (us > prev && !m_max_us.compare_exchange_weak(prev, us, std::memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::reset()
+{
+	for (int i = 0; i < BUCKET_COUNT; i++)
+		m_buckets[i] = 0;
+	m_count = 0;
+	m_sum_us = 0;
+	m_max_us = 0;
+}
+
+double LatencyHistogram::mean() const
+{
+	const uint64_t count = m_count;
+	return count ? m_sum_us * 1e-6 / count : 0.0;
+}
+
+double LatencyHistogram::percentile(double p) const
+{
+	// The buckets are read while other threads record, the result is approximate the same way the buckets are
+	uint64_t total = 0;
+	for (int i = 0; i < BUCKET_COUNT; i++)
+		total += m_buckets[i].load(std::memory_order_relaxed);
+	if (!total)
+		return 0.0;
+
+	const uint64_t target = (uint64_t)(total * p / 100.0 + 0.5);
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKET_COUNT; i++)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target && seen > 0)
+			return std::min(bucket_upper_bound(i), (uint64_t)m_max_us) * 1e-6;
+	}
+	return max();
+}
+
+double LatencyStats::now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyStats::reset()
+{
+	for (int i = 0; i < LATENCY_STAGE_COUNT; i++)
+		m_stages[i].reset();
+}
+
+const char * LatencyStats::stage_name(LatencyStage stage)
+{
+	switch (stage) {
+	case LATENCY_DELIVERY: return "delivery";
+	case LATENCY_QUEUE: return "queue";
+	case LATENCY_ENCODE: return "encode";
+	case LATENCY_WRITE: return "write";
+	case LATENCY_TOTAL: return "total";
+	default: return "unknown";
+	}
+}
+
+void LatencyStats::to_json(rapidjson::Value& v, rapidjson::Document::AllocatorType& allocator) const
+{
+	v.SetObject();
+
+	for (int i = 0; i < LATENCY_STAGE_COUNT; i++)
+	{
+		const LatencyHistogram& h = m_stages[i];
+		if (!h.count())
+			continue;
+
+		rapidjson::Value s(rapidjson::kObjectType);
+		s.AddMember("count", (uint64_t)h.count(), allocator);
+		s.AddMember("mean_ms", h.mean() * 1000.0, allocator);
+		s.AddMember("p50_ms", h.percentile(50.0) * 1000.0, allocator);
+		s.AddMember("p90_ms", h.percentile(90.0) * 1000.0, allocator);
+		s.AddMember("p99_ms", h.percentile(99.0) * 1000.0, allocator);
+		s.AddMember("p999_ms", h.percentile(99.9) * 1000.0, allocator);
+		s.AddMember("max_ms", h.max() * 1000.0, allocator);
+
+		v.AddMember(rapidjson::Value(stage_name((LatencyStage)i), allocator), s, allocator);
+	}
+}
+
+void DurableLatency::written(const std::shared_ptr<LatencyStats>& stats, uint64_t end, double write_start, double arrival)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_stats = stats;
+	Pending p;
+	p.end = end;
+	p.write_start = write_start;
+	p.arrival = arrival;
+	m_pending.push_back(p);
+}
+
+void DurableLatency::durable(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const double now = LatencyStats::now();
+	while (!m_pending.empty() && m_pending.front().end <= size)
+	{
+		const Pending& p = m_pending.front();
+		m_stats->record(LATENCY_WRITE, now - p.write_start);
+		m_stats->record(LATENCY_TOTAL, now - p.arrival);
+		m_pending.pop_front();
+	}
+}
@@ -0,0 +1,92 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "json.hpp"
+
+enum LatencyStage
+{
+	LATENCY_DELIVERY, // sensor timestamp to got_image, above the fastest frame (the camera clock has its own epoch)
+	LATENCY_QUEUE,    // waiting in the writer queue, from addFrame to the encoder
+	LATENCY_ENCODE,   // compression (FrameCodec, ffvhuff)
+	LATENCY_WRITE,    // from the write stage until the write completes: on the drive with direct I/O, in the page cache on the buffered fallback (image sequences: handing the files to the OS, TIF/RAW encoding included)
+	LATENCY_TOTAL,    // from got_image to the end of the write as above, including the pre-roll and staging when they are used
+	LATENCY_STAGE_COUNT
+};
+
+class LatencyHistogram
+{
+	// Log-linear histogram of durations in microseconds, in the spirit of HdrHistogram: 16 buckets per power of two
+	// (about 6% resolution) from 1 us to over an hour. Recording is a few relaxed atomic increments, safe from any thread.
+public:
+	LatencyHistogram();
+
+	void record(double seconds);
+	void reset();
+
+	uint64_t count() const { return m_count; }
+	double max() const { return m_max_us * 1e-6; } // seconds
+	double mean() const;
+	double percentile(double p) const; // seconds, upper bound of the bucket, p in 0..100
+
+	static const int SUB_BUCKET_BITS = 4;
+	static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const int BUCKET_COUNT = SUB_BUCKETS + 32 * SUB_BUCKETS;
+
+private:
+	static int bucket_index(uint64_t us);
+	static uint64_t bucket_upper_bound(int index);
+
+	std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum_us;
+	std::atomic<uint64_t> m_max_us;
+};
+
+class LatencyStats
+{
+	// Per camera latency histograms, one for each stage a frame goes through between the sensor and the disk.
+	// Shared by the camera, its recorders and their writers.
+public:
+	static double now(); // seconds on the steady clock, the time base of every stage
+
+	void record(LatencyStage stage, double seconds) { m_stages[stage].record(seconds); }
+	void reset();
+
+	const LatencyHistogram& stage(LatencyStage stage) const { return m_stages[stage]; }
+	static const char * stage_name(LatencyStage stage);
+
+	// { "<stage>": { "count", "mean_ms", "p50_ms", "p90_ms", "p99_ms", "p999_ms", "max_ms" }, ... } for the stages with samples
+	void to_json(rapidjson::Value& v, rapidjson::Document::AllocatorType& allocator) const;
+
+private:
+	LatencyHistogram m_stages[LATENCY_STAGE_COUNT];
+};
+
+class DurableLatency
+{
+	// Write and total latency of the packets of one DirectFile, recorded when their write completed rather than when
+	// the write stage hands them over: packets wait here with the offset where they end, the completions of the file
+	// (DirectFile::set_durable_callback, which says what completed means) release them in order.
+public:
+	void written(const std::shared_ptr<LatencyStats>& stats, uint64_t end, double write_start, double arrival);
+	void durable(uint64_t size);
+
+private:
+	struct Pending
+	{
+		uint64_t end;
+		double write_start;
+		double arrival;
+	};
+
+	std::mutex m_mutex; // between the write stage and the thread that completes the writes
+	std::deque<Pending> m_pending;
+	std::shared_ptr<LatencyStats> m_stats;
+};
@@ -5,6 +5,11 @@
 #include "capturenode.hpp"
 #include "server_uplink.hpp"
 #include "embedded_python.hpp"
+#include "thread_config.hpp"
+#include "replaycameras.hpp"
+#include "ava_format.hpp"
+#include "video_writer_staged.hpp"
+#include "ava_recovery.hpp"
 
 #ifdef WIN32
 	#define GIT_REVISION "unknown" // TODO Set revision in the build script, just like in linux
@@ -102,7 +107,17 @@ int main(int argc, char** argv)
 		("port", po::value<int>()->default_value(DEFAULT_PORT), "Port of the server")
 		("webcams", po::bool_switch()->default_value(false), "Initialize all available Webcams")
 		("dummy", po::bool_switch()->default_value(false), "Add dummy test camera")
+		("dummy-count", po::value<int>()->default_value(2), "Number of dummy cameras")
+		("dummy-size", po::value<std::string>()->default_value("320x200"), "Resolution of the dummy cameras (WIDTHxHEIGHT)")
+		("dummy-bits", po::value<int>()->default_value(8), "Bit depth of the dummy cameras (8..16)")
+		("dummy-bayer", po::value<std::string>()->default_value(""), "Bayer pattern of the dummy cameras (RGGB, BGGR, GRBG or GBRG), mono if empty")
+		("dummy-fps", po::value<int>()->default_value(10), "Framerate of the dummy cameras")
+		("dummy-noise-bits", po::value<int>()->default_value(4), "Random bits in each pixel of the dummy cameras, higher values compress worse")
+		("replay", po::value<std::vector<std::string>>()->multitoken(), "Add cameras playing back these .ava recordings, in a loop")
+		("replay-count", po::value<int>()->default_value(1), "Number of cameras playing back each recording")
+		("replay-fps", po::value<double>()->default_value(0.0), "Play back at this framerate instead of the recorded timestamps")
 		("service", po::bool_switch()->default_value(false), "Run without the interactive prompt")
+		("recover", po::value<std::vector<std::string>>()->multitoken(), "Rebuild the index of .ava recordings that were interrupted, then exit")
 #ifdef WITH_PORTAUDIO		
 		("audio", po::bool_switch()->default_value(false), "Initialize default audio capture device")
 #endif
@@ -128,6 +143,17 @@ int main(int argc, char** argv)
 		return 1;
 	}
 
+	if (!vm["recover"].empty())
+	{
+		bool ok = true;
+		for (auto& filename : vm["recover"].as<std::vector<std::string> >())
+			ok = recover_ava_recording(filename) && ok;
+		return ok ? 0 : 1;
+	}
+
+	// Start tracking worker threads before the first recording creates the TBB thread pool
+	ThreadConfig::Instance();
+
 	// Launch Node, Server, ServerUplink
 
 	int rcode = 0;
@@ -140,11 +166,38 @@ int main(int argc, char** argv)
 #endif
 	const bool use_dummycam = vm["dummy"].as<bool>();
 
+	DummyCameraSettings dummy_settings;
+	dummy_settings.count = vm["dummy-count"].as<int>();
+	dummy_settings.bitcount = vm["dummy-bits"].as<int>();
+	dummy_settings.framerate = vm["dummy-fps"].as<int>();
+	dummy_settings.noise_bits = vm["dummy-noise-bits"].as<int>();
+	if (sscanf(vm["dummy-size"].as<std::string>().c_str(), "%dx%d", &dummy_settings.width, &dummy_settings.height) != 2)
+	{
+		std::cerr << "ERROR: Invalid dummy camera size " << vm["dummy-size"].as<std::string>() << std::endl;
+		return 1;
+	}
+	if (!vm["dummy-bayer"].as<std::string>().empty())
+	{
+		dummy_settings.bayer_pattern = ava_format::bayer_from_name(vm["dummy-bayer"].as<std::string>().c_str());
+		if (dummy_settings.bayer_pattern < 0)
+		{
+			std::cerr << "ERROR: Invalid bayer pattern " << vm["dummy-bayer"].as<std::string>() << std::endl;
+			return 1;
+		}
+	}
+
 	std::vector<std::string> folders;
 	if (!vm["folder"].empty())
 		folders = vm["folder"].as<std::vector<std::string> >();
 
-	std::shared_ptr<CaptureNode> node(new CaptureNode(use_webcams, use_audio, use_dummycam, folders));
+	std::shared_ptr<CaptureNode> node(new CaptureNode(use_webcams, use_audio, use_dummycam, folders, dummy_settings));
+
+	// Replay cameras for load testing
+	if (!vm["replay"].empty())
+	{
+		node->add_cameras(ReplayCamera::get_replay_cameras(vm["replay"].as<std::vector<std::string> >(), 
+			std::max(1, vm["replay-count"].as<int>()), vm["replay-fps"].as<double>()));
+	}
 
 	// HTTP Server
 	NodeHttpServer httpd(node, 8080);
@@ -330,6 +383,13 @@ int main(int argc, char** argv)
 
 	node->GotoState(STATE_EXIT);
 
+	// Takes staged in memory are lost if we exit before they are on disk
+	if (StagedVideoWriter::pending_drains())
+	{
+		std::cout << "Writing staged recordings to disk..." << std::endl;
+		StagedVideoWriter::wait_for_drains();
+	}
+
 	// Close Webserver and Websocet Server
 	httpd.close();
 	http_thread.join();	
@@ -148,8 +148,7 @@ void NodeWSServer<S>::on_message(websocketpp::connection_hdl hdl, typename S::se
         else if (action=="preview")
         {
             std::vector<unsigned char> buf;
-            bool is_histogram = false;
-            if (cam->get_preview_image(buf), &is_histogram)
+            if (cam->get_preview_image(buf))
             {
         	    WSServer<S>::send(hdl, camUniqueId + ";" + base64encode(buf));
             }
@@ -7,6 +7,7 @@
 #include "capturenode.hpp"
 #include "base64.hpp"
 #include "json.hpp"
+#include "video_writer_staged.hpp"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
@@ -118,10 +119,10 @@ std::string NodeHttpServer::getStatusPage(std::shared_ptr<Session> request)
 				ssContent << "<a href=\"/camera/" << cam->unique_id() << "/params\">Parameters</a><br>";
 				ssContent << "Current Effective framerate : " << cam->effective_fps() << "<br>";
 
-				std::map<std::string, CameraParameter> params = cam->params_list(); 
-				for (auto p : params)
+				std::shared_ptr<const Camera::ParamMap> params = cam->params_cached();
+				for (auto& p : *params)
 				{
-					ssContent << "<a href=\"/camera/" << cam->unique_id()  << "/" << p.first << "\">" << p.first  << "</a> : " << cam->param_get(p.first.c_str()) << "<br>";
+					ssContent << "<a href=\"/camera/" << cam->unique_id()  << "/" << p.first << "\">" << p.first  << "</a> : " << p.second.last_value << "<br>";
 				}
 				ssContent << "<a href=\"/camera/" << cam->unique_id()  << "/live\"><img width=\"" << cam->preview_width()  << "\" height=\"" << cam->preview_height()  << "\" src=\"/camera/" << cam->unique_id()  << "/preview\"></a><br>";
 
@@ -179,13 +180,29 @@ std::string NodeHttpServer::getCamerasPage(std::shared_ptr<Session> request)
 			cam.AddMember("framerate", c->framerate(), d.GetAllocator());
 			cam.AddMember("encoding_buffers_used", c->encoding_buffers_used(), d.GetAllocator());
 			cam.AddMember("writing_buffers_used", c->writing_buffers_used(), d.GetAllocator());
+			cam.AddMember("preroll_frames", (unsigned int)c->preroll_capacity(), d.GetAllocator());
+			if (c->sharpness() >= 0.0f)
+				cam.AddMember("sharpness", c->sharpness(), d.GetAllocator());
+
+			// Takes staged in memory that are still being written to disk
+			StagingStatus staging;
+			if (StagedVideoWriter::status(c->unique_id(), staging))
+			{
+				rapidjson::Value st(rapidjson::kObjectType);
+				st.AddMember("frames_pending", (uint64_t)staging.frames_pending, d.GetAllocator());
+				st.AddMember("frames_written", (uint64_t)staging.frames_written, d.GetAllocator());
+				st.AddMember("mb_pending", (double)staging.bytes_pending / 1024 / 1024, d.GetAllocator());
+				st.AddMember("write_rate_mb", staging.write_rate / 1024 / 1024, d.GetAllocator());
+				st.AddMember("eta_seconds", staging.eta, d.GetAllocator());
+				cam.AddMember("staging", st, d.GetAllocator());
+			}
 
 			rapidjson::Value params(rapidjson::kObjectType);
-			auto params_list = c->params_list();
-			for (auto& p : params_list)
+			std::shared_ptr<const Camera::ParamMap> params_list = c->params_cached(); // never reads from the camera
+			for (auto& p : *params_list)
 			{
 				rapidjson::Value param_element(rapidjson::kObjectType);
-				param_element.AddMember("value", c->param_get(p.first.c_str()), d.GetAllocator());
+				param_element.AddMember("value", p.second.last_value, d.GetAllocator());
 				param_element.AddMember("minimum", p.second.minimum, d.GetAllocator());
 				param_element.AddMember("maximum", p.second.maximum, d.GetAllocator());
 				param_element.AddMember("increment", p.second.increment, d.GetAllocator());
@@ -199,13 +216,25 @@ std::string NodeHttpServer::getCamerasPage(std::shared_ptr<Session> request)
 
 			// Encode Image as JPG
 			std::vector<unsigned char> buf;
-			bool is_histogram = false;
-			if (c->get_preview_image(buf, &is_histogram))
+			if (c->get_preview_image(buf))
 			{ 
 				cam.AddMember("jpeg_thumbnail", rapidjson::Value(base64encode(buf).c_str(), d.GetAllocator()), d.GetAllocator());
-				cam.AddMember("jpeg_thumbnail_is_histogram", is_histogram, d.GetAllocator());
 			}
 
+			// Exposure statistics, when the histogram display is enabled
+			auto stats = c->image_stats();
+			if (stats && !stats->empty())
+			{
+				rapidjson::Value histogram;
+				stats->to_json(histogram, d.GetAllocator());
+				cam.AddMember("histogram", histogram, d.GetAllocator());
+			}
+
+			// Per stage latency histograms since the start of the last recording
+			rapidjson::Value latency;
+			c->latency_stats().to_json(latency, d.GetAllocator());
+			cam.AddMember("latency", latency, d.GetAllocator());
+
 			d.PushBack(cam, d.GetAllocator());
 		}
 
@@ -476,7 +505,8 @@ std::string NodeHttpServer::handleRequest(std::shared_ptr<Session> session)
 			if (req_cam_id=="all")
 			{
 				// Act on all cameras of this node
-				list_of_cameras = m_node->cameraList();
+				CameraList all = m_node->cameraList();
+				list_of_cameras.assign(all.begin(), all.end());
 			}
 			else
 			{
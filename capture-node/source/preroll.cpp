@@ -0,0 +1,99 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "preroll.hpp"
+
+PreRollRing::PreRollRing() : m_head(0), m_count(0), m_capacity(0)
+{
+}
+
+void PreRollRing::configure(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_frames.clear();
+	m_frames.resize(capacity);
+	m_head = 0;
+	m_count = 0;
+	m_capacity = capacity;
+}
+
+size_t PreRollRing::size() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_count;
+}
+
+double PreRollRing::duration() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_count < 2)
+		return 0.0;
+	return m_frames[(m_head + m_count - 1) % m_frames.size()].ts - m_frames[m_head].ts;
+}
+
+bool PreRollRing::push(const FrameRef& frame, double ts, int black_level)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_frames.empty())
+		return false;
+
+	if (m_count)
+	{
+		const FrameRef& newest = m_frames[(m_head + m_count - 1) % m_frames.size()].frame;
+		if (newest.width() != frame.width() || newest.height() != frame.height() || newest.type() != frame.type())
+			clear_locked(); // acquisition restarted with another format
+	}
+
+	bool dropped = false;
+	if (m_count == m_frames.size())
+	{
+		// Overwrite the oldest frame, its buffer returns to the pool
+		m_head = (m_head + 1) % m_frames.size();
+		m_count--;
+		dropped = true;
+	}
+
+	PreRollFrame& slot = m_frames[(m_head + m_count) % m_frames.size()];
+	slot.frame = frame;
+	slot.ts = ts;
+	slot.black_level = black_level;
+	m_count++;
+
+	return !dropped;
+}
+
+bool PreRollRing::pop(PreRollFrame& out)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_count)
+		return false;
+
+	PreRollFrame& slot = m_frames[m_head];
+	out.frame = std::move(slot.frame);
+	out.ts = slot.ts;
+	out.black_level = slot.black_level;
+
+	m_head = (m_head + 1) % m_frames.size();
+	m_count--;
+
+	return true;
+}
+
+void PreRollRing::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	clear_locked();
+}
+
+void PreRollRing::clear_locked()
+{
+	for (size_t i = 0; i < m_count; i++)
+		m_frames[(m_head + i) % m_frames.size()].frame.reset();
+	m_head = 0;
+	m_count = 0;
+}
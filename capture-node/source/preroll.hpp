@@ -0,0 +1,52 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "frame_pool.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct PreRollFrame
+{
+	PreRollFrame() : ts(0.0), black_level(0) {}
+
+	FrameRef frame;
+	double ts;
+	int black_level;
+};
+
+class PreRollRing
+{
+	// Last frames of a camera, kept before the recording is triggered so that they can be recorded ahead of the live frames.
+	// The slots are allocated once by configure(). Frames are pooled buffers: when the ring is full, the oldest frame
+	// goes back to the FramePool and is reused by the next capture, so the steady state never allocates.
+public:
+	PreRollRing();
+
+	void configure(size_t capacity); // drops the frames currently held, 0 disables the ring
+	size_t capacity() const { return m_capacity; } // without the lock, got_image checks it on every frame
+
+	size_t size() const;
+	bool empty() const { return size() == 0; }
+	double duration() const; // seconds between the oldest and the newest frame
+
+	// Adds the newest frame. Returns false if the ring was full and the oldest frame was dropped to make room.
+	// The frames held are dropped first if the new one has another size or type, they could not go in the same recording.
+	bool push(const FrameRef& frame, double ts, int black_level);
+
+	// Takes the oldest frame out of the ring
+	bool pop(PreRollFrame& out);
+
+	void clear();
+
+private:
+	void clear_locked();
+
+	mutable std::mutex m_mutex; // between the capture thread and stop_recording
+	std::vector<PreRollFrame> m_frames;
+	size_t m_head; // oldest frame
+	size_t m_count;
+	std::atomic<size_t> m_capacity; // m_frames.size(), also readable while configure() resizes it
+};
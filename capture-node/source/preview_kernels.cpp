@@ -0,0 +1,188 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "preview_kernels.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define PREVIEW_KERNELS_SSE2
+#endif
+
+namespace preview_kernels
+{
+	static std::vector<unsigned char> build_srgb_lut()
+	{
+		// Same curve and rounding as color_correction::linear_to_sRGB on 8 bit images
+		std::vector<unsigned char> lut(256);
+		for (int i = 0; i < 256; i++)
+		{
+			const float linear = i / 255.0f;
+			const float srgb = linear <= 0.0031308f ? 12.92f * linear : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+			const int v = int(srgb * 255.0f);
+			lut[i] = (unsigned char)(v > 255 ? 255 : (v < 0 ? 0 : v));
+		}
+		return lut;
+	}
+
+	static const unsigned char * srgb_lut()
+	{
+		static const std::vector<unsigned char> lut = build_srgb_lut();
+		return &lut[0];
+	}
+
+	BayerLayout bayer_layout(int bayer_pattern)
+	{
+		BayerLayout l;
+		switch (bayer_pattern) {
+			case cv::COLOR_BayerRG2RGB: l.b_x = 0; l.b_y = 0; l.r_x = 1; l.r_y = 1; break; // B G / G R
+			case cv::COLOR_BayerGR2RGB: l.b_x = 1; l.b_y = 0; l.r_x = 0; l.r_y = 1; break; // G B / R G
+			case cv::COLOR_BayerGB2RGB: l.r_x = 1; l.r_y = 0; l.b_x = 0; l.b_y = 1; break; // G R / B G
+			case cv::COLOR_BayerBG2RGB:
+			default: l.r_x = 0; l.r_y = 0; l.b_x = 1; l.b_y = 1; break; // R G / G B
+		}
+		// Greens are on the other diagonal
+		l.g1_x = 1 - l.r_x; l.g1_y = l.r_y;
+		l.g2_x = l.r_x; l.g2_y = 1 - l.r_y;
+		return l;
+	}
+
+	static std::vector<int> sample_positions(int src_size, int dst_size, bool quads)
+	{
+		// Source column (or row) sampled by each output pixel, aligned on bayer quads
+		std::vector<int> pos(dst_size);
+		for (int i = 0; i < dst_size; i++)
+		{
+			int p = (int)((long long)i * src_size / dst_size);
+			if (quads)
+				p = std::min(p & ~1, (src_size & ~1) - 2);
+			pos[i] = std::max(p, 0);
+		}
+		return pos;
+	}
+
+	static void scale_to_8bit(const float * src, unsigned char * dst, int count, float offset, float scale)
+	{
+		// dst = clamp((src - offset) * scale, 0, 255)
+		int i = 0;
+#ifdef PREVIEW_KERNELS_SSE2
+		const __m128 v_offset = _mm_set1_ps(offset);
+		const __m128 v_scale = _mm_set1_ps(scale);
+		const __m128 v_zero = _mm_setzero_ps();
+		const __m128 v_max = _mm_set1_ps(255.0f);
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128 a = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), v_offset), v_scale);
+			__m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i + 4), v_offset), v_scale);
+			a = _mm_min_ps(_mm_max_ps(a, v_zero), v_max);
+			b = _mm_min_ps(_mm_max_ps(b, v_zero), v_max);
+			const __m128i ab = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+			_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(ab, ab));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			const float v = (src[i] - offset) * scale;
+			dst[i] = (unsigned char)(v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (int)v));
+		}
+	}
+
+	template <typename T>
+	static void bayer_thumbnail_impl(const cv::Mat& raw, cv::Mat& out, cv::Size size, const BayerLayout& l,
+		color_correction::rgb_color_balance bal, int black_level, int bitcount)
+	{
+		const std::vector<int> xs = sample_positions(raw.cols, size.width, true);
+		const std::vector<int> ys = sample_positions(raw.rows, size.height, true);
+
+		const float to_8bit = bitcount > 8 ? 1.0f / (1 << (bitcount - 8)) : 1.0f;
+		const unsigned char * lut = srgb_lut();
+
+		std::vector<float> r(size.width), g(size.width), b(size.width);
+		std::vector<unsigned char> r8(size.width), g8(size.width), b8(size.width);
+
+		for (int y = 0; y < size.height; y++)
+		{
+			const T * row0 = raw.ptr<T>(ys[y]);
+			const T * row1 = raw.ptr<T>(ys[y] + 1);
+			const T * rows[2] = { row0, row1 };
+
+			// Gather: only the quads we sample are read
+			for (int x = 0; x < size.width; x++)
+			{
+				const int sx = xs[x];
+				r[x] = rows[l.r_y][sx + l.r_x];
+				b[x] = rows[l.b_y][sx + l.b_x];
+				g[x] = 0.5f * (rows[l.g1_y][sx + l.g1_x] + rows[l.g2_y][sx + l.g2_x]);
+			}
+
+			// Black level, white balance and 8 bit conversion, one channel at a time
+			scale_to_8bit(&r[0], &r8[0], size.width, (float)black_level, bal.kR * to_8bit);
+			scale_to_8bit(&g[0], &g8[0], size.width, (float)black_level, bal.kG * to_8bit);
+			scale_to_8bit(&b[0], &b8[0], size.width, (float)black_level, bal.kB * to_8bit);
+
+			unsigned char * dst = out.ptr<unsigned char>(y);
+			for (int x = 0; x < size.width; x++)
+			{
+				dst[x * 3 + 0] = lut[b8[x]];
+				dst[x * 3 + 1] = lut[g8[x]];
+				dst[x * 3 + 2] = lut[r8[x]];
+			}
+		}
+	}
+
+	template <typename T>
+	static void mono_thumbnail_impl(const cv::Mat& raw, cv::Mat& out, cv::Size size, int bitcount)
+	{
+		const std::vector<int> xs = sample_positions(raw.cols, size.width, false);
+		const std::vector<int> ys = sample_positions(raw.rows, size.height, false);
+
+		const float to_8bit = bitcount > 8 ? 1.0f / (1 << (bitcount - 8)) : 1.0f;
+		const unsigned char * lut = srgb_lut();
+
+		std::vector<float> v(size.width);
+		std::vector<unsigned char> v8(size.width);
+
+		for (int y = 0; y < size.height; y++)
+		{
+			const T * row = raw.ptr<T>(ys[y]);
+			for (int x = 0; x < size.width; x++)
+				v[x] = row[xs[x]];
+
+			scale_to_8bit(&v[0], &v8[0], size.width, 0.0f, to_8bit);
+
+			unsigned char * dst = out.ptr<unsigned char>(y);
+			for (int x = 0; x < size.width; x++)
+				dst[x] = lut[v8[x]];
+		}
+	}
+
+	void bayer_thumbnail(const cv::Mat& raw, cv::Mat& out, cv::Size size, int bayer_pattern,
+		color_correction::rgb_color_balance bal, int black_level, int bitcount)
+	{
+		out.create(size, CV_8UC3);
+		if (raw.rows < 2 || raw.cols < 2 || size.area() == 0)
+			return;
+
+		const BayerLayout l = bayer_layout(bayer_pattern);
+		if (raw.depth() == CV_16U)
+			bayer_thumbnail_impl<unsigned short>(raw, out, size, l, bal, black_level, bitcount);
+		else
+			bayer_thumbnail_impl<unsigned char>(raw, out, size, l, bal, black_level, 8);
+	}
+
+	void mono_thumbnail(const cv::Mat& raw, cv::Mat& out, cv::Size size, int bitcount)
+	{
+		out.create(size, CV_8UC1);
+		if (raw.empty() || size.area() == 0)
+			return;
+
+		if (raw.depth() == CV_16U)
+			mono_thumbnail_impl<unsigned short>(raw, out, size, bitcount);
+		else
+			mono_thumbnail_impl<unsigned char>(raw, out, size, 8);
+	}
+}
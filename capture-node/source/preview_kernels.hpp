@@ -0,0 +1,32 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "color_correction.hpp"
+
+#include <opencv2/core.hpp>
+
+namespace preview_kernels
+{
+	struct BayerLayout
+	{
+		// Position of each color in the 2x2 quad, same convention as the bayer fields of the .ava header
+		int r_x, r_y;
+		int b_x, b_y;
+		int g1_x, g1_y;
+		int g2_x, g2_y;
+	};
+
+	BayerLayout bayer_layout(int bayer_pattern); // bayer_pattern is one of the cv::COLOR_BayerXX2RGB codes
+
+	// Thumbnails computed straight from the raw frame, in a single pass that only reads the pixels it samples.
+	// The cost depends on the size of the thumbnail, not on the size of the sensor.
+
+	// One bayer quad per output pixel: black level, white balance, conversion to 8 bit and sRGB.
+	// raw is CV_8UC1 or CV_16UC1 holding bitcount significant bits, out is CV_8UC3 (BGR).
+	void bayer_thumbnail(const cv::Mat& raw, cv::Mat& out, cv::Size size, int bayer_pattern,
+		color_correction::rgb_color_balance bal, int black_level, int bitcount);
+
+	// Nearest pixel, conversion to 8 bit and sRGB. out is CV_8UC1.
+	void mono_thumbnail(const cv::Mat& raw, cv::Mat& out, cv::Size size, int bitcount);
+}
@@ -3,6 +3,7 @@
 #include "recorder.hpp"
 #include "cameras.hpp"
 #include "color_correction.hpp"
+#include "thread_config.hpp"
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -20,11 +21,13 @@
 
 #include "video_writer_avi.hpp"
 #include "video_writer_ava.hpp"
+#include "video_writer_staged.hpp"
 
 void writeTIF(const FrameToWrite* frame, 
 	int m_bitcount, bool m_color_bayer, int m_bayerpattern, color_correction::rgb_color_balance& m_color_balance)
 {
-	cv::Mat tempImage = frame->img;
+	const cv::Mat img = frame->frame.mat(); // pooled memory shared with other consumers, never written to
+	cv::Mat tempImage = img;
 
 	if (m_color_bayer)
 	{
@@ -34,7 +37,7 @@ void writeTIF(const FrameToWrite* frame,
 
 		// COLOR Image
 
-		cv::cvtColor(frame->img, tempImage, m_bayerpattern);
+		cv::cvtColor(img, tempImage, m_bayerpattern);
 
 		// Color correction is always applied in 16 bit (8 bit images are converted to 16 bit)
 		// Also move 8 bits to MSB in the 16bit word
@@ -57,7 +60,12 @@ void writeTIF(const FrameToWrite* frame,
 		// GRAYSCALE Image (or color native)
 
 		if (m_bitcount>8)
-			tempImage = tempImage * (1 << (16 - m_bitcount)); // 10,12,14 bit images need to be scaled up to 16 bit value range	
+		{
+			// 10,12,14 bit images need to be scaled up to 16 bit value range, in a new image (tempImage is still the pooled frame)
+			cv::Mat scaled;
+			img.convertTo(scaled, CV_16U, 1 << (16 - m_bitcount));
+			tempImage = scaled;
+		}
 	}
 
 
@@ -86,14 +94,16 @@ void writeRAW(const FrameToWrite* frame,
 		float kB;
 	};
 
+	const cv::Mat img = frame->frame.mat();
+
 	raw_info info;
 	memset(&info, 0, sizeof(info));
 	info.magic = 0xED;
 	info.version = 1;
-	info.channels = frame->img.channels();
+	info.channels = img.channels();
 	info.bitcount = m_bitcount;
-	info.width = frame->img.cols;
-	info.height = frame->img.rows;
+	info.width = img.cols;
+	info.height = img.rows;
 	info.blacklevel = frame->blacklevel;
 	if (m_color_bayer)
 	{
@@ -114,7 +124,7 @@ void writeRAW(const FrameToWrite* frame,
 
 	// Our RAW format is actually a TIF file, followed by our information block
 	std::vector<unsigned char> buf;
-	if (cv::imencode(".tif", frame->img, buf))
+	if (cv::imencode(".tif", img, buf))
 		f.write((const char *)&buf[0], buf.size());
 
 	// Append our RAW Info at the end of the file
@@ -132,7 +142,7 @@ Recorder::~Recorder()
 		close();
 }
 
-void Recorder::append(cv::Mat img, double ts, int blacklevel)
+void Recorder::append(const FrameRef& frame, double ts, int blacklevel)
 {
 	std::lock_guard<std::mutex> lock(m_mutex);
 
@@ -141,7 +151,7 @@ void Recorder::append(cv::Mat img, double ts, int blacklevel)
 	m_last_ts = ts;
 
 	if (!m_closed)
-		append_impl(img, ts, blacklevel);
+		append_impl(frame, ts, blacklevel);
 }
 
 void Recorder::close()
@@ -151,7 +161,7 @@ void Recorder::close()
 	close_impl();
 }
 
-void Recorder::append_impl(cv::Mat img, double ts, int blacklevel)
+void Recorder::append_impl(const FrameRef& frame, double ts, int blacklevel)
 {
 	m_frame_count++;
 }
@@ -161,27 +171,39 @@ void Recorder::close_impl()
 	m_closed = true;
 }
 
-SimpleRecorder::SimpleRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, const std::vector<std::string>& folders)
-	: Recorder(framerate, width, height, bitcount, folders), m_unique_name(unique_name), m_dropped_frames(0)
+SimpleRecorder::SimpleRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, const std::vector<std::string>& folders,
+	std::shared_ptr<LatencyStats> latency)
+	: Recorder(framerate, width, height, bitcount, folders), m_unique_name(unique_name), m_dropped_frames(0), m_latency(latency)
 {
 }
 
 SimpleMovieRecorder::SimpleMovieRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, 
 	bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal,
-	const std::vector<std::string>& folders, bool use_ava_format)
-	: SimpleRecorder(unique_name, framerate, width, height, bitcount, folders)
+	const std::vector<std::string>& folders, bool use_ava_format, bool staged, std::shared_ptr<LatencyStats> latency,
+	uint64_t expected_bytes, uint64_t extent_bytes, const std::string& codec, int codec_level,
+	unsigned int filters)
+	: SimpleRecorder(unique_name, framerate, width, height, bitcount, folders, latency)
 {
 	namespace fs = boost::filesystem;
 
 	if (use_ava_format)
 	{
-		// AvaVideoWriter
+		// AvaVideoWriter, striped over the different folders: <name>.ava has the index, <name>.ava.001... the other segments
 
-		fs::path filename = fs::path(m_folders[0]) / (boost::format("%s.ava") % m_unique_name).str();
-		m_filenames.push_back(filename.string());
-		std::unique_ptr<VideoWriter> writer(new AvaVideoWriter(filename.string().c_str(), 
+		std::vector<std::string> segment_folders;
+		for (auto& folder : m_folders)
+			if (std::find(segment_folders.begin(), segment_folders.end(), folder) == segment_folders.end())
+				segment_folders.push_back(folder);
+
+		for (size_t i = 0; i < segment_folders.size(); i++)
+		{
+			fs::path filename = fs::path(segment_folders[i]) / (i == 0 ? (boost::format("%s.ava") % m_unique_name).str() : (boost::format("%s.ava.%03d") % m_unique_name % i).str());
+			m_filenames.push_back(filename.string());
+		}
+
+		std::unique_ptr<VideoWriter> writer(new AvaVideoWriter(m_filenames, 
 			framerate, width, height, bitcount, 
-			color_bayer, bayer_pattern, bal));
+			color_bayer, bayer_pattern, bal, codec, codec_level, filters));
 		m_writers.push_back(std::move(writer));
 	}
 	else
@@ -202,6 +224,19 @@ SimpleMovieRecorder::SimpleMovieRecorder(const std::string& unique_name, int fra
 			index++;
 		}
 	}
+
+	for (auto& writer : m_writers)
+	{
+		writer->set_latency_stats(m_latency);
+		writer->preallocate(expected_bytes / m_writers.size(), extent_bytes / m_writers.size()); // the frames are split between the writers
+	}
+
+	if (staged)
+	{
+		// Record into memory, the writers get the frames at the pace of the drives, after the take if needed
+		for (auto& writer : m_writers)
+			writer.reset(new StagedVideoWriter(m_unique_name, std::move(writer)));
+	}
 }
 
 int SimpleMovieRecorder::buffers_used(int type) const
@@ -212,12 +247,12 @@ int SimpleMovieRecorder::buffers_used(int type) const
 	return (*it)->buffers_used(type);
 }
 
-void SimpleMovieRecorder::append_impl(cv::Mat img, double ts, int blacklevel)
+void SimpleMovieRecorder::append_impl(const FrameRef& frame, double ts, int blacklevel)
 {
-	if (!m_writers[m_frame_count % m_writers.size()]->addFrame(img, ts))
+	if (!m_writers[m_frame_count % m_writers.size()]->addFrame(frame, ts))
 		m_dropped_frames++;
 
-	Recorder::append_impl(img, ts, blacklevel);
+	Recorder::append_impl(frame, ts, blacklevel);
 }
 
 void SimpleMovieRecorder::close_impl()
@@ -225,11 +260,14 @@ void SimpleMovieRecorder::close_impl()
 	Recorder::close_impl();
 
 	for (auto& it : m_writers)
+	{
 		it->close();
+		m_dropped_frames += it->dropped_frames(); // frames the writer accepted but could not encode
+	}
 }
 
-SimpleImageRecorder::SimpleImageRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal, const std::vector<std::string>& folders, bool output_raw)
-	: SimpleRecorder(unique_name, framerate, width, height, bitcount, folders), 
+SimpleImageRecorder::SimpleImageRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal, const std::vector<std::string>& folders, bool output_raw, std::shared_ptr<LatencyStats> latency)
+	: SimpleRecorder(unique_name, framerate, width, height, bitcount, folders, latency), 
 	m_color_bayer(color_bayer), m_bayerpattern(bayer_pattern), m_color_balance(bal), 
 	m_output_raw(output_raw), m_extension(output_raw?"raw":"tif")
 {
@@ -238,6 +276,8 @@ SimpleImageRecorder::SimpleImageRecorder(const std::string& unique_name, int fra
 	// Run TBB Pipeline in a thread
 	pipeline_thread = boost::thread([this]() {
 
+		ThreadConfig::WorkerThreadScope thread_scope;
+
 		// Prepare TBB Pipeline to encode and write frames
 		tbb::filter_t<void,FrameToWrite*> f1(tbb::filter::serial_in_order, [this](tbb::flow_control& fc) -> FrameToWrite* {
 				// Consume m_frame_queue
@@ -252,12 +292,22 @@ SimpleImageRecorder::SimpleImageRecorder(const std::string& unique_name, int fra
 				return frame;
 			});
 		tbb::filter_t<FrameToWrite*,void> f2(tbb::filter::parallel, [this](FrameToWrite * frame){
+
+				const double start = LatencyStats::now();
 		
 				if (m_output_raw)
 					writeRAW(frame, m_bitcount, m_color_bayer, m_bayerpattern, m_color_balance);
 				else
 					writeTIF(frame, m_bitcount, m_color_bayer, m_bayerpattern, m_color_balance);
 
+				if (m_latency)
+				{
+					const double end = LatencyStats::now();
+					m_latency->record(LATENCY_QUEUE, start - frame->queued);
+					m_latency->record(LATENCY_WRITE, end - start); // encoding and writing are one call
+					m_latency->record(LATENCY_TOTAL, end - frame->frame.arrival());
+				}
+
 				delete frame;
 
 			});
@@ -267,7 +317,7 @@ SimpleImageRecorder::SimpleImageRecorder(const std::string& unique_name, int fra
 	});
 }
 
-void SimpleImageRecorder::append_impl(cv::Mat img, double ts, int blacklevel)
+void SimpleImageRecorder::append_impl(const FrameRef& frame, double ts, int blacklevel)
 {
 	namespace fs = boost::filesystem;
 	fs::path filename = fs::path(m_folders[m_frame_count%m_folders.size()]) / (boost::format("%s_%04i.%s") % m_unique_name % m_frame_count % m_extension).str();
@@ -276,14 +326,15 @@ void SimpleImageRecorder::append_impl(cv::Mat img, double ts, int blacklevel)
 
 	// Add to writing queue
 	{
-		FrameToWrite* frame = new FrameToWrite();
-		frame->img = img.clone();
-		frame->filename = filename.string();
-		frame->blacklevel = blacklevel;
-		m_frame_queue.push(frame); // blocking push
+		FrameToWrite* to_write = new FrameToWrite();
+		to_write->frame = frame; // shared with the camera, no copy
+		to_write->filename = filename.string();
+		to_write->blacklevel = blacklevel;
+		to_write->queued = LatencyStats::now();
+		m_frame_queue.push(to_write); // blocking push
 	}
 
-	Recorder::append_impl(img, ts, blacklevel);
+	Recorder::append_impl(frame, ts, blacklevel);
 }
 
 void SimpleImageRecorder::close_impl()
@@ -307,7 +358,7 @@ MetadataRecorder::MetadataRecorder(const std::string& unique_name, int framerate
 	m_meta_log_path = meta_log_path.string();
 }
 
-void MetadataRecorder::append_impl(cv::Mat img, double ts, int blacklevel)
+void MetadataRecorder::append_impl(const FrameRef& frame, double ts, int blacklevel)
 {
 	m_timestamps.push_back(ts);
 
@@ -317,7 +368,7 @@ void MetadataRecorder::append_impl(cv::Mat img, double ts, int blacklevel)
 
 	m_last_black_level = blacklevel;
 
-	Recorder::append_impl(img, ts, blacklevel);
+	Recorder::append_impl(frame, ts, blacklevel);
 }
 
 void MetadataRecorder::close_impl()
@@ -359,8 +410,8 @@ void MetadataRecorder::close_impl()
 			stream << "Using Sync: " << m_camera->using_hardware_sync() << std::endl;
 
 			// Write params
-			for (auto it : m_camera->params_list())
-				stream << "Param " << it.first  << ":" << m_camera->param_get(it.first.c_str()) << std::endl;
+			for (auto& it : *m_camera->params_cached())
+				stream << "Param " << it.first  << ":" << it.second.last_value << std::endl;
 
 			// write frames
 			stream << std::endl << "frame_index;timestamp_s;delta_ms" << std::endl;
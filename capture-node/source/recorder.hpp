@@ -14,6 +14,8 @@
 #include "json.hpp"
 #include "color_correction.hpp"
 #include "video_writer.hpp"
+#include "frame_pool.hpp"
+#include "latency_stats.hpp"
 
 enum { BUFFER_ENCODING, BUFFER_WRITING };
 
@@ -25,7 +27,7 @@ public:
 
 	int frame_count() const { return m_frame_count; }
 
-	void append(cv::Mat img, double ts, int blacklevel);
+	void append(const FrameRef& frame, double ts, int blacklevel);
 	void close();
 
 	virtual void summarize(shared_json_doc summary) = 0;
@@ -37,7 +39,7 @@ public:
 	}
 
 protected:
-	virtual void append_impl(cv::Mat img, double ts, int blacklevel);
+	virtual void append_impl(const FrameRef& frame, double ts, int blacklevel);
 	virtual void close_impl();
 
 protected:
@@ -59,7 +61,8 @@ private:
 class SimpleRecorder : public Recorder
 {
 public:
-	SimpleRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, const std::vector<std::string>& folders);
+	SimpleRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, const std::vector<std::string>& folders,
+		std::shared_ptr<LatencyStats> latency);
 
 	virtual void summarize(shared_json_doc summary) override;
 
@@ -67,14 +70,16 @@ protected:
 	std::vector<std::string> m_filenames;
 	std::string m_unique_name;
 	int m_dropped_frames;
+	std::shared_ptr<LatencyStats> m_latency; // may be null
 };
 
 class FrameToWrite
 {
 public:
-	cv::Mat img;
+	FrameRef frame;
 	std::string filename;
 	int blacklevel;
+	double queued; // LatencyStats::now() when appended
 };
 
 class SimpleImageRecorder : public SimpleRecorder
@@ -84,10 +89,10 @@ class SimpleImageRecorder : public SimpleRecorder
 public:
 	SimpleImageRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, 
 		bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal, 
-		const std::vector<std::string>& folders, bool output_raw);
+		const std::vector<std::string>& folders, bool output_raw, std::shared_ptr<LatencyStats> latency);
 
 protected:
-	virtual void append_impl(cv::Mat img, double ts, int blacklevel) override;
+	virtual void append_impl(const FrameRef& frame, double ts, int blacklevel) override;
 	virtual void close_impl() override;
 
 	void writingThread();
@@ -108,12 +113,14 @@ class SimpleMovieRecorder : public SimpleRecorder
 public:
 	SimpleMovieRecorder(const std::string& unique_name, int framerate, int width, int height, int bitcount, 
 		bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal,
-		const std::vector<std::string>& folders, bool use_ava_format);
+		const std::vector<std::string>& folders, bool use_ava_format, bool staged, std::shared_ptr<LatencyStats> latency,
+		uint64_t expected_bytes = 0, uint64_t extent_bytes = 0, const std::string& codec = "lz4", int codec_level = 0,
+		unsigned int filters = 0);
 
 	virtual int buffers_used(int type) const override;
 
 protected:
-	virtual void append_impl(cv::Mat img, double ts, int blacklevel) override;
+	virtual void append_impl(const FrameRef& frame, double ts, int blacklevel) override;
 	virtual void close_impl() override;
 
 private:
@@ -128,7 +135,7 @@ public:
 	virtual void summarize(shared_json_doc summary) override;
 
 protected:
-	virtual void append_impl(cv::Mat img, double ts, int blacklevel) override;
+	virtual void append_impl(const FrameRef& frame, double ts, int blacklevel) override;
 	virtual void close_impl() override;
 
 private:
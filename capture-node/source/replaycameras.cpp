@@ -0,0 +1,211 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "replaycameras.hpp"
+#include "video_reader_ava.hpp"
+#include "frame_pool.hpp"
+#include "thread_config.hpp"
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+static const double DEFAULT_REPLAY_FRAMERATE = 30.0; // when the recording has no metadata file
+static const double MAX_SLEEP = 0.1; // seconds, so that stop_capture does not wait on a long gap in the recording
+
+ReplayCamera::ReplayCamera(const std::string& filename, int instance, double forced_fps)
+	: m_valid(false), m_forced_rate(forced_fps > 0.0), m_black_level(0)
+{
+	namespace fs = boost::filesystem;
+
+	std::stringstream ss;
+	ss << "Replay_" << fs::path(filename).stem().string() << "_" << instance;
+
+	m_unique_id = ss.str();
+	m_model = "Replay";
+	m_version = "1.0";
+
+	m_reader.reset(new AvaVideoReader(filename.c_str()));
+	if (!m_reader->is_open() || !m_reader->frame_count())
+	{
+		std::cerr << "Replay> " << filename << ": " << (m_reader->is_open() ? "No frames" : m_reader->error()) << std::endl;
+		return;
+	}
+
+	m_framerate = (int)DEFAULT_REPLAY_FRAMERATE;
+	m_black_level = m_reader->blacklevel();
+	load_metadata(filename);
+	if (m_forced_rate)
+		m_framerate = std::max(1, (int)(forced_fps + 0.5));
+
+	m_width = m_reader->width();
+	m_height = m_reader->height();
+	m_bitcount = m_reader->bitcount();
+	m_color_need_debayer = m_reader->bayer_pattern() >= 0;
+	if (m_color_need_debayer)
+	{
+		m_bayerpattern = m_reader->bayer_pattern();
+		m_color_balance = m_reader->color_balance();
+	}
+
+	m_preview_width = default_preview_res;
+	m_preview_height = m_preview_width*m_height / m_width; // keep aspect ratio for preview
+
+	m_valid = true;
+
+	start_capture();
+}
+
+ReplayCamera::~ReplayCamera()
+{
+	stop_capture();
+}
+
+void ReplayCamera::load_metadata(const std::string& filename)
+{
+	// MetadataRecorder writes <camera>.txt next to <camera>.ava, with the framerate and the timestamp of each recorded frame
+	namespace fs = boost::filesystem;
+
+	std::ifstream f(fs::path(filename).replace_extension(".txt").string());
+	if (!f.is_open())
+		return;
+
+	bool in_frames = false;
+	std::string line;
+	while (std::getline(f, line))
+	{
+		if (!in_frames)
+		{
+			if (boost::starts_with(line, "Framerate:"))
+				m_framerate = std::max(1, atoi(line.c_str() + strlen("Framerate:")));
+			else if (boost::starts_with(line, "Black Level:"))
+				m_black_level = atoi(line.c_str() + strlen("Black Level:"));
+			else if (boost::starts_with(line, "frame_index;"))
+				in_frames = true;
+			continue;
+		}
+
+		if (m_reader->has_timestamps())
+			break; // in the frame table of the .ava
+
+		// frame_index; timestamp_s; delta_ms
+		std::vector<std::string> fields;
+		boost::split(fields, line, boost::is_any_of(";"));
+		if (fields.size() < 2)
+			break;
+		m_timestamps.push_back(atof(fields[1].c_str()));
+	}
+
+	if (!m_reader->has_timestamps() && m_timestamps.size() != m_reader->frame_count())
+	{
+		std::cerr << "Replay> " << filename << ": timestamps do not match the frames, using the index" << std::endl;
+		m_timestamps.clear();
+	}
+}
+
+double ReplayCamera::frame_interval(size_t i) const
+{
+	const double period = 1.0 / m_framerate;
+	const size_t next = i + 1;
+
+	if (m_forced_rate || next >= m_reader->frame_count())
+		return period; // also the gap before looping back to the first frame
+
+	if (m_reader->has_timestamps())
+		return std::max(0.0, m_reader->frame_timestamp(next) - m_reader->frame_timestamp(i));
+	if (!m_timestamps.empty())
+		return std::max(0.0, m_timestamps[next] - m_timestamps[i]);
+
+	// Missing frames are holes in the index
+	return (m_reader->frame_slot(next) - m_reader->frame_slot(i)) * period;
+}
+
+std::vector<std::shared_ptr<Camera> > ReplayCamera::get_replay_cameras(const std::vector<std::string>& filenames, int count, double forced_fps)
+{
+	std::vector<std::shared_ptr<Camera> > v;
+
+	for (const std::string& filename : filenames)
+	{
+		for (int i=0;i<count;i++)
+		{
+			std::shared_ptr<ReplayCamera> cam = std::make_shared<ReplayCamera>(filename, i, forced_fps);
+			if (!cam->is_valid())
+				break;
+			v.push_back(cam);
+		}
+	}
+
+	return v;
+}
+
+void ReplayCamera::captureThread()
+{
+	ThreadConfig::CaptureThreadScope thread_scope(m_unique_id);
+
+	typedef std::chrono::steady_clock clock;
+	typedef std::chrono::duration<double> seconds;
+
+	const int container_bitcount = m_reader->frame_type() == CV_16UC1 ? 16 : 8;
+
+	clock::time_point deadline = clock::now();
+	size_t i = 0;
+	while (m_capturing)
+	{
+		// Read and decode the frame before its deadline, it is delivered right on time
+		FrameRef frame;
+		if (!m_reader->read_frame(i, frame))
+		{
+			std::cerr << "Replay> " << m_unique_id << ": could not read frame " << i << std::endl;
+			frame.reset(); // may hold a partly decoded buffer
+		}
+
+		// Wait for the time of this frame, in short steps to stay responsive to stop_capture
+		clock::time_point now = clock::now();
+		while (m_capturing && now < deadline)
+		{
+			std::this_thread::sleep_for(std::min(seconds(deadline - now), seconds(MAX_SLEEP)));
+			now = clock::now();
+		}
+		if (!m_capturing)
+			break;
+
+		// Like a camera that can not keep up: fall behind, but never deliver a burst to catch up
+		if (now - deadline > seconds(1.0 / m_framerate))
+			deadline = now;
+
+		if (!frame.empty())
+		{
+			frame.mark_arrival(); // delivered now, not when the reader filled the buffer
+			const double ts = seconds(deadline.time_since_epoch()).count();
+			Camera::got_image(frame, ts, container_bitcount, 1, m_black_level);
+		}
+
+		deadline += std::chrono::duration_cast<clock::duration>(seconds(frame_interval(i)));
+		i = (i + 1) % m_reader->frame_count();
+	}
+}
+
+void ReplayCamera::start_capture()
+{
+	if (!m_capturing && m_valid)
+	{
+		Camera::start_capture();
+		capture_thread = boost::thread([this]() {captureThread(); });
+	}
+}
+
+void ReplayCamera::stop_capture()
+{
+	if (m_capturing)
+	{
+		Camera::stop_capture();
+		capture_thread.join();
+		m_effective_fps = 0;
+	}
+}
@@ -0,0 +1,46 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "cameras.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class AvaVideoReader;
+
+class ReplayCamera : public Camera
+{
+	// Plays back an .ava recording as a live camera, in a loop, to load test a node without the camera hardware.
+	// Frames are paced at the timestamps of the recording (from the metadata file written next to the .ava),
+	// or at a forced framerate.
+public:
+	ReplayCamera(const std::string& filename, int instance, double forced_fps);
+	~ReplayCamera();
+
+	// count cameras for each file, forced_fps <= 0 plays back at the recorded timestamps
+	static std::vector<std::shared_ptr<Camera> > get_replay_cameras(const std::vector<std::string>& filenames, int count, double forced_fps);
+
+	bool is_valid() const override { return m_valid; }
+
+	void set_hardware_sync(bool enable, int framerate) override {} // playback is paced by the recording
+
+protected:
+	void captureThread();
+	void start_capture() override;
+	void stop_capture() override;
+
+	double frame_interval(size_t i) const; // seconds between frame i and the next one
+
+private:
+	void load_metadata(const std::string& filename);
+
+	std::unique_ptr<AvaVideoReader> m_reader;
+	bool m_valid;
+	bool m_forced_rate;
+	int m_black_level;
+	std::vector<double> m_timestamps; // recorded timestamps of the stored frames, empty if unknown
+
+	boost::thread capture_thread;
+};
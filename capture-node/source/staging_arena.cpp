@@ -0,0 +1,191 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "staging_arena.hpp"
+
+#include <iostream>
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // the arena size is rounded to this
+
+StagingArena& StagingArena::Instance()
+{
+	static StagingArena instance;
+	return instance;
+}
+
+StagingArena::StagingArena() : m_base(0), m_capacity(0), m_huge_pages(false), m_head(0), m_in_use(0)
+{
+}
+
+StagingArena::~StagingArena()
+{
+	free_memory();
+}
+
+bool StagingArena::configure(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	if (bytes == m_capacity)
+		return true;
+
+	if (!m_blocks.empty())
+	{
+		std::cerr << "StagingArena> Cannot resize while " << (m_in_use / 1024 / 1024) << " MB are staged" << std::endl;
+		return false;
+	}
+
+	free_memory();
+
+	if (!bytes)
+		return true;
+
+#ifdef WIN32
+	// Large pages need the SeLockMemoryPrivilege, fall back to regular pages
+	SIZE_T large_page = GetLargePageMinimum();
+	if (large_page && bytes % large_page == 0)
+	{
+		m_base = (unsigned char *)VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		m_huge_pages = m_base != 0;
+	}
+	if (!m_base)
+		m_base = (unsigned char *)VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	// Explicit huge pages if some are reserved (vm.nr_hugepages), then transparent huge pages
+	void * p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	m_huge_pages = p != MAP_FAILED;
+	if (p == MAP_FAILED)
+	{
+		p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			madvise(p, bytes, MADV_HUGEPAGE);
+			for (size_t i = 0; i < bytes; i += alignment)
+				((volatile unsigned char *)p)[i] = 0; // touch every page now rather than during the take
+		}
+	}
+	m_base = p != MAP_FAILED ? (unsigned char *)p : 0;
+	if (m_base && mlock(m_base, bytes) != 0)
+		std::cerr << "StagingArena> Could not lock the arena in memory, it may be swapped out" << std::endl;
+#endif
+
+	if (!m_base)
+	{
+		m_huge_pages = false;
+		std::cerr << "StagingArena> Could not allocate " << (bytes / 1024 / 1024) << " MB" << std::endl;
+		return false;
+	}
+
+	m_capacity = bytes;
+	m_head = 0;
+	m_in_use = 0;
+
+	std::cout << "StagingArena> " << (bytes / 1024 / 1024) << " MB" << (m_huge_pages ? " (huge pages)" : "") << std::endl;
+
+	return true;
+}
+
+void StagingArena::free_memory()
+{
+	// Called with m_mutex locked, or from the destructor
+	if (m_base)
+	{
+#ifdef WIN32
+		VirtualFree(m_base, 0, MEM_RELEASE);
+#else
+		munlock(m_base, m_capacity);
+		munmap(m_base, m_capacity);
+#endif
+	}
+
+	m_base = 0;
+	m_capacity = 0;
+	m_huge_pages = false;
+	m_blocks.clear();
+	m_head = 0;
+	m_in_use = 0;
+}
+
+unsigned char * StagingArena::allocate(size_t size)
+{
+	size = (size + alignment - 1) / alignment * alignment;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_base || !size || size > m_capacity)
+		return 0;
+
+	// Used space goes from the oldest live block (tail) to m_head, possibly wrapping around the end of the arena
+	size_t offset = 0;
+	if (m_blocks.empty())
+	{
+		offset = 0;
+	}
+	else
+	{
+		const size_t tail = m_blocks.front().offset;
+		if (tail < m_head)
+		{
+			if (m_head + size <= m_capacity)
+				offset = m_head;
+			else if (size <= tail)
+				offset = 0; // wrap around, the end of the arena stays unused until the ring catches up
+			else
+				return 0;
+		}
+		else
+		{
+			if (m_head + size <= tail)
+				offset = m_head;
+			else
+				return 0;
+		}
+	}
+
+	Block b;
+	b.offset = offset;
+	b.size = size;
+	b.released = false;
+	m_blocks.push_back(b);
+
+	m_head = offset + size;
+	m_in_use += size;
+
+	return m_base + offset;
+}
+
+void StagingArena::release(unsigned char * ptr)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const size_t offset = ptr - m_base;
+
+	// Blocks are mostly released in order, the search is short
+	for (auto& b : m_blocks)
+	{
+		if (b.offset == offset && !b.released)
+		{
+			b.released = true;
+			m_in_use -= b.size;
+			break;
+		}
+	}
+
+	while (!m_blocks.empty() && m_blocks.front().released)
+		m_blocks.pop_front();
+	if (m_blocks.empty())
+		m_head = 0;
+}
+
+size_t StagingArena::bytes_in_use() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_in_use;
+}
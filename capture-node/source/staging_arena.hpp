@@ -0,0 +1,53 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <cstddef>
+
+class StagingArena
+{
+	// Large memory region, allocated once, where takes are staged when they are recorded faster than the drives can write.
+	// Backed by huge pages when the system has them, and touched up front so that a take never page faults.
+	// Allocations are carved in order from a ring and can be released in any order, the space is reused once
+	// the oldest allocations are released.
+public:
+	static StagingArena& Instance();
+
+	~StagingArena();
+
+	bool configure(size_t bytes); // 0 frees the arena. Fails while staged data is pending.
+
+	unsigned char * allocate(size_t size); // returns 0 when the arena is full
+	void release(unsigned char * ptr);
+
+	bool enabled() const { return m_base != 0; }
+	size_t capacity() const { return m_capacity; }
+	size_t bytes_in_use() const;
+	bool huge_pages() const { return m_huge_pages; }
+
+	static const size_t alignment = 4096;
+
+protected:
+	StagingArena();
+
+private:
+	void free_memory();
+
+	struct Block
+	{
+		size_t offset;
+		size_t size;
+		bool released;
+	};
+
+	mutable std::mutex m_mutex;
+	unsigned char * m_base;
+	size_t m_capacity;
+	bool m_huge_pages;
+
+	std::deque<Block> m_blocks; // live allocations, oldest first
+	size_t m_head; // where the next allocation starts
+	size_t m_in_use;
+};
@@ -0,0 +1,205 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+// .ava recordings written by the AvaVideoWriter and read back by the AvaVideoReader: every codec and filter, striped
+// segments, missing frames, the index of version 4 and 5 files, and recordings that were not closed
+
+#include "test_check.hpp"
+#include "video_writer_ava.hpp"
+#include "video_reader_ava.hpp"
+#include "ava_format.hpp"
+#include "frame_codec.hpp"
+#include "frame_filters.hpp"
+#include "frame_pool.hpp"
+
+#include <opencv2/imgproc.hpp>
+#include <boost/filesystem.hpp>
+
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace fs = boost::filesystem;
+
+static const int WIDTH = 64;
+static const int HEIGHT = 48;
+static const int FRAMES = 120;
+static const int FRAMERATE = 30;
+
+static bool missing(int slot) { return slot % 17 == 5; }
+
+static unsigned int pixel(int slot, size_t i, int bitcount)
+{
+	// Smooth enough for the filters to matter, different for each frame
+	return (unsigned int)((slot * 7 + i / 3 + (i % 5)) & ((1 << bitcount) - 1));
+}
+
+static FrameRef test_frame(int slot, int bitcount)
+{
+	FrameRef frame = FramePool::Instance().acquire(WIDTH, HEIGHT, bitcount > 8 ? CV_16UC1 : CV_8UC1);
+	unsigned char * data = (unsigned char *)frame.data();
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; i++)
+		if (bitcount > 8)
+			((uint16_t *)data)[i] = (uint16_t)pixel(slot, i, bitcount);
+		else
+			data[i] = (unsigned char)pixel(slot, i, bitcount);
+	return frame;
+}
+
+static bool same_frame(const FrameRef& frame, int slot, int bitcount)
+{
+	if (frame.width() != WIDTH || frame.height() != HEIGHT)
+		return false;
+	for (size_t i = 0; i < (size_t)WIDTH * HEIGHT; i++)
+	{
+		const unsigned int v = bitcount > 8 ? ((const uint16_t *)frame.data())[i] : frame.data()[i];
+		if (v != pixel(slot, i, bitcount))
+			return false;
+	}
+	return true;
+}
+
+static std::vector<std::string> write_recording(const fs::path& dir, const std::string& codec, unsigned int filters, int bitcount)
+{
+	fs::create_directories(dir / "a");
+	fs::create_directories(dir / "b");
+	std::vector<std::string> filenames = { (dir / "a" / "cam.ava").string(), (dir / "b" / "cam.ava.001").string() };
+
+	color_correction::rgb_color_balance balance;
+	balance.kR = balance.kG = balance.kB = 1.0f;
+
+	AvaVideoWriter writer(filenames, FRAMERATE, WIDTH, HEIGHT, bitcount, true, cv::COLOR_BayerBG2RGB, balance, codec, 0, filters);
+
+	// Frames of another format are refused
+	CHECK(!writer.addFrame(FramePool::Instance().acquire(WIDTH / 2, HEIGHT, bitcount > 8 ? CV_16UC1 : CV_8UC1), 0.0));
+
+	for (int slot = 0; slot < FRAMES; slot++)
+	{
+		if (missing(slot))
+			continue;
+		FrameRef frame = test_frame(slot, bitcount);
+		while (!writer.addFrame(frame, slot / (double)FRAMERATE))
+			; // queue full
+	}
+
+	writer.close();
+
+	return filenames;
+}
+
+static void check_recording(const std::string& filename, int bitcount, bool complete)
+{
+	AvaVideoReader reader(filename.c_str());
+	CHECK(reader.is_open());
+	if (!reader.is_open())
+	{
+		std::cerr << "  " << filename << ": " << reader.error() << std::endl;
+		return;
+	}
+
+	CHECK(reader.width() == WIDTH);
+	CHECK(reader.height() == HEIGHT);
+	CHECK(reader.bitcount() == bitcount);
+	CHECK(reader.is_complete() == complete);
+	CHECK(reader.has_timestamps() == complete); // the frame table is written when the recording is closed
+
+	size_t expected = 0;
+	for (int slot = 0; slot < FRAMES; slot++)
+		if (!missing(slot))
+			expected++;
+	CHECK(reader.frame_count() == expected);
+
+	size_t i = 0;
+	for (int slot = 0; slot < FRAMES && i < reader.frame_count(); slot++)
+	{
+		if (missing(slot))
+			continue;
+
+		CHECK(reader.frame_slot(i) == (size_t)slot);
+		if (complete)
+			CHECK(reader.frame_timestamp(i) == slot / (double)FRAMERATE);
+
+		FrameRef frame;
+		CHECK(reader.read_frame(i, frame));
+		CHECK(same_frame(frame, slot, bitcount));
+		i++;
+	}
+
+	if (complete)
+		CHECK(reader.find_frame(10.0 / FRAMERATE) == 10 - 1); // one missing frame before slot 10
+}
+
+template <typename T>
+static void patch_header(const std::string& filename, size_t offset, T value)
+{
+	std::fstream f(filename, std::ios::in | std::ios::out | std::ios::binary);
+	f.seekp(offset);
+	f.write((const char *)&value, sizeof(value));
+}
+
+static void check_index()
+{
+	// Slots without a frame are 0 in the locations, the frame table keeps the recording order
+	std::vector<ava_frame_entry> frames(3);
+	memset(&frames[0], 0, frames.size() * sizeof(ava_frame_entry));
+	frames[0].slot = 0; frames[0].location = 100;
+	frames[1].slot = 1; frames[1].location = 200;
+	frames[2].slot = 4; frames[2].location = 300;
+
+	std::vector<unsigned char> block;
+	ava_format::build_index(frames, block);
+
+	ava_index_header header;
+	memcpy(&header, &block[0], sizeof(header));
+	CHECK(header.magic == ava_format::INDEX_MAGIC);
+	CHECK(header.entry_size == sizeof(ava_frame_entry));
+	CHECK(header.slot_count == 5);
+	CHECK(header.frame_count == 3);
+	CHECK(block.size() == sizeof(header) + 5 * sizeof(unsigned long long) + 3 * sizeof(ava_frame_entry));
+
+	const unsigned long long * locations = (const unsigned long long *)&block[sizeof(header)];
+	const unsigned long long expected[5] = { 100, 200, 0, 0, 300 };
+	for (int i = 0; i < 5; i++)
+		CHECK(locations[i] == expected[i]);
+}
+
+int main()
+{
+	const fs::path root = fs::temp_directory_path() / fs::unique_path("ava_test_%%%%%%%%");
+
+	check_index();
+
+	std::vector<std::string> codecs = { "lz4", "lz4hc", "raw" };
+	if (FrameCodec::create("zstd"))
+		codecs.push_back("zstd");
+
+	const unsigned int all_filters = frame_filters::BAYER_PLANES | frame_filters::DELTA | frame_filters::SHUFFLE;
+	int test = 0;
+	for (const std::string& codec : codecs)
+		for (unsigned int filters : { 0u, (unsigned int)frame_filters::DELTA, all_filters })
+			for (int bitcount : { 8, 12 })
+			{
+				const fs::path dir = root / std::to_string(test++);
+				const std::vector<std::string> files = write_recording(dir, codec, filters, bitcount);
+				check_recording(files[0], bitcount, true);
+			}
+
+	// Version 4 files: same layout, the filters field was padding
+	{
+		const std::vector<std::string> files = write_recording(root / "v4", "lz4", 0, 12);
+		patch_header(files[0], offsetof(ava_raw_info, version), ava_format::VERSION_FRAME_TABLE);
+		check_recording(files[0], 12, true);
+	}
+
+	// Not closed (no index yet): read through the checkpoints
+	{
+		const std::vector<std::string> files = write_recording(root / "open", "lz4", all_filters, 12);
+		patch_header(files[0], offsetof(ava_raw_info, index_start_offset), 0ULL);
+		check_recording(files[0], 12, false);
+	}
+
+	fs::remove_all(root);
+
+	return test_result("test_ava_file");
+}
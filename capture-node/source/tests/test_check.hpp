@@ -0,0 +1,24 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <iostream>
+
+// Minimal checks for the ctest programs: report each failure, the exit code is the number of failures
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			s_failures++; \
+		} \
+	} while (0)
+
+inline int test_result(const char * name)
+{
+	std::cout << name << ": " << (s_failures ? "FAILED" : "passed") << std::endl;
+	return s_failures;
+}
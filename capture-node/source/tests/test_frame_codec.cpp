@@ -0,0 +1,77 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+// Round trips of the FrameCodecs, and the tags that the .ava header stores for them
+
+#include "test_check.hpp"
+#include "frame_codec.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+static std::vector<unsigned char> test_frame(size_t size, bool compressible)
+{
+	std::vector<unsigned char> frame(size);
+	for (size_t i = 0; i < size; i++)
+		frame[i] = compressible ? (unsigned char)((i / 64) & 0x0F) : (unsigned char)rand();
+	return frame;
+}
+
+static void round_trip(const std::string& name, int level)
+{
+	std::unique_ptr<FrameCodec> codec = FrameCodec::create(name, level);
+	CHECK(codec);
+	if (!codec)
+		return;
+
+	// The tag in the header gives back the same codec
+	std::unique_ptr<FrameCodec> reader = FrameCodec::from_tag(codec->tag());
+	CHECK(reader);
+	CHECK(reader && strcmp(reader->tag(), codec->tag()) == 0);
+	if (!reader)
+		return;
+
+	for (size_t size : { (size_t)1, (size_t)4096, (size_t)640 * 480 * 2 })
+		for (bool compressible : { false, true })
+		{
+			const std::vector<unsigned char> src = test_frame(size, compressible);
+
+			std::vector<unsigned char> packet(codec->bound(size));
+			const size_t len = codec->compress(&src[0], size, &packet[0], packet.size());
+			CHECK(len > 0 && len <= packet.size());
+			if (!len)
+				continue;
+			if (compressible && size > 4096 && name != "raw")
+				CHECK(len < size / 4);
+
+			std::vector<unsigned char> decoded(size);
+			CHECK(reader->decompress(&packet[0], len, &decoded[0], size));
+			CHECK(decoded == src);
+
+			// A frame of another size is an error, not a partial frame
+			if (size > 1)
+			{
+				std::vector<unsigned char> larger(size + 1);
+				CHECK(!reader->decompress(&packet[0], len, &larger[0], larger.size()));
+			}
+		}
+}
+
+int main()
+{
+	round_trip("lz4", 0);
+	round_trip("lz4hc", 0);
+	round_trip("lz4hc", 4);
+	round_trip("raw", 0);
+#ifdef WITH_ZSTD
+	round_trip("zstd", 0);
+	round_trip("zstd", 9);
+#endif
+
+	CHECK(!FrameCodec::create("unknown"));
+	CHECK(!FrameCodec::from_tag("????"));
+
+	return test_result("test_frame_codec");
+}
@@ -0,0 +1,106 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+// Round trips of the frame_filters, on every combination, 8 to 16 bits, and widths that end in the scalar tails
+// of the SSE2 loops
+
+#include "test_check.hpp"
+#include "frame_filters.hpp"
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+static std::vector<unsigned char> test_frame(int width, int height, int bitcount, bool smooth)
+{
+	// Smooth data goes both up and down, so that the delta filter sees negative differences
+	const size_t samples = (size_t)width * height;
+	std::vector<unsigned char> frame(samples * (bitcount > 8 ? 2 : 1));
+	const int max_value = (1 << bitcount) - 1;
+	for (size_t i = 0; i < samples; i++)
+	{
+		const int x = (int)(i % width);
+		int v = smooth ? max_value / 2 + ((x / 8) % 2 ? -(x % 8) : (x % 8)) : rand();
+		v &= max_value;
+		if (bitcount > 8)
+			((uint16_t *)&frame[0])[i] = (uint16_t)v;
+		else
+			frame[i] = (unsigned char)v;
+	}
+	return frame;
+}
+
+static void round_trip(unsigned int filters, int width, int height, int bitcount, bool smooth)
+{
+	const std::vector<unsigned char> src = test_frame(width, height, bitcount, smooth);
+	std::vector<unsigned char> encoded(src.size()), decoded(src.size());
+
+	filters = frame_filters::supported(filters, width, height, bitcount, true);
+	frame_filters::encode(filters, &src[0], &encoded[0], width, height, bitcount);
+	frame_filters::decode(filters, &encoded[0], &decoded[0], width, height, bitcount);
+
+	CHECK(decoded == src);
+	if (decoded != src)
+		std::cerr << "  filters " << filters << " " << width << "x" << height << " " << bitcount << " bits" << std::endl;
+}
+
+static void check_supported()
+{
+	using namespace frame_filters;
+	const unsigned int all = BAYER_PLANES | DELTA | SHUFFLE;
+	CHECK(supported(all, 64, 48, 12, true) == all);
+	CHECK(supported(all, 64, 48, 12, false) == (DELTA | SHUFFLE)); // not bayer
+	CHECK(supported(all, 63, 48, 12, true) == (DELTA | SHUFFLE)); // odd width
+	CHECK(supported(all, 64, 47, 12, true) == (DELTA | SHUFFLE)); // odd height
+	CHECK(supported(all, 64, 48, 8, true) == (BAYER_PLANES | DELTA)); // no high bytes
+	CHECK(supported(all, 1, 48, 16, false) == SHUFFLE);
+
+	CHECK(parse("bayer, delta,shuffle") == all);
+	CHECK(parse("") == 0);
+	CHECK(parse("delta,unknown") == DELTA);
+}
+
+static void check_layout()
+{
+	using namespace frame_filters;
+
+	// Bayer planes of a 4x2 frame: (even row, even column), (even row, odd column), then the odd row
+	const uint16_t src[8] = { 0, 1, 2, 3, 10, 11, 12, 13 };
+	const uint16_t planes[8] = { 0, 2, 1, 3, 10, 12, 11, 13 };
+	uint16_t dst[8];
+	encode(BAYER_PLANES, (const unsigned char *)src, (unsigned char *)dst, 4, 2, 12);
+	for (int i = 0; i < 8; i++)
+		CHECK(dst[i] == planes[i]);
+
+	// Zigzag coded differences: a slow ramp down leaves all the high bytes of the shuffled differences at 0
+	const int width = 64;
+	std::vector<uint16_t> ramp(width * 2);
+	for (int i = 0; i < width * 2; i++)
+		ramp[i] = (uint16_t)(4000 - (i % width) * 3 + (i & 1));
+	std::vector<uint16_t> coded(ramp.size());
+	encode(DELTA | SHUFFLE, (const unsigned char *)&ramp[0], (unsigned char *)&coded[0], width, 2, 12);
+	const unsigned char * high = (const unsigned char *)&coded[0] + ramp.size();
+	for (int i = 0; i < width * 2; i++)
+		if (i % width) // the first sample of each row is not a difference
+			CHECK(high[i] == 0);
+}
+
+int main()
+{
+	const int widths[] = { 2, 6, 14, 16, 18, 33, 64, 101, 640 };
+	const int heights[] = { 1, 2, 3, 48 };
+	const int bitcounts[] = { 8, 10, 12, 16 };
+
+	for (int bitcount : bitcounts)
+		for (int width : widths)
+			for (int height : heights)
+				for (unsigned int filters = 0; filters < 8; filters++)
+				{
+					round_trip(filters, width, height, bitcount, false);
+					round_trip(filters, width, height, bitcount, true);
+				}
+
+	check_supported();
+	check_layout();
+
+	return test_result("test_frame_filters");
+}
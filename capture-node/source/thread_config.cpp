@@ -0,0 +1,336 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "thread_config.hpp"
+#include "frame_pool.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <boost/thread/thread.hpp>
+#include <tbb/task_scheduler_observer.h>
+
+#ifndef WIN32
+	#include <sched.h>
+	#include <unistd.h>
+	#include <sys/syscall.h>
+	#include <sys/resource.h>
+#endif
+
+class ThreadConfigObserver : public tbb::task_scheduler_observer
+{
+	// Registers the TBB worker threads (where the recorders encode and write frames) as worker threads
+public:
+	ThreadConfigObserver(ThreadConfig* config) : m_config(config) { observe(true); }
+	~ThreadConfigObserver() { observe(false); }
+
+	void on_scheduler_entry(bool is_worker) override
+	{
+		if (is_worker)
+			m_config->register_worker_thread(ThreadConfig::current_thread_id());
+	}
+	void on_scheduler_exit(bool is_worker) override
+	{
+		if (is_worker)
+			m_config->unregister_worker_thread(ThreadConfig::current_thread_id());
+	}
+
+private:
+	ThreadConfig* m_config;
+};
+
+ThreadConfig& ThreadConfig::Instance()
+{
+	static ThreadConfig s_instance;
+	return s_instance;
+}
+
+ThreadConfig::ThreadConfig() : m_configured(false)
+{
+	m_observer.reset(new ThreadConfigObserver(this));
+}
+
+int ThreadConfig::current_thread_id()
+{
+#ifdef WIN32
+	return 0;
+#else
+	return (int)syscall(SYS_gettid);
+#endif
+}
+
+void ThreadConfig::lower_current_thread_priority()
+{
+#ifndef WIN32
+	if (setpriority(PRIO_PROCESS, current_thread_id(), 19) != 0)
+		std::cerr << "ThreadConfig> Could not lower thread priority: " << strerror(errno) << std::endl;
+#endif
+}
+
+std::vector<int> ThreadConfig::parse_cpu_list(const std::string& list)
+{
+	// Same format as the Linux cpulist files and taskset: "0-3,8,10-11"
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ','))
+	{
+		if (range.empty())
+			continue;
+		int first = 0, last = 0;
+		size_t dash = range.find('-');
+		first = atoi(range.substr(0, dash).c_str());
+		last = dash == std::string::npos ? first : atoi(range.substr(dash + 1).c_str());
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+static std::vector<int> read_cpu_list_file(const std::string& filename)
+{
+	std::ifstream f(filename);
+	std::string list;
+	if (f.good())
+		std::getline(f, list);
+	return ThreadConfig::parse_cpu_list(list);
+}
+
+std::vector<int> ThreadConfig::numa_node_cpus(int node)
+{
+	std::stringstream ss;
+	ss << "/sys/devices/system/node/node" << node << "/cpulist";
+	return read_cpu_list_file(ss.str());
+}
+
+std::vector<int> ThreadConfig::online_cpus()
+{
+	std::vector<int> cpus = read_cpu_list_file("/sys/devices/system/cpu/online");
+	if (cpus.empty())
+	{
+		for (int i = 0; i < (int)boost::thread::hardware_concurrency(); i++)
+			cpus.push_back(i);
+	}
+	return cpus;
+}
+
+static std::vector<int> cpu_list_from_json(const rapidjson::Value& v)
+{
+	// Either "0-3,8" or [0,1,2,3,8]
+	std::vector<int> cpus;
+	if (v.IsString())
+		cpus = ThreadConfig::parse_cpu_list(v.GetString());
+	else if (v.IsInt())
+		cpus.push_back(v.GetInt());
+	else if (v.IsArray())
+		for (rapidjson::SizeType i = 0; i < v.Size(); i++)
+			if (v[i].IsInt())
+				cpus.push_back(v[i].GetInt());
+	return cpus;
+}
+
+void ThreadConfig::configure(const rapidjson::Value& v)
+{
+	if (!v.IsObject())
+		return;
+
+	ThreadSettings s;
+
+	if (v.HasMember("capture_policy") && v["capture_policy"].IsString())
+	{
+		std::string policy = v["capture_policy"].GetString();
+		if (policy == "fifo")
+			s.capture_policy = ThreadSettings::POLICY_FIFO;
+		else if (policy == "nice")
+			s.capture_policy = ThreadSettings::POLICY_NICE;
+	}
+	if (v.HasMember("capture_priority") && v["capture_priority"].IsInt())
+		s.capture_priority = std::min(99, std::max(1, v["capture_priority"].GetInt()));
+	if (v.HasMember("capture_nice") && v["capture_nice"].IsInt())
+		s.capture_nice = std::min(19, std::max(-20, v["capture_nice"].GetInt()));
+	if (v.HasMember("capture_cpus"))
+		s.capture_cpus = cpu_list_from_json(v["capture_cpus"]);
+	if (v.HasMember("camera_cpus") && v["camera_cpus"].IsObject())
+	{
+		const rapidjson::Value& cams = v["camera_cpus"];
+		for (rapidjson::Value::ConstMemberIterator itr = cams.MemberBegin(); itr != cams.MemberEnd(); ++itr)
+			s.camera_cpus[itr->name.GetString()] = cpu_list_from_json(itr->value);
+	}
+	if (v.HasMember("worker_cpus"))
+		s.worker_cpus = cpu_list_from_json(v["worker_cpus"]);
+	if (v.HasMember("numa_node") && v["numa_node"].IsInt())
+		s.numa_node = v["numa_node"].GetInt();
+
+	bool numa_changed = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		numa_changed = s.numa_node >= 0 && s.numa_node != m_settings.numa_node;
+		m_settings = s;
+		m_configured = true;
+
+		// Re-apply to the threads that are already running
+		for (auto& it : m_capture_threads)
+			apply_capture(it.second, it.first);
+		for (int tid : m_worker_threads)
+			apply_worker(tid);
+	}
+
+	// Unused frame buffers may live on another node, drop them so that new ones get
+	// first-touched by the capture threads that now run on the right node.
+	if (numa_changed)
+		FramePool::Instance().release_unused();
+}
+
+ThreadSettings ThreadConfig::settings()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_settings;
+}
+
+std::vector<int> ThreadConfig::capture_cpus_for(const std::string& camera_id)
+{
+	auto it = m_settings.camera_cpus.find(camera_id);
+	if (it != m_settings.camera_cpus.end())
+		return it->second;
+
+	if (!m_settings.capture_cpus.empty())
+	{
+		// Each camera keeps its own CPU, assigned in the order the cameras started capturing
+		auto slot = m_capture_slots.find(camera_id);
+		if (slot == m_capture_slots.end())
+			slot = m_capture_slots.insert(std::make_pair(camera_id, (int)m_capture_slots.size())).first;
+		return std::vector<int>(1, m_settings.capture_cpus[slot->second % m_settings.capture_cpus.size()]);
+	}
+
+	if (m_settings.numa_node >= 0)
+		return numa_node_cpus(m_settings.numa_node);
+
+	return std::vector<int>();
+}
+
+std::vector<int> ThreadConfig::worker_cpus()
+{
+	if (!m_settings.worker_cpus.empty())
+		return m_settings.worker_cpus;
+
+	std::vector<int> reserved = m_settings.capture_cpus;
+	for (auto& it : m_settings.camera_cpus)
+		reserved.insert(reserved.end(), it.second.begin(), it.second.end());
+
+	if (reserved.empty() && m_settings.numa_node < 0)
+		return std::vector<int>(); // nothing to do, the scheduler can use any CPU
+
+	// Every CPU of the node (or of the machine) that is not dedicated to a capture thread
+	std::vector<int> all = m_settings.numa_node >= 0 ? numa_node_cpus(m_settings.numa_node) : online_cpus();
+	std::vector<int> cpus;
+	for (int cpu : all)
+		if (std::find(reserved.begin(), reserved.end(), cpu) == reserved.end())
+			cpus.push_back(cpu);
+
+	return cpus.empty() ? all : cpus;
+}
+
+#ifndef WIN32
+static void set_thread_affinity(int tid, const std::vector<int>& cpus)
+{
+	if (cpus.empty())
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(tid, sizeof(set), &set) != 0)
+		std::cerr << "ThreadConfig> Could not set affinity of thread " << tid << ": " << strerror(errno) << std::endl;
+}
+#endif
+
+void ThreadConfig::apply_capture(int tid, const std::string& camera_id)
+{
+#ifndef WIN32
+	if (!m_configured || !tid)
+		return;
+
+	set_thread_affinity(tid, capture_cpus_for(camera_id));
+
+	if (m_settings.capture_policy == ThreadSettings::POLICY_FIFO)
+	{
+		// Requires CAP_SYS_NICE (or an rtprio limit in /etc/security/limits.conf)
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = m_settings.capture_priority;
+		if (sched_setscheduler(tid, SCHED_FIFO, &param) != 0)
+			std::cerr << "ThreadConfig> Could not set SCHED_FIFO for camera " << camera_id << ": " << strerror(errno) << std::endl;
+	}
+	else if (m_settings.capture_policy == ThreadSettings::POLICY_NICE)
+	{
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		sched_setscheduler(tid, SCHED_OTHER, &param);
+		if (setpriority(PRIO_PROCESS, tid, m_settings.capture_nice) != 0)
+			std::cerr << "ThreadConfig> Could not set niceness for camera " << camera_id << ": " << strerror(errno) << std::endl;
+	}
+#endif
+}
+
+void ThreadConfig::apply_worker(int tid)
+{
+#ifndef WIN32
+	if (!m_configured || !tid)
+		return;
+
+	set_thread_affinity(tid, worker_cpus());
+#endif
+}
+
+void ThreadConfig::register_capture_thread(const std::string& camera_id, int tid)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capture_threads[camera_id] = tid;
+	apply_capture(tid, camera_id);
+}
+
+void ThreadConfig::unregister_capture_thread(const std::string& camera_id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capture_threads.erase(camera_id);
+}
+
+void ThreadConfig::register_worker_thread(int tid)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_worker_threads.push_back(tid);
+	apply_worker(tid);
+}
+
+void ThreadConfig::unregister_worker_thread(int tid)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_worker_threads.erase(std::remove(m_worker_threads.begin(), m_worker_threads.end(), tid), m_worker_threads.end());
+}
+
+ThreadConfig::CaptureThreadScope::CaptureThreadScope(const std::string& camera_id) : m_camera_id(camera_id)
+{
+	ThreadConfig::Instance().register_capture_thread(m_camera_id, current_thread_id());
+}
+
+ThreadConfig::CaptureThreadScope::~CaptureThreadScope()
+{
+	ThreadConfig::Instance().unregister_capture_thread(m_camera_id);
+}
+
+ThreadConfig::WorkerThreadScope::WorkerThreadScope()
+{
+	ThreadConfig::Instance().register_worker_thread(current_thread_id());
+}
+
+ThreadConfig::WorkerThreadScope::~WorkerThreadScope()
+{
+	ThreadConfig::Instance().unregister_worker_thread(current_thread_id());
+}
@@ -0,0 +1,99 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+
+#include "json.hpp"
+
+struct ThreadSettings
+{
+	// Scheduling and placement of the capture node threads, received in the "threads" global parameter:
+	// {
+	//   "capture_policy": "fifo",      // "fifo" (SCHED_FIFO), "nice" or "default" to leave capture threads alone
+	//   "capture_priority": 50,        // SCHED_FIFO priority, 1..99
+	//   "capture_nice": -10,           // niceness when the policy is "nice"
+	//   "capture_cpus": "2-9",         // cameras are spread over these CPUs, one CPU per camera
+	//   "camera_cpus": { "<unique_id>": "4" }, // explicit CPUs for some cameras
+	//   "worker_cpus": "10-15",        // encoding, writing and preview threads, by default every CPU not used for capture
+	//   "numa_node": 0                 // keep workers, capture threads and new frame pool memory on this node, -1 for any
+	// }
+
+	enum Policy { POLICY_DEFAULT, POLICY_NICE, POLICY_FIFO };
+
+	ThreadSettings() : capture_policy(POLICY_DEFAULT), capture_priority(50), capture_nice(-10), numa_node(-1) {}
+
+	Policy capture_policy;
+	int capture_priority;
+	int capture_nice;
+	std::vector<int> capture_cpus;
+	std::map<std::string, std::vector<int> > camera_cpus;
+	std::vector<int> worker_cpus;
+	int numa_node;
+};
+
+class ThreadConfig
+{
+	// Applies ThreadSettings to the capture threads (one per camera) and to the worker threads
+	// (TBB workers, writer pipelines, preview threads). Threads register themselves while they run, so that
+	// a new configuration can be applied to threads that are already running. Only implemented on Linux,
+	// on Windows the capture threads keep using SetThreadPriority.
+public:
+	static ThreadConfig& Instance();
+
+	void configure(const rapidjson::Value& v);
+	ThreadSettings settings();
+
+	// RAII registration of the current thread, for the lifetime of the thread function
+	class CaptureThreadScope
+	{
+	public:
+		explicit CaptureThreadScope(const std::string& camera_id);
+		~CaptureThreadScope();
+	private:
+		std::string m_camera_id;
+	};
+	class WorkerThreadScope
+	{
+	public:
+		WorkerThreadScope();
+		~WorkerThreadScope();
+	};
+
+	static int current_thread_id();
+	static void lower_current_thread_priority(); // lowest niceness, for housekeeping threads that must not compete with capture
+	static std::vector<int> parse_cpu_list(const std::string& list); // "0-3,8" -> 0,1,2,3,8
+	static std::vector<int> numa_node_cpus(int node);
+	static std::vector<int> online_cpus();
+
+protected:
+	ThreadConfig();
+
+private:
+	friend class ThreadConfigObserver;
+
+	void register_capture_thread(const std::string& camera_id, int tid);
+	void unregister_capture_thread(const std::string& camera_id);
+	void register_worker_thread(int tid);
+	void unregister_worker_thread(int tid);
+
+	// Called with m_mutex locked
+	std::vector<int> capture_cpus_for(const std::string& camera_id);
+	std::vector<int> worker_cpus();
+	void apply_capture(int tid, const std::string& camera_id);
+	void apply_worker(int tid);
+
+	std::mutex m_mutex;
+	bool m_configured;
+	ThreadSettings m_settings;
+
+	std::map<std::string, int> m_capture_threads; // camera unique_id -> thread id
+	std::map<std::string, int> m_capture_slots; // camera unique_id -> index in capture_cpus, stable across restarts
+	std::vector<int> m_worker_threads;
+
+	std::unique_ptr<class ThreadConfigObserver> m_observer;
+};
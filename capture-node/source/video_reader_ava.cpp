@@ -0,0 +1,392 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "video_reader_ava.hpp"
+#include "frame_pool.hpp"
+#include "frame_filters.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+AvaVideoReader::AvaVideoReader(const char * filename) : m_valid(false), m_has_timestamps(false), m_scan_offset(0)
+{
+	memset(&m_info, 0, sizeof(m_info));
+
+	m_segments.emplace_back(new std::ifstream(filename, std::ios::in | std::ios::binary));
+	std::ifstream& f = *m_segments[0];
+	if (!f.is_open())
+	{
+		m_error = "Cannot open file";
+		return;
+	}
+
+	f.seekg(0, std::ios::end);
+	const unsigned long long file_size = f.tellg();
+	f.seekg(0, std::ios::beg);
+
+	// Header
+	if (!f.read((char *)&m_info, sizeof(m_info)))
+	{
+		m_error = "Invalid Ava Sequence file (header)";
+		return;
+	}
+	if (m_info.magic != ava_format::MAGIC)
+	{
+		m_error = "Invalid Ava Sequence file (magic)";
+		return;
+	}
+	if (m_info.version < ava_format::VERSION || m_info.version > ava_format::VERSION_FILTERS)
+	{
+		m_error = "Invalid Ava Sequence file (version)";
+		return;
+	}
+	char tag[sizeof(m_info.compression) + 1] = {};
+	memcpy(tag, m_info.compression, sizeof(m_info.compression));
+	m_codec = FrameCodec::from_tag(tag);
+	if (!m_codec)
+	{
+		m_error = "Invalid Ava Sequence file (unknown compression)";
+		return;
+	}
+	if (m_info.channels != 1 || m_info.bitcount < 8 || m_info.bitcount > 16 || !m_info.width || !m_info.height)
+	{
+		m_error = "Unsupported Ava Sequence file (image format)";
+		return;
+	}
+	if (m_info.version < ava_format::VERSION_FILTERS)
+		m_info.filters = 0;
+	if (m_info.filters != frame_filters::supported(m_info.filters, m_info.width, m_info.height, m_info.bitcount, bayer_pattern() >= 0))
+	{
+		m_error = "Unsupported Ava Sequence file (frame filters)";
+		return;
+	}
+
+	if (m_info.version >= ava_format::VERSION_STRIPED && !read_segment_table(filename))
+		return;
+	m_scan_offset = f.tellg(); // the records of a version 3 file start after the segment table
+
+	if (m_info.version >= ava_format::VERSION_FRAMED && !is_complete())
+	{
+		m_valid = true;
+		refresh();
+		return;
+	}
+
+	m_valid = read_index(file_size);
+}
+
+bool AvaVideoReader::read_index(unsigned long long file_size)
+{
+	if (m_info.version >= ava_format::VERSION_FRAME_TABLE)
+		return read_frame_table(file_size);
+
+	std::ifstream& f = *m_segments[0];
+
+	// Index, an offset (or a location since version 2) per frame slot until the end of the file
+	const unsigned long long index_offset = m_info.index_start_offset;
+	if (index_offset < sizeof(m_info) || index_offset > file_size || (file_size - index_offset) % sizeof(unsigned long long))
+	{
+		m_error = "Invalid Ava Sequence file (invalid index size)";
+		return false;
+	}
+
+	std::vector<unsigned long long> index((size_t)((file_size - index_offset) / sizeof(unsigned long long)));
+	f.seekg(index_offset);
+	if (!index.empty() && !f.read((char *)&index[0], index.size() * sizeof(unsigned long long)))
+	{
+		m_error = "Invalid Ava Sequence file (index)";
+		return false;
+	}
+
+	// Where the frames of each segment end
+	std::vector<unsigned long long> segment_end(m_segments.size(), index_offset);
+	for (size_t i = 1; i < m_segments.size(); i++)
+	{
+		m_segments[i]->seekg(0, std::ios::end);
+		segment_end[i] = m_segments[i]->tellg();
+	}
+
+	const bool striped = m_info.version >= ava_format::VERSION_STRIPED;
+	std::vector<long long> last_in_segment(m_segments.size(), -1); // position in m_frames
+	for (size_t slot = 0; slot < index.size(); slot++)
+	{
+		if (!index[slot])
+			continue; // frame was not recorded
+
+		FrameEntry e;
+		e.segment = striped ? ava_format::location_segment(index[slot]) : 0;
+		e.offset = striped ? ava_format::location_offset(index[slot]) : index[slot];
+		e.size = 0;
+		e.slot = slot;
+		e.ts = 0.0;
+
+		const long long last = e.segment < m_segments.size() ? last_in_segment[e.segment] : -1;
+		if (e.segment >= m_segments.size() || e.offset < sizeof(m_info) || e.offset >= segment_end[e.segment] || 
+			(last >= 0 && e.offset <= m_frames[(size_t)last].offset))
+		{
+			m_error = "Invalid Ava Sequence file (frame offset)";
+			m_frames.clear();
+			return false;
+		}
+
+		// Before version 3, the size of a packet is the distance to the next one in the same segment
+		if (last >= 0)
+			m_frames[(size_t)last].size = (unsigned int)(e.offset - m_frames[(size_t)last].offset);
+		last_in_segment[e.segment] = (long long)m_frames.size();
+		m_frames.push_back(e);
+	}
+
+	// The last packet of each segment ends at the index, or at the end of the segment file
+	for (size_t i = 0; i < m_segments.size(); i++)
+		if (last_in_segment[i] >= 0)
+			m_frames[(size_t)last_in_segment[i]].size = (unsigned int)(segment_end[i] - m_frames[(size_t)last_in_segment[i]].offset);
+
+	return true;
+}
+
+bool AvaVideoReader::read_frame_table(unsigned long long file_size)
+{
+	std::ifstream& f = *m_segments[0];
+
+	// Index header, the locations of the slots, then one entry per frame
+	const unsigned long long index_offset = m_info.index_start_offset;
+	ava_index_header header;
+	f.clear();
+	f.seekg(index_offset);
+	if (index_offset < sizeof(m_info) || !f.read((char *)&header, sizeof(header)) || header.magic != ava_format::INDEX_MAGIC || 
+		header.entry_size != sizeof(ava_frame_entry) || header.frame_count > header.slot_count ||
+		index_offset + sizeof(header) + header.slot_count * sizeof(unsigned long long) + header.frame_count * sizeof(ava_frame_entry) != file_size)
+	{
+		m_error = "Invalid Ava Sequence file (invalid index size)";
+		return false;
+	}
+
+	std::vector<ava_frame_entry> table((size_t)header.frame_count);
+	f.seekg(index_offset + sizeof(header) + header.slot_count * sizeof(unsigned long long));
+	if (!table.empty() && !f.read((char *)&table[0], table.size() * sizeof(ava_frame_entry)))
+	{
+		m_error = "Invalid Ava Sequence file (frame table)";
+		return false;
+	}
+
+	m_frames.reserve(table.size());
+	for (auto& t : table)
+	{
+		FrameEntry e;
+		e.segment = ava_format::location_segment(t.location);
+		e.offset = ava_format::location_offset(t.location);
+		e.size = t.size;
+		e.slot = (size_t)t.slot;
+		e.ts = t.ts;
+
+		if (e.segment >= m_segments.size() || e.offset < sizeof(m_info) || (!m_frames.empty() && e.slot <= m_frames.back().slot))
+		{
+			m_error = "Invalid Ava Sequence file (frame table)";
+			m_frames.clear();
+			return false;
+		}
+		m_frames.push_back(e);
+	}
+
+	m_has_timestamps = true;
+	return true;
+}
+
+size_t AvaVideoReader::find_frame(double ts) const
+{
+	auto it = std::lower_bound(m_frames.begin(), m_frames.end(), ts, [](const FrameEntry& e, double t) { return e.ts < t; });
+	return it - m_frames.begin();
+}
+
+bool AvaVideoReader::refresh()
+{
+	if (!m_valid || m_info.version < ava_format::VERSION_FRAMED || is_complete())
+		return false;
+
+	std::ifstream& f = *m_segments[0];
+	f.clear();
+
+	// The index is written after the last checkpoint when the recording is closed, it is not read as records
+	unsigned long long index_offset = 0;
+	f.seekg(offsetof(struct ava_raw_info, index_start_offset));
+	f.read((char *)&index_offset, sizeof(index_offset));
+	f.clear();
+	f.seekg(0, std::ios::end);
+	const unsigned long long limit = index_offset ? index_offset : (unsigned long long)f.tellg();
+
+	const size_t before = m_frames.size();
+	while (m_scan_offset + sizeof(ava_packet_header) <= limit)
+	{
+		// Both records start with a 32 bytes header
+		ava_packet_header header;
+		f.seekg(m_scan_offset);
+		if (!f.read((char *)&header, sizeof(header)))
+			break;
+
+		if (header.magic == ava_format::PACKET_MAGIC && header.size <= max_packet_size())
+		{
+			m_scan_offset += sizeof(header) + header.size;
+			continue;
+		}
+
+		if (header.magic != ava_format::CHECKPOINT_MAGIC)
+			break; // not written yet
+
+		ava_checkpoint_header cp;
+		memcpy(&cp, &header, sizeof(cp));
+		std::vector<unsigned long long> entries(cp.count);
+		if (m_scan_offset + sizeof(cp) + entries.size() * sizeof(unsigned long long) > limit)
+			break;
+		if (!entries.empty() && !f.read((char *)&entries[0], entries.size() * sizeof(unsigned long long)))
+			break;
+		if (ava_format::crc32(entries.empty() ? 0 : &entries[0], entries.size() * sizeof(unsigned long long)) != cp.checksum)
+			break; // not completely written yet
+
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (!entries[i] || ava_format::location_segment(entries[i]) >= m_segments.size())
+				continue;
+
+			FrameEntry e;
+			e.segment = ava_format::location_segment(entries[i]);
+			e.offset = ava_format::location_offset(entries[i]);
+			e.size = 0;
+			e.slot = (size_t)(cp.first_slot + i);
+			e.ts = 0.0; // in the frame table, once the recording is closed
+			m_frames.push_back(e);
+		}
+		m_scan_offset += sizeof(cp) + entries.size() * sizeof(unsigned long long);
+	}
+	f.clear();
+
+	if (index_offset)
+	{
+		// Closed: all the frames are in the checkpoints, the frame table has their timestamps
+		m_info.index_start_offset = index_offset;
+		if (m_info.version >= ava_format::VERSION_FRAME_TABLE)
+		{
+			f.seekg(0, std::ios::end);
+			m_frames.clear();
+			m_valid = read_frame_table(f.tellg());
+		}
+	}
+
+	return m_frames.size() > before;
+}
+
+std::string AvaVideoReader::segment_path(const std::string& filename, const std::string& recorded_path)
+{
+	// A copy of the take next to the first file comes first, the other drives of the recording node may still have
+	// the segments of the original
+	namespace fs = boost::filesystem;
+	const fs::path moved = fs::path(filename).parent_path() / fs::path(recorded_path).filename();
+	if (fs::exists(moved))
+		return moved.string();
+	return recorded_path;
+}
+
+size_t AvaVideoReader::max_packet_size() const
+{
+	return ava_format::max_packet_size(m_info);
+}
+
+bool AvaVideoReader::read_segment_table(const std::string& filename)
+{
+	namespace fs = boost::filesystem;
+
+	std::ifstream& f = *m_segments[0];
+
+	unsigned int count = 0;
+	if (!f.read((char *)&count, sizeof(count)) || count < 1 || count > ava_format::MAX_SEGMENTS)
+	{
+		m_error = "Invalid Ava Sequence file (segment table)";
+		return false;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		unsigned short len = 0;
+		std::string path;
+		if (f.read((char *)&len, sizeof(len)))
+		{
+			path.resize(len);
+			if (len)
+				f.read(&path[0], len);
+		}
+		if (!f)
+		{
+			m_error = "Invalid Ava Sequence file (segment table)";
+			return false;
+		}
+		if (i == 0)
+			continue; // this file
+
+		std::unique_ptr<std::ifstream> segment(new std::ifstream(segment_path(filename, path).c_str(), std::ios::in | std::ios::binary));
+		if (!segment->is_open())
+		{
+			m_error = "Missing Ava Sequence segment " + fs::path(path).filename().string();
+			return false;
+		}
+		m_segments.push_back(std::move(segment));
+	}
+
+	return true;
+}
+
+color_correction::rgb_color_balance AvaVideoReader::color_balance() const
+{
+	color_correction::rgb_color_balance bal;
+	bal.kR = m_info.kR;
+	bal.kG = m_info.kG;
+	bal.kB = m_info.kB;
+	return bal;
+}
+
+int AvaVideoReader::frame_type() const
+{
+	return m_info.bitcount > 8 ? CV_16UC1 : CV_8UC1;
+}
+
+bool AvaVideoReader::read_frame(size_t i, FrameRef& frame)
+{
+	if (!m_valid || i >= m_frames.size())
+		return false;
+
+	const FrameEntry& e = m_frames[i];
+	std::ifstream& f = *m_segments[e.segment];
+	f.clear();
+	f.seekg(e.offset);
+
+	size_t size = e.size;
+	if (m_info.version >= ava_format::VERSION_FRAMED)
+	{
+		// The size is in the packet header
+		ava_packet_header header;
+		if (!f.read((char *)&header, sizeof(header)) || header.magic != ava_format::PACKET_MAGIC || header.size > max_packet_size())
+			return false;
+		size = header.size;
+	}
+	if (!size)
+		return false;
+
+	m_packet.resize(size);
+	if (!f.read(&m_packet[0], size))
+		return false;
+
+	frame = FramePool::Instance().acquire(width(), height(), frame_type());
+	if (frame.empty())
+		return false; // pool exhausted
+
+	// We are the only owner of this buffer until it is handed over, it is safe to write to it
+	cv::Mat dst = frame.mat();
+	if (!m_info.filters)
+		return m_codec->decompress((const unsigned char *)&m_packet[0], size, dst.data, frame.size());
+
+	// Filtered frame, decompressed next to the destination then transformed back
+	m_filtered.resize(frame.size());
+	if (!m_codec->decompress((const unsigned char *)&m_packet[0], size, &m_filtered[0], frame.size()))
+		return false;
+	frame_filters::decode(m_info.filters, &m_filtered[0], dst.data, width(), height(), bitcount());
+	return true;
+}
@@ -0,0 +1,83 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "ava_format.hpp"
+#include "color_correction.hpp"
+#include "frame_codec.hpp"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+class FrameRef;
+
+class AvaVideoReader
+{
+	// Sequential access to the frames of an .ava file written by AvaVideoWriter.
+	// Striped recordings are read as one sequence, the segment files are looked for next to the first file,
+	// then where they were recorded. Not thread safe, each user opens its own reader.
+public:
+	AvaVideoReader(const char * filename);
+
+	bool is_open() const { return m_valid; }
+	const std::string& error() const { return m_error; }
+
+	int width() const { return m_info.width; }
+	int height() const { return m_info.height; }
+	int bitcount() const { return m_info.bitcount; }
+	int channels() const { return m_info.channels; }
+	int blacklevel() const { return m_info.blacklevel; }
+	int bayer_pattern() const { return ava_format::get_bayer(m_info); } // cv::COLOR_BayerXX2RGB, -1 if not bayer
+	color_correction::rgb_color_balance color_balance() const;
+	int frame_type() const; // CV_8UC1 or CV_16UC1
+
+	// Frames that were stored in the file, the missing frames of the index are skipped
+	size_t frame_count() const { return m_frames.size(); }
+	size_t frame_slot(size_t i) const { return m_frames[i].slot; } // position of the frame in the index, in frame periods from the first slot
+
+	// Since version 4, recording timestamps in seconds, from the frame table
+	bool has_timestamps() const { return m_has_timestamps; }
+	double frame_timestamp(size_t i) const { return m_frames[i].ts; }
+	size_t find_frame(double ts) const; // first frame recorded at or after ts, frame_count() if none
+
+	// Decompress one frame into a pooled buffer. Returns false if the file is corrupt or the pool is exhausted.
+	bool read_frame(size_t i, FrameRef& frame);
+
+	// Recordings that are not closed (still recording, or interrupted) are read through their checkpoints.
+	// refresh() adds the frames of the checkpoints written since, returns true if there are new frames.
+	bool is_complete() const { return m_info.index_start_offset != 0; }
+	bool refresh();
+
+	// Where to open a segment of a striped recording: next to the first file, or where it was recorded
+	static std::string segment_path(const std::string& filename, const std::string& recorded_path);
+
+private:
+	struct FrameEntry
+	{
+		unsigned int segment;
+		unsigned long long offset;
+		unsigned int size; // compressed
+		size_t slot;
+		double ts; // 0 if not known
+	};
+
+	bool read_segment_table(const std::string& filename);
+	bool read_index(unsigned long long file_size);
+	bool read_frame_table(unsigned long long file_size);
+	size_t max_packet_size() const;
+
+	bool m_valid;
+	bool m_has_timestamps;
+	std::string m_error;
+
+	ava_raw_info m_info;
+	std::unique_ptr<FrameCodec> m_codec; // from the compression field of the header
+	std::vector<FrameEntry> m_frames;
+	unsigned long long m_scan_offset; // next record to read in the first segment, when following the checkpoints
+
+	std::vector<std::unique_ptr<std::ifstream> > m_segments; // the first one is the file that was opened
+	std::vector<char> m_packet;
+	std::vector<unsigned char> m_filtered; // decompressed frame before frame_filters::decode
+};
@@ -2,7 +2,11 @@
 
 #pragma once
 
-namespace cv { class Mat; }
+#include <memory>
+#include <cstdint>
+
+class FrameRef;
+class LatencyStats;
 
 class VideoWriter
 {
@@ -10,7 +14,17 @@ public:
 	VideoWriter() {}
 	virtual ~VideoWriter() {}
 
-	virtual bool addFrame(const cv::Mat& img, double ts) = 0;
+	virtual bool addFrame(const FrameRef& frame, double ts) = 0;
 	virtual void close() = 0;
 	virtual int buffers_used(int type) const = 0;
+	virtual int dropped_frames() const { return 0; } // accepted by addFrame but not written, e.g. the encoder failed
+
+	// Where the writer records the time spent in each stage, set before the first frame
+	void set_latency_stats(std::shared_ptr<LatencyStats> stats) { m_latency = stats; }
+
+	// Disk space to reserve for the output file, see DirectFile::preallocate
+	virtual void preallocate(uint64_t expected_size, uint64_t extent) {}
+
+protected:
+	std::shared_ptr<LatencyStats> m_latency; // may be null
 };
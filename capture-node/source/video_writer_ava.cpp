@@ -1,13 +1,18 @@
 // Copyright (C) 2017 Electronic Arts Inc.  All rights reserved.
 
 #include "video_writer_ava.hpp"
+#include "ava_format.hpp"
 #include "recorder.hpp"
+#include "frame_pool.hpp"
+#include "thread_config.hpp"
+#include "latency_stats.hpp"
+#include "frame_filters.hpp"
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/opencv.hpp>
 
 #include <iostream>
-#include <lz4.h>
+#include <algorithm>
 #include <chrono>
 #include <tbb/pipeline.h>
 
@@ -15,55 +20,67 @@ struct FrameToEncode
 {
 	FrameToEncode() : index(0) {} 
 
-	std::vector<unsigned char> img_buf;
+	FrameRef frame; // pooled image data, shared with the camera
 	unsigned int index;
     double ts;
+	double queued; // LatencyStats::now() in addFrame
 };
 
 struct PacketToWrite
 {
 	std::vector<unsigned char> buf;
 	double ts;
+	double arrival; // of the frame, for the total latency
+	unsigned int checksum;
 };
 
-AvaVideoWriter::AvaVideoWriter(const char * filename, 
+AvaVideoWriter::AvaVideoWriter(const std::vector<std::string>& filenames, 
 	int framerate, int width, int height, int bpp,
-	bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal) 
-: m_framerate(framerate), m_width(width), m_height(height), m_closed(false), m_frame_counter(0), m_bpp(bpp)
+	bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal,
+	const std::string& codec, int codec_level, unsigned int filters) 
+: m_framerate(framerate), m_width(width), m_height(height), m_closed(false), m_frame_counter(0), m_bpp(bpp),
+	m_last_ts(0.0), m_checkpoint_slot(0), m_last_checkpoint(0), m_packets_since_checkpoint(0)
 {
 	m_frame_queue.set_capacity(300); // TODO
 	m_packets_in_flight = 0;
+	m_encode_failures = 0;
 	m_frame_unused.set_capacity(300);
 	m_paquet_unused.set_capacity(300);
 
-    // File I/O: Open file
-    m_f = std::fstream(filename, std::ios::out | std::ios::binary);
+	m_codec = FrameCodec::create(codec, codec_level);
+	if (!m_codec)
+	{
+		std::cerr << "Encoder> Codec " << codec << " not available, using lz4" << std::endl;
+		m_codec = FrameCodec::create("lz4");
+	}
+	m_filters = frame_filters::supported(filters, width, height, bpp, color_bayer);
+	m_frame_type = bpp > 8 ? CV_16UC1 : CV_8UC1;
+	m_frame_bytes = (size_t)width * height * (bpp > 8 ? 2 : 1);
 
-	// Write File Header
-	struct ava_raw_info {
-		unsigned char magic; // 0xED
-		unsigned char version; // 1
-		unsigned char channels; // 1 or 3
-		unsigned char bitcount; // 8..16
-		unsigned int width;
-		unsigned int height;
-		unsigned int blacklevel;
-		unsigned char bayer0; // first row, first pixel
-		unsigned char bayer1; // first row, second pixel
-		unsigned char bayer2; // second row, first pixel
-		unsigned char bayer3; // second row, second pixel
-		float kR;
-		float kG;
-		float kB;
-
-		char compression[4];
-		unsigned long long index_start_offset; // offset un bytes from the start of the file where the index will start
-	};
+    // File I/O: Open files, packets are written asynchronously and bypass the page cache
+	std::vector<std::string> segment_names;
+	for (size_t i = 0; i < filenames.size() && i < ava_format::MAX_SEGMENTS; i++)
+	{
+		std::unique_ptr<DirectFile> f(new DirectFile);
+		if (!f->open(filenames[i]) && i > 0)
+		{
+			std::cerr << "Encoder> Not striping to " << filenames[i] << std::endl; // drive not available, record to the others
+			continue;
+		}
+		DurableLatency * durable = new DurableLatency;
+		m_durable.emplace_back(durable);
+		f->set_durable_callback([durable](uint64_t size) { durable->durable(size); });
 
+		m_segments.push_back(std::move(f));
+		segment_names.push_back(i > 0 ? filenames[i] : std::string());
+	}
+	DirectFile& main_file = *m_segments[0];
+
+	// Write File Header
 	ava_raw_info info;
 	memset(&info, 0, sizeof(info));
-	info.magic = 0xED;
-	info.version = 1;
+	info.magic = ava_format::MAGIC;
+	info.version = ava_format::VERSION_FILTERS;
 	info.channels = 1; // would be 3 only for RGB data
 	info.bitcount = m_bpp;
 	info.width = m_width;
@@ -71,29 +88,36 @@ AvaVideoWriter::AvaVideoWriter(const char * filename,
 	info.blacklevel = 0; // TODO
 	if (color_bayer)
 	{
-		switch (bayer_pattern) {
-			case cv::COLOR_BayerRG2RGB: info.bayer0 = 'B'; info.bayer1 = 'G'; info.bayer2 = 'G'; info.bayer3 = 'R'; break;
-			case cv::COLOR_BayerBG2RGB: info.bayer0 = 'R'; info.bayer1 = 'G'; info.bayer2 = 'G'; info.bayer3 = 'B'; break;
-			case cv::COLOR_BayerGR2RGB: info.bayer0 = 'G'; info.bayer1 = 'B'; info.bayer2 = 'R'; info.bayer3 = 'G'; break;
-			case cv::COLOR_BayerGB2RGB: info.bayer0 = 'G'; info.bayer1 = 'R'; info.bayer2 = 'B'; info.bayer3 = 'G'; break;
-			default: info.bayer0 = ' '; info.bayer1 = ' '; info.bayer2 = ' '; info.bayer3 = ' '; break;
-		}
+		ava_format::set_bayer(info, bayer_pattern);
 		info.kR = bal.kR;
 		info.kG = bal.kG;
 		info.kB = bal.kB;
 	}
-	info.compression[0] = 'L';
-	info.compression[1] = 'Z';
-	info.compression[2] = '4';
+	strncpy(info.compression, m_codec->tag(), sizeof(info.compression));
+	info.filters = m_filters;
 
-	m_f.write((const char *)&info, sizeof(ava_raw_info));
+	main_file.write(&info, sizeof(ava_raw_info));
 
 	m_offset_for_index_start = offsetof(struct ava_raw_info, index_start_offset);
-	m_offset_for_packets = m_f.tellg();
+
+	// Segment table, and a copy of the header at the start of the other segments
+	unsigned int count = (unsigned int)segment_names.size();
+	main_file.write(&count, sizeof(count));
+	for (auto& name : segment_names)
+	{
+		unsigned short len = (unsigned short)name.size();
+		main_file.write(&len, sizeof(len));
+		main_file.write(name.data(), len);
+	}
+
+	for (size_t i = 1; i < m_segments.size(); i++)
+		m_segments[i]->write(&info, sizeof(ava_raw_info));
 
 	// Run TBB Pipeline in a thread
 	pipeline_thread = boost::thread([this]() {
 
+		ThreadConfig::WorkerThreadScope thread_scope;
+
 		// Prepare TBB Pipeline to encode and write frames
 		tbb::filter_t<void,FrameToEncode*> f1(tbb::filter::serial_in_order, [this](tbb::flow_control& fc) -> FrameToEncode* {
 				// Consume m_frame_queue
@@ -110,26 +134,95 @@ AvaVideoWriter::AvaVideoWriter(const char * filename,
 		tbb::filter_t<FrameToEncode*,PacketToWrite*> f2(tbb::filter::parallel, [this](FrameToEncode * frame){
 
 				// Encode one frame
+				const double start = LatencyStats::now();
+
 				PacketToWrite* packet = allocate_packet();
 
 				packet->ts = frame->ts;
-				packet->buf.resize(frame->img_buf.size()*2);
-				int len = LZ4_compress_default((const char *)&frame->img_buf[0], (char *)&packet->buf[0], 
-					frame->img_buf.size(), packet->buf.size());
+				packet->arrival = frame->frame.arrival();
+				// Reversible filters first, in a buffer of this encoding thread
+				const unsigned char * data = frame->frame.data();
+				if (m_filters)
+				{
+					static thread_local std::vector<unsigned char> filtered;
+					filtered.resize(m_frame_bytes);
+					frame_filters::encode(m_filters, data, &filtered[0], m_width, m_height, m_bpp);
+					data = &filtered[0];
+				}
+
+				packet->buf.resize(m_codec->bound(m_frame_bytes));
+				size_t len = m_codec->compress(data, m_frame_bytes, &packet->buf[0], packet->buf.size());
+				if (!len)
+				{
+					// Dropped: no packet to write, the slot of the frame stays empty in the index
+					std::cerr << "Encoder> Failed to compress frame " << frame->index << ", dropped" << std::endl;
+					m_encode_failures++;
+					deallocate_packet(&packet);
+					deallocate_frame(&frame);
+					return packet; // null, the write stage skips it
+				}
 				packet->buf.resize(len);
+				packet->checksum = ava_format::crc32(&packet->buf[0], packet->buf.size());
+
+				if (m_latency)
+				{
+					m_latency->record(LATENCY_QUEUE, start - frame->queued);
+					m_latency->record(LATENCY_ENCODE, LatencyStats::now() - start);
+				}
 
 				deallocate_frame(&frame);
 
 				return packet;			
 			});
 		tbb::filter_t<PacketToWrite*,void> f3(tbb::filter::serial_in_order, [this](PacketToWrite * packet){
-			
-				// Write one packet to disk
-				// File I/O: Write packet to disk
-				m_f.write((const char *)&packet->buf[0], packet->buf.size());
 
-				// Store timestamp with index, check if frames are missing, to build index
-				m_written_packets.push_back(std::pair<double, unsigned int>(packet->ts, packet->buf.size()));
+				if (!packet)
+					return; // dropped by the encoder
+				// Write one packet to disk
+				const double start = LatencyStats::now();
+
+				// File I/O: Write packet to disk, to the segment that has the least data so far
+				unsigned int segment = 0;
+				for (unsigned int i = 1; i < m_segments.size(); i++)
+					if (m_segments[i]->size() < m_segments[segment]->size())
+						segment = i;
+
+				// Position of the frame in the index, in frame periods: missing frames leave empty slots
+				unsigned long long slot = 0;
+				if (!m_index.empty())
+					slot = m_index.size() + std::max(0, int((packet->ts - m_last_ts) * m_framerate - 0.5));
+				m_last_ts = packet->ts;
+
+				ava_packet_header header;
+				memset(&header, 0, sizeof(header));
+				header.magic = ava_format::PACKET_MAGIC;
+				header.size = (unsigned int)packet->buf.size();
+				header.slot = slot;
+				header.ts = packet->ts;
+				header.checksum = packet->checksum;
+
+				DirectFile& file = *m_segments[segment];
+				const unsigned long long location = ava_format::make_location(segment, file.size());
+				file.write(&header, sizeof(header));
+				file.write(&packet->buf[0], packet->buf.size());
+
+				// Write and total latency are recorded when the write of the packet completes
+				if (m_latency)
+					m_durable[segment]->written(m_latency, file.size(), start, packet->arrival);
+
+				// Index, written in the first segment every second and at the end
+				m_index.resize(slot + 1, 0);
+				m_index[slot] = location;
+
+				ava_frame_entry entry;
+				entry.ts = packet->ts;
+				entry.slot = slot;
+				entry.location = location;
+				entry.size = header.size;
+				entry.checksum = header.checksum;
+				m_frame_table.push_back(entry);
+				if (++m_packets_since_checkpoint >= std::max(1, m_framerate))
+					write_checkpoint();
 
 				deallocate_packet(&packet);
 			});
@@ -173,6 +266,7 @@ FrameToEncode* AvaVideoWriter::allocate_frame()
 
 void AvaVideoWriter::deallocate_frame(FrameToEncode** frame)
 {
+	(*frame)->frame.reset(); // return the image memory to the pool right away
 	m_frame_unused.push(*frame);
     *frame = 0;
 }
@@ -195,17 +289,23 @@ void AvaVideoWriter::deallocate_packet(PacketToWrite** packet)
 	m_packets_in_flight--;
 }
 
-bool AvaVideoWriter::addFrame(const cv::Mat& img, double ts)
+bool AvaVideoWriter::addFrame(const FrameRef& img, double ts)
 {
-	const int byteperpixel = m_bpp == 8 ? 1 : 2;
+	// The header has one format for the whole recording, the encoder reads m_frame_bytes of each frame
+	if (img.width() != m_width || img.height() != m_height || img.type() != m_frame_type)
+	{
+		std::cerr << "Encoder> Dropped Frame, " << img.width() << "x" << img.height() << " type " << img.type()
+			<< " instead of " << m_width << "x" << m_height << " type " << m_frame_type << std::endl;
+		return false;
+	}
 
 	FrameToEncode* frame = allocate_frame();
 
-	// Copy image data to FrameToEncode
-	frame->img_buf.resize(img.total() * img.elemSize());
-	memcpy(&frame->img_buf[0], img.data, frame->img_buf.size());
+	// Keep a reference to the pooled image data, the encoder reads it directly
+	frame->frame = img;
     frame->ts = ts;
 	frame->index = m_frame_counter;
+	frame->queued = LatencyStats::now();
 
 	if (!m_frame_queue.try_push(frame))
 	{
@@ -227,34 +327,55 @@ void AvaVideoWriter::close()
 
 	m_closed = true;
 
-	unsigned long long zero = 0;
-	unsigned long long index_offset = m_f.tellg();
-	unsigned long long cur_packet_offset = m_offset_for_packets;
+	DirectFile& main_file = *m_segments[0];
 
-	// Write index
+	// Last checkpoint, so that readers following the recording get all the frames
+	if (m_checkpoint_slot < m_index.size())
+		write_checkpoint();
 
-	for (int i=0;i<m_written_packets.size();i++)
-	{
-		double offset = (i>0) ? (m_written_packets[i].first - m_written_packets[i-1].first) : 0.0;
-		double ts_offset_ratio = offset * m_framerate;
-
-		// Write offset for this frame
-		m_f.write((const char *)&cur_packet_offset, sizeof(unsigned long long)); 
-
-		// Write offset=0 for missing frames (frames that were not recorded according to timestamps)
-		int nb_extra_frames = int(ts_offset_ratio-0.5);
-		for (int j=0;j<nb_extra_frames;j++)
-			m_f.write((const char *)&zero, sizeof(unsigned long long));
-
-		cur_packet_offset += m_written_packets[i].second;
-	}
+	// Write index and frame table in one block
+	unsigned long long index_offset = main_file.size();
+	std::vector<unsigned char> index;
+	ava_format::build_index(m_frame_table, index);
+	main_file.write(&index[0], index.size());
 
 	// Write offset for start of index
-	m_f.seekg(m_offset_for_index_start);
-	m_f.write((const char *)&index_offset, sizeof(unsigned long long));
+	main_file.write_at(m_offset_for_index_start, &index_offset, sizeof(unsigned long long));
+
+    // File I/O: Close files
+	bool ok = true;
+	for (auto& f : m_segments)
+		ok = f->close() && ok;
+	if (!ok)
+		std::cerr << "Encoder> Recording may be incomplete" << std::endl;
+}
 
-    // File I/O: Close file
-    m_f.close();
+void AvaVideoWriter::write_checkpoint()
+{
+	// Index entries of the frames written since the previous checkpoint
+	DirectFile& main_file = *m_segments[0];
+
+	ava_checkpoint_header cp;
+	memset(&cp, 0, sizeof(cp));
+	cp.magic = ava_format::CHECKPOINT_MAGIC;
+	cp.count = (unsigned int)(m_index.size() - m_checkpoint_slot);
+	cp.first_slot = m_checkpoint_slot;
+	cp.previous = m_last_checkpoint;
+	cp.checksum = ava_format::crc32(&m_index[m_checkpoint_slot], cp.count * sizeof(unsigned long long));
+
+	m_last_checkpoint = main_file.size();
+	main_file.write(&cp, sizeof(cp));
+	main_file.write(&m_index[m_checkpoint_slot], cp.count * sizeof(unsigned long long));
+
+	m_checkpoint_slot = m_index.size();
+	m_packets_since_checkpoint = 0;
+}
+
+void AvaVideoWriter::preallocate(uint64_t expected_size, uint64_t extent)
+{
+	// The packets are balanced between the segments
+	for (auto& f : m_segments)
+		f->preallocate(expected_size / m_segments.size(), extent / m_segments.size());
 }
 
 int AvaVideoWriter::buffers_used(int type) const
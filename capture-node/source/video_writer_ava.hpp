@@ -6,10 +6,17 @@ namespace cv { class Mat; }
 
 #include <tbb/concurrent_queue.h>
 #include <boost/thread.hpp>
-#include <fstream>
+
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "video_writer.hpp"
 #include "color_correction.hpp"
+#include "direct_file.hpp"
+#include "ava_format.hpp"
+#include "frame_codec.hpp"
+#include "latency_stats.hpp"
 
 struct FrameToEncode;
 struct PacketToWrite;
@@ -17,14 +24,19 @@ struct PacketToWrite;
 class AvaVideoWriter : public VideoWriter
 {
 public:
-	AvaVideoWriter(const char * filename, 
+	// With several filenames the recording is striped: the frames are spread over one segment file per filename,
+	// the first file has the index of all the frames (see ava_format.hpp)
+	AvaVideoWriter(const std::vector<std::string>& filenames, 
 		int framerate, int width, int height, int bpp,
-		bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal);
+		bool color_bayer, int bayer_pattern, color_correction::rgb_color_balance bal,
+		const std::string& codec = "lz4", int codec_level = 0, unsigned int filters = 0);
 	virtual ~AvaVideoWriter();
 
-	virtual bool addFrame(const cv::Mat& img, double ts) override;
+	virtual bool addFrame(const FrameRef& frame, double ts) override;
 	virtual void close() override;
 	virtual int buffers_used(int type) const override;
+	virtual int dropped_frames() const override { return m_encode_failures; }
+	virtual void preallocate(uint64_t expected_size, uint64_t extent) override;
 
 protected:
 	FrameToEncode* allocate_frame();
@@ -33,26 +45,39 @@ protected:
 	PacketToWrite* allocate_packet();
 	void deallocate_packet(PacketToWrite** frame);
 
+	void write_checkpoint();
+
 private:
 	int m_frame_counter;
 	int m_framerate;
 	int m_width;
 	int m_height;
 	int m_bpp;
+	int m_frame_type; // CV_8UC1 or CV_16UC1, the only frames addFrame accepts
+	size_t m_frame_bytes; // of each frame, what the filters and the codec read
 	bool m_closed;
 
 	unsigned int m_offset_for_index_start;
-	unsigned int m_offset_for_packets;
 
-	std::fstream m_f;
+	std::unique_ptr<FrameCodec> m_codec; // shared by the encoding threads
+	unsigned int m_filters; // frame_filters applied before the codec, the ones that apply to this image format
+
+	std::vector<std::unique_ptr<DurableLatency> > m_durable; // one per segment, outlives the completions of m_segments
+	std::vector<std::unique_ptr<DirectFile> > m_segments; // the first one has the header, the checkpoints and the index
 
-	std::vector<std::pair<double, unsigned int> > m_written_packets;
+	std::vector<unsigned long long> m_index; // location of the packet of each slot, 0 for missing frames
+	std::vector<ava_frame_entry> m_frame_table; // timestamp, slot, location and size of each packet
+	double m_last_ts;
+	unsigned long long m_checkpoint_slot; // first slot that is not in a checkpoint yet
+	unsigned long long m_last_checkpoint; // offset in the first segment
+	int m_packets_since_checkpoint;
 
 	tbb::concurrent_bounded_queue<FrameToEncode*> m_frame_unused;
 	tbb::concurrent_bounded_queue<PacketToWrite*> m_paquet_unused;
 
 	tbb::concurrent_bounded_queue<FrameToEncode*> m_frame_queue;
 	tbb::atomic<int> m_packets_in_flight;
+	tbb::atomic<int> m_encode_failures; // frames dropped by the encoding threads
 
 	boost::thread pipeline_thread;
 };
@@ -2,9 +2,13 @@
 
 #include "video_writer_avi.hpp"
 #include "recorder.hpp"
+#include "frame_pool.hpp"
+#include "thread_config.hpp"
+#include "latency_stats.hpp"
 
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 
 #include <opencv2/highgui.hpp>
 
@@ -14,33 +18,30 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/buffer.h>
 }
 
+struct PooledFrame
+{
+	// Owner of the pooled image wrapped by an AVFrame, released by libav
+	FrameRef frame;
+	double queued; // LatencyStats::now() in addFrame
+};
+
+struct AviPacketToWrite
+{
+	AVPacket* packet;
+	double arrival; // of the frame, for the total latency
+};
+
 bool AviVideoWriter::s_global_init = false;
 int AviVideoWriter::s_frame_row_alignment = 32;
 
-int ffio_set_buf_size(AVIOContext *s, int buf_size)
-{
-	uint8_t *buffer;
-	buffer = (uint8_t*)av_malloc(buf_size);
-	if (!buffer)
-		return AVERROR(ENOMEM);
-
-	av_free(s->buffer);
-	s->buffer = buffer;
-	s->orig_buffer_size =
-		s->buffer_size = buf_size;
-	s->buf_ptr = buffer;
-
-	s->buf_end = s->buffer + s->buffer_size;
-	s->write_flag = 1;
-	
-	return 0;
-}
+static const int AVIO_BUFFER_SIZE = 1024 * 1024; // the muxer hands the data to m_file in blocks of this size
 
 AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width, int height, int bpp)
 	: m_framerate(framerate), m_width(width), m_height(height), m_closed(false), m_frame_counter(0),
-		m_av_stream(0), m_fmt_ctx(0), m_c(0), m_format_opts(0), m_bpp(bpp)
+		m_av_stream(0), m_fmt_ctx(0), m_c(0), m_format_opts(0), m_bpp(bpp), m_io_pos(0)
 {
 	m_frame_queue.set_capacity(300); // TODO
 	m_paquet_queue.set_capacity(300);
@@ -127,16 +128,23 @@ AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width,
 	// open the output file, if needed
 	if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE)) 
 	{
-		ret = avio_open2(&m_fmt_ctx->pb, filename, AVIO_FLAG_WRITE, 0, 0);
-		if (ret < 0) 
+		// The muxer writes through our DirectFile: asynchronously, and without going through the page cache
+		m_file.set_durable_callback([this](uint64_t size) { m_durable.durable(size); });
+		if (!m_file.open(filename))
 		{
 			std::cerr << "Could not open file " << filename << std::endl;
 			return;
 		}
 
-		// TODO implement my own IO
-
-		ffio_set_buf_size(m_fmt_ctx->pb, 64 * 1024 * 1024); // TODO
+		unsigned char * io_buffer = (unsigned char *)av_malloc(AVIO_BUFFER_SIZE);
+		m_fmt_ctx->pb = io_buffer ? avio_alloc_context(io_buffer, AVIO_BUFFER_SIZE, 1, this, NULL, io_write, io_seek) : 0;
+		if (!m_fmt_ctx->pb)
+		{
+			std::cerr << "Could not allocate IO context for " << filename << std::endl;
+			av_free(io_buffer);
+			return;
+		}
+		m_fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
 	}
 
 	avformat_write_header(m_fmt_ctx, &m_format_opts);
@@ -144,6 +152,8 @@ AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width,
 	// Run TBB Pipeline in a thread
 	pipeline_thread = boost::thread([this]() {
 
+		ThreadConfig::WorkerThreadScope thread_scope;
+
 		// Prepare TBB Pipeline to encode and write frames
 		tbb::filter_t<void,AVFrame*> f1(tbb::filter::serial_in_order, [this](tbb::flow_control& fc) -> AVFrame* {
 				// Consume m_frame_queue
@@ -157,10 +167,15 @@ AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width,
 
 				return frame;
 			});
-		tbb::filter_t<AVFrame*,AVPacket*> f2(tbb::filter::serial_in_order, [this](AVFrame * frame){
+		tbb::filter_t<AVFrame*,AviPacketToWrite*> f2(tbb::filter::serial_in_order, [this](AVFrame * frame){
 
 				// Encode one frame
 				{
+					const double start = LatencyStats::now();
+					const PooledFrame* pooled = (const PooledFrame*)av_buffer_get_opaque(frame->buf[0]);
+					const double queued = pooled->queued;
+					const double arrival = pooled->frame.arrival();
+
 					int ret = 0;
 					int got_output = 0;
 
@@ -173,9 +188,15 @@ AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width,
 					// Encode Frame
 					ret = avcodec_encode_video2(m_c, packet, frame, &got_output);
 
+					if (m_latency)
+					{
+						m_latency->record(LATENCY_QUEUE, start - queued);
+						m_latency->record(LATENCY_ENCODE, LatencyStats::now() - start);
+					}
+
 					//std::cout << "frame compressed to " << packet->size << "\n"; // DEBUG
 
-					// Deallocate frame memory (TODO: return to available queue)
+					// Release the frame, the pooled image goes back to the FramePool
 					deallocate_frame(&frame);
 
 					{
@@ -186,26 +207,39 @@ AviVideoWriter::AviVideoWriter(const char * filename, int framerate, int width,
 							{
 								std::cerr << "Writer> Dropped Frame!" << std::endl;
 								delete packet;
-								return (AVPacket*)nullptr;
+								return (AviPacketToWrite*)nullptr;
 							}
 						}
 						else
 						{
-							return (AVPacket*)nullptr;
+							delete packet;
+							return (AviPacketToWrite*)nullptr;
 						}
 					}
 
-					return packet;			
+					AviPacketToWrite* to_write = new AviPacketToWrite;
+					to_write->packet = packet;
+					to_write->arrival = arrival;
+					return to_write;
 				}
 			});
-		tbb::filter_t<AVPacket*,void> f3(tbb::filter::serial_in_order, [this](AVPacket * packet){
+		tbb::filter_t<AviPacketToWrite*,void> f3(tbb::filter::serial_in_order, [this](AviPacketToWrite * to_write){
 				// Write one packet to disk
+				if (to_write)
 				{
+					const double start = LatencyStats::now();
+
+					AVPacket* packet = to_write->packet;
 					packet->stream_index = m_av_stream->index;
 					av_interleaved_write_frame(m_fmt_ctx, packet);
 
+					// Write and total latency are recorded when the write of the packet completes, past the muxer and AVIO buffers
+					if (m_latency)
+						m_durable.written(m_latency, (uint64_t)avio_tell(m_fmt_ctx->pb), start, to_write->arrival);
+
 					av_packet_unref(packet);
 					delete packet;
+					delete to_write;
 				}
 			});
 
@@ -234,12 +268,11 @@ int AviVideoWriter::buffers_used(int type) const
 	return 0;
 }
 
-bool AviVideoWriter::addFrame(const cv::Mat& img, double ts)
+bool AviVideoWriter::addFrame(const FrameRef& img, double ts)
 {
-	const int byteperpixel = m_bpp == 8 ? 1 : 2;
-
-	AVFrame* frame = allocate_frame(); // TODO We should not allocate each frame, there whould be a queue of available frame struct to use.
-	memcpy(frame->data[0], img.data, m_width*m_height*byteperpixel);
+	AVFrame* frame = allocate_frame(img);
+	if (!frame)
+		return false;
 	frame->pts = m_frame_counter;
 	if (!m_frame_queue.try_push(frame))
 	{
@@ -294,19 +327,78 @@ void AviVideoWriter::close()
 
 
 	// Close the output file
-	if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
-		avio_closep(&m_fmt_ctx->pb);
+	if (m_fmt_ctx->pb)
+	{
+		avio_flush(m_fmt_ctx->pb);
+		av_freep(&m_fmt_ctx->pb->buffer);
+		av_freep(&m_fmt_ctx->pb);
+	}
+	if (m_file.is_open() && !m_file.close())
+		std::cerr << "Writer> Recording may be incomplete" << std::endl;
 
 	if (m_fmt_ctx)
 		avformat_free_context(m_fmt_ctx);
 	av_dict_free(&m_format_opts);
 }
 
-AVFrame* AviVideoWriter::allocate_frame()
+int AviVideoWriter::io_write(void * opaque, uint8_t * buf, int size)
 {
-	AVFrame* frame = 0;
+	// The muxer writes sequentially, except when it goes back to update the headers and the indexes
+	AviVideoWriter* w = (AviVideoWriter*)opaque;
+	DirectFile& file = w->m_file;
+
+	bool ok = true;
+	static const unsigned char zeros[4096] = { 0 };
+	while (ok && w->m_io_pos > file.size()) // seek past the end
+		ok = file.write(zeros, (size_t)std::min<uint64_t>(sizeof(zeros), w->m_io_pos - file.size()));
+
+	const uint64_t end = file.size();
+	const size_t inside = (size_t)std::min<uint64_t>(size, end - w->m_io_pos);
+	if (ok && inside)
+		ok = file.write_at(w->m_io_pos, buf, inside);
+	if (ok && size > (int)inside)
+		ok = file.write(buf + inside, size - inside);
+
+	w->m_io_pos += size;
+
+	return ok ? size : AVERROR(EIO);
+}
+
+int64_t AviVideoWriter::io_seek(void * opaque, int64_t offset, int whence)
+{
+	AviVideoWriter* w = (AviVideoWriter*)opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return (int64_t)w->m_file.size();
+	case SEEK_SET:
+		w->m_io_pos = offset;
+		break;
+	case SEEK_CUR:
+		w->m_io_pos += offset;
+		break;
+	case SEEK_END:
+		w->m_io_pos = w->m_file.size() + offset;
+		break;
+	default:
+		return -1;
+	}
 
-	frame = av_frame_alloc();
+	return (int64_t)w->m_io_pos;
+}
+
+static void release_pooled_frame(void* opaque, uint8_t* data)
+{
+	// Called by libav when the last reference to the AVFrame data goes away
+	delete (PooledFrame*)opaque;
+}
+
+AVFrame* AviVideoWriter::allocate_frame(const FrameRef& img)
+{
+	// Wrap the pooled image in an AVFrame without copying it, the encoder only reads the frame data.
+	// Pool buffers are page aligned, and the width is a multiple of s_frame_row_alignment.
+
+	AVFrame* frame = av_frame_alloc();
 	if (!frame)
 	{
 		std::cerr << "Could not allocate video frame" << std::endl;
@@ -316,21 +408,26 @@ AVFrame* AviVideoWriter::allocate_frame()
 	frame->width = m_c->width;
 	frame->height = m_c->height;
 
-	int ret = av_image_alloc(frame->data, frame->linesize, m_c->width, m_c->height, m_c->pix_fmt, s_frame_row_alignment);
-	if (ret < 0)
+	PooledFrame* ref = new PooledFrame;
+	ref->frame = img;
+	ref->queued = LatencyStats::now();
+	frame->buf[0] = av_buffer_create((uint8_t*)img.data(), (int)img.size(), release_pooled_frame, ref, AV_BUFFER_FLAG_READONLY);
+	if (!frame->buf[0])
 	{
-		std::cerr << "Could not allocate raw picture buffer" << std::endl;
+		std::cerr << "Could not wrap raw picture buffer" << std::endl;
+		delete ref;
+		av_frame_free(&frame);
 		return 0;
 	}
 
+	frame->data[0] = frame->buf[0]->data;
+	frame->linesize[0] = m_width * (m_bpp == 8 ? 1 : 2);
+
 	return frame;
 }
 
 void AviVideoWriter::deallocate_frame(AVFrame** frame)
 {
 	if (*frame)
-	{
-		av_freep(&(*frame)->data[0]);
-		av_frame_free(frame);
-	}
+		av_frame_free(frame); // releases the pooled image through release_pooled_frame
 }
@@ -6,7 +6,10 @@ namespace cv { class Mat; }
 
 #include <tbb/concurrent_queue.h>
 #include <boost/thread.hpp>
+#include <cstdint>
 #include "video_writer.hpp"
+#include "direct_file.hpp"
+#include "latency_stats.hpp"
 
 struct AVFrame;
 struct AVPacket;
@@ -17,19 +20,24 @@ public:
 	AviVideoWriter(const char * filename, int framerate, int width, int height, int bpp);
 	~AviVideoWriter();
 
-	bool addFrame(const cv::Mat& img, double ts) override;
+	bool addFrame(const FrameRef& frame, double ts) override;
 	void close() override;
 	int buffers_used(int type) const override;
+	void preallocate(uint64_t expected_size, uint64_t extent) override { m_file.preallocate(expected_size, extent); }
 
 	static int frame_row_alignment() { return s_frame_row_alignment; }
 
 protected:
-	AVFrame* allocate_frame();
+	AVFrame* allocate_frame(const FrameRef& img);
 	void deallocate_frame(AVFrame** frame);
 
 	void encodingThread();
 	void writingThread();
 
+	// Custom IO for the muxer
+	static int io_write(void * opaque, uint8_t * buf, int size);
+	static int64_t io_seek(void * opaque, int64_t offset, int whence);
+
 private:
 	int m_frame_counter;
 	int m_framerate;
@@ -46,6 +54,10 @@ private:
 	struct AVCodecContext* m_c;
 	struct AVDictionary* m_format_opts;
 
+	DurableLatency m_durable; // outlives the completions of m_file
+	DirectFile m_file;
+	uint64_t m_io_pos; // where the muxer writes next
+
 	tbb::concurrent_bounded_queue<AVFrame*> m_frame_queue;
 	tbb::concurrent_bounded_queue<AVPacket*> m_paquet_queue;
 
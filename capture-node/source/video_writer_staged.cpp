@@ -0,0 +1,271 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#include "video_writer_staged.hpp"
+#include "staging_arena.hpp"
+#include "recorder.hpp"
+#include "frame_pool.hpp"
+#include "thread_config.hpp"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+static const int DRAIN_MAX_BUFFERS = 50; // % of the wrapped writer's queue, the drain waits above this
+
+struct StagedFrame
+{
+	unsigned char * data; // in the StagingArena
+	int width;
+	int height;
+	int type;
+	double ts;
+};
+
+class StagingDrain
+{
+	// One staged writer: frames waiting in the arena, and the thread that writes them
+public:
+	StagingDrain(const std::string& name, std::unique_ptr<VideoWriter> writer)
+		: m_name(name), m_writer(std::move(writer)), m_closed(false), m_done(false),
+		m_frames_pending(0), m_bytes_pending(0), m_frames_written(0), m_bytes_written(0), m_busy_seconds(0.0), m_dropped(0)
+	{
+		m_thread = boost::thread([this]() { run(); });
+	}
+
+	~StagingDrain()
+	{
+		close();
+		m_thread.join();
+	}
+
+	bool push(const FrameRef& frame, double ts)
+	{
+		unsigned char * data = StagingArena::Instance().allocate(frame.size());
+		if (!data)
+			return false;
+
+		memcpy(data, frame.data(), frame.size());
+
+		StagedFrame f;
+		f.data = data;
+		f.width = frame.width();
+		f.height = frame.height();
+		f.type = frame.type();
+		f.ts = ts;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_frames.push_back(f);
+			m_frames_pending++;
+			m_bytes_pending += frame.size();
+		}
+		m_cond.notify_one();
+
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+		m_cond.notify_one();
+	}
+
+	int buffers_used(int type) const { return m_writer->buffers_used(type); }
+	int dropped_frames() const { return m_dropped + m_writer->dropped_frames(); }
+
+	const std::string& name() const { return m_name; }
+	bool done() const { return m_done; }
+
+	void add_status(StagingStatus& status) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		status.frames_pending += m_frames_pending;
+		status.bytes_pending += m_bytes_pending;
+		status.frames_written += m_frames_written;
+		if (m_busy_seconds > 0.0)
+			status.write_rate += m_bytes_written / m_busy_seconds;
+	}
+
+private:
+	void run()
+	{
+		ThreadConfig::WorkerThreadScope thread_scope;
+
+		typedef std::chrono::steady_clock clock;
+
+		while (true)
+		{
+			StagedFrame f;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.wait(lock, [this]() { return !m_frames.empty() || m_closed; });
+				if (m_frames.empty())
+					break; // closed, and everything is written
+				f = m_frames.front();
+				m_frames.pop_front();
+			}
+
+			// Only the time spent writing counts for the rate, not the time spent waiting for frames
+			const clock::time_point start = clock::now();
+
+			// Feed the writer at the pace of the drives, it would drop frames if its queue overflows
+			while (m_writer->buffers_used(BUFFER_ENCODING) > DRAIN_MAX_BUFFERS)
+				boost::this_thread::sleep_for(boost::chrono::milliseconds(2));
+
+			FrameRef frame;
+			while ((frame = FramePool::Instance().acquire(f.width, f.height, f.type)).empty())
+				boost::this_thread::sleep_for(boost::chrono::milliseconds(2)); // pool budget, wait for the writer to release frames
+
+			cv::Mat dst = frame.mat(); // we are the only owner until addFrame
+			memcpy(dst.data, f.data, frame.size());
+			StagingArena::Instance().release(f.data);
+
+			if (!m_writer->addFrame(frame, f.ts))
+			{
+				std::cerr << "Staging> " << m_name << ": dropped frame while draining" << std::endl;
+				m_dropped++;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_frames_pending--;
+				m_bytes_pending -= frame.size();
+				m_frames_written++;
+				m_bytes_written += frame.size();
+				m_busy_seconds += std::chrono::duration<double>(clock::now() - start).count();
+			}
+		}
+
+		m_writer->close();
+		m_done = true;
+	}
+
+	std::string m_name;
+	std::unique_ptr<VideoWriter> m_writer;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<StagedFrame> m_frames;
+	bool m_closed;
+	std::atomic<bool> m_done;
+
+	size_t m_frames_pending;
+	size_t m_bytes_pending;
+	size_t m_frames_written;
+	size_t m_bytes_written;
+	double m_busy_seconds;
+	std::atomic<int> m_dropped; // by the wrapped writer while draining
+
+	boost::thread m_thread;
+};
+
+// Drains that are still running, they outlive their StagedVideoWriter
+static std::mutex s_drains_mutex;
+static std::vector<std::shared_ptr<StagingDrain> > s_drains;
+
+static void reap_drains()
+{
+	// Called with s_drains_mutex locked. Joins the threads that are done.
+	s_drains.erase(std::remove_if(s_drains.begin(), s_drains.end(),
+		[](const std::shared_ptr<StagingDrain>& d) { return d->done(); }), s_drains.end());
+}
+
+StagedVideoWriter::StagedVideoWriter(const std::string& name, std::unique_ptr<VideoWriter> writer)
+	: m_drain(std::make_shared<StagingDrain>(name, std::move(writer))), m_closed(false)
+{
+	std::lock_guard<std::mutex> lock(s_drains_mutex);
+	reap_drains();
+	s_drains.push_back(m_drain);
+}
+
+StagedVideoWriter::~StagedVideoWriter()
+{
+	if (!m_closed)
+		close();
+}
+
+bool StagedVideoWriter::addFrame(const FrameRef& frame, double ts)
+{
+	if (!m_drain->push(frame, ts))
+	{
+		std::cerr << "Staging> " << m_drain->name() << ": arena full, dropped frame" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void StagedVideoWriter::close()
+{
+	// The drain keeps running until everything is written
+	m_drain->close();
+	m_closed = true;
+}
+
+int StagedVideoWriter::dropped_frames() const
+{
+	return m_drain->dropped_frames();
+}
+
+int StagedVideoWriter::buffers_used(int type) const
+{
+	// The arena plays the part of the encoding queue, the wrapped writer reports on the writing side
+	const StagingArena& arena = StagingArena::Instance();
+	switch (type) {
+	case BUFFER_ENCODING:
+		return arena.capacity() ? (int)(arena.bytes_in_use() * 100 / arena.capacity()) : 0;
+	case BUFFER_WRITING:
+		return std::max(m_drain->buffers_used(BUFFER_ENCODING), m_drain->buffers_used(BUFFER_WRITING));
+	}
+
+	return 0;
+}
+
+bool StagedVideoWriter::status(const std::string& name, StagingStatus& status)
+{
+	std::lock_guard<std::mutex> lock(s_drains_mutex);
+	reap_drains();
+
+	status = StagingStatus();
+	bool found = false;
+	for (auto& d : s_drains)
+	{
+		if (d->name() == name)
+		{
+			d->add_status(status);
+			found = true;
+		}
+	}
+
+	if (status.write_rate > 0.0)
+		status.eta = status.bytes_pending / status.write_rate;
+	else if (!status.bytes_pending)
+		status.eta = 0.0;
+
+	return found;
+}
+
+size_t StagedVideoWriter::pending_drains()
+{
+	std::lock_guard<std::mutex> lock(s_drains_mutex);
+	reap_drains();
+
+	return s_drains.size();
+}
+
+void StagedVideoWriter::wait_for_drains()
+{
+	while (pending_drains())
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
+}
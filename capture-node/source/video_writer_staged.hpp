@@ -0,0 +1,44 @@
+// Copyright (C) 2019 Electronic Arts Inc.  All rights reserved.
+
+#pragma once
+
+#include "video_writer.hpp"
+
+#include <memory>
+#include <string>
+
+struct StagingStatus
+{
+	StagingStatus() : frames_pending(0), bytes_pending(0), frames_written(0), write_rate(0.0), eta(-1.0) {}
+
+	size_t frames_pending; // staged in memory, not written yet
+	size_t bytes_pending;
+	size_t frames_written;
+	double write_rate; // bytes/s while draining, 0 if unknown
+	double eta; // seconds until everything is written, -1 if unknown
+};
+
+class StagingDrain;
+
+class StagedVideoWriter : public VideoWriter
+{
+	// Records into the StagingArena at memory speed, a background thread drains the frames to the wrapped writer
+	// at the pace of the drives. The drain outlives this object: close() returns right away, the wrapped writer
+	// is closed once every staged frame has been written.
+public:
+	StagedVideoWriter(const std::string& name, std::unique_ptr<VideoWriter> writer);
+	virtual ~StagedVideoWriter();
+
+	virtual bool addFrame(const FrameRef& frame, double ts) override; // returns false when the arena is full
+	virtual void close() override;
+	virtual int buffers_used(int type) const override;
+	virtual int dropped_frames() const override; // so far, the drain may still be writing
+
+	static bool status(const std::string& name, StagingStatus& status); // sums the pending drains of name, false if there are none
+	static size_t pending_drains();
+	static void wait_for_drains(); // blocks until every staged take is on disk
+
+private:
+	std::shared_ptr<StagingDrain> m_drain;
+	bool m_closed;
+};
@@ -1,6 +1,7 @@
 // Copyright (C) 2017 Electronic Arts Inc.  All rights reserved.
 
 #include "ximeacameras.hpp"
+#include "thread_config.hpp"
 
 #ifdef WIN32
 #include "xiApi.h"       // Windows
@@ -11,6 +12,9 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <iterator>
 
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
@@ -45,6 +49,7 @@ AcquisitionGuard::~AcquisitionGuard()
 		if (_t->acq_ctx.recursion == 0)
 		{
 			_t->m_image_counter = 0;
+			_t->m_preroll.clear(); // frames of the previous format and time base
 			xiStartAcquisition(_t->m_deviceHandle);
 		}
 	}
@@ -68,7 +73,13 @@ XimeaCamera::XimeaCamera(int deviceId)
 
 	std::cout << m_model << std::endl;
 
-	m_max_bandwidth = get_param_int(XI_PRM_AVAILABLE_BANDWIDTH); //  On the CM120, this resets the Exposure Time
+	{
+		// Cameras are initialized in parallel, but the bandwidth is measured one camera at a time:
+		// cameras sharing a controller would see each other's traffic
+		static std::mutex s_bandwidth_mutex;
+		std::lock_guard<std::mutex> lock(s_bandwidth_mutex);
+		m_max_bandwidth = get_param_int(XI_PRM_AVAILABLE_BANDWIDTH); //  On the CM120, this resets the Exposure Time
+	}
 	std::cout << "Bandwidth: " << m_max_bandwidth << std::endl;
 
 	set_param_int(XI_PRM_DEBUG_LEVEL, XI_DL_FATAL);
@@ -377,7 +388,9 @@ void XimeaCamera::fill_params_list()
 		m[i] = p;
 	}
 
+	std::lock_guard<std::mutex> lock(m_params_mutex);
 	std::swap(m, m_params);
+	invalidate_params_cache();
 }
 
 void XimeaCamera::param_set(const char * name, float value)
@@ -410,6 +423,8 @@ void XimeaCamera::param_set(const char * name, float value)
 		set_param_float(name, value);
 	}
 
+	std::lock_guard<std::mutex> params_lock(m_params_mutex);
+
 	// Set the value we are currently changing to m_params.
 	// Note that this value may be overwritten below with the xiGetParamFloat
 	m_params[std::string(name)].last_value = value;
@@ -421,6 +436,14 @@ void XimeaCamera::param_set(const char * name, float value)
 	{ 
 		xiGetParamFloat(m_deviceHandle, name, &it->second.last_value);
 	}
+
+	invalidate_params_cache();
+}
+
+bool XimeaCamera::param_is_volatile(const std::string& name) const
+{
+	// Temperatures change on their own, every other parameter only changes when it is written
+	return name == XI_PRM_CHIP_TEMP || name == XI_PRM_HOUS_TEMP || name == XI_PRM_HOUS_BACK_SIDE_TEMP || name == XI_PRM_SENSOR_BOARD_TEMP;
 }
 
 float XimeaCamera::param_get(const char * name)
@@ -464,6 +487,7 @@ void XimeaCamera::get_ximea_cameras(std::vector<std::shared_ptr<Camera> >& new_c
 	xiGetNumberDevices(&device_count);
 
 	// Find newly added cameras
+	std::vector<std::pair<int, std::string> > new_devices;
 	for (unsigned int i = 0; i < device_count; i++)
 	{
 		char buffer[512];
@@ -478,10 +502,46 @@ void XimeaCamera::get_ximea_cameras(std::vector<std::shared_ptr<Camera> >& new_c
 			printf("Detected New Ximea : %s\n", buffer);
 
 			s_unique_id_list.insert(unique_id);
-			new_cameras.push_back(std::make_shared<XimeaCamera>(i));
+			new_devices.push_back(std::make_pair(i, unique_id));
 		}
 	}
 
+	// Opening and configuring a camera takes dozens of round trips to the device, do all the cameras at once
+	// so that start-up and hot-plug recovery do not grow with the number of cameras
+	if (!new_devices.empty())
+	{
+		typedef std::chrono::steady_clock clock;
+		const clock::time_point start = clock::now();
+
+		std::vector<std::shared_ptr<Camera> > opened(new_devices.size());
+		std::atomic<int> ready_count(0);
+		std::mutex print_mutex;
+
+		boost::thread_group threads;
+		for (size_t i = 0; i < new_devices.size(); i++)
+		{
+			threads.create_thread([&, i]() {
+				std::shared_ptr<XimeaCamera> cam = std::make_shared<XimeaCamera>(new_devices[i].first);
+				opened[i] = cam;
+
+				const int n = ++ready_count;
+				const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+				std::lock_guard<std::mutex> lock(print_mutex);
+				if (cam->is_valid())
+					printf("Ximea %s ready in %.2fs (%d/%d)\n", new_devices[i].second.c_str(), seconds, n, (int)new_devices.size());
+				else
+					printf("Ximea %s failed to open after %.2fs (%d/%d)\n", new_devices[i].second.c_str(), seconds, n, (int)new_devices.size());
+			});
+		}
+		threads.join_all();
+
+		// Keep the order of the device indices
+		std::copy(opened.begin(), opened.end(), std::back_inserter(new_cameras));
+
+		printf("Initialized %d Ximea cameras in %.2fs\n", (int)opened.size(), std::chrono::duration<double>(clock::now() - start).count());
+	}
+
 	// Find removed cameras
 	// everything in s_unique_id_list but not in all_ximeas
 	std::copy_if(s_unique_id_list.begin(), s_unique_id_list.end(), std::back_inserter(removed_ids), [&all_ximeas](const std::string& id) {
@@ -543,6 +603,7 @@ void XimeaCamera::set_param_int(const char * param, int value)
 	std::lock_guard<std::recursive_mutex> lock(m_mutex);
 
 	XI_RETURN ret = xiSetParamInt(m_deviceHandle, param, value);
+	invalidate_params_cache(); // setting one parameter can change others
 	if (ret != XI_OK)
 		std::cerr << "XIMEA: Error(" << ret << ") setting parameter " << param << " to " << value  << std::endl;
 }
@@ -557,12 +618,15 @@ void XimeaCamera::set_param_float(const char * param, float value)
 	std::lock_guard<std::recursive_mutex> lock(m_mutex);
 
 	XI_RETURN ret = xiSetParamFloat(m_deviceHandle, param, value);
+	invalidate_params_cache(); // setting one parameter can change others
 	if (ret != XI_OK)
 		std::cerr << "XIMEA: Error(" << ret << ") setting parameter " << param << " to " << value << std::endl;
 }
 
 void XimeaCamera::captureThread()
 {
+	ThreadConfig::CaptureThreadScope thread_scope(m_unique_id); // scheduling policy and CPU affinity on Linux
+
 	while (m_capturing && m_deviceHandle)
 	{
 		if (acq_ctx.isAcquisitionPaused()) // If another thread needs to lock the AcquisitionGuard, make sure 
@@ -655,7 +719,7 @@ void XimeaCamera::start_capture()
 #ifdef WIN32
 		SetThreadPriority(capture_thread.native_handle(), THREAD_PRIORITY_HIGHEST);
 #else
-		#pragma message("TODO Implement Linux")
+		// On Linux the capture thread registers itself with ThreadConfig, which sets its policy and affinity
 #endif
 
 		m_image_counter = 0;
@@ -67,6 +67,7 @@ protected:
 	virtual void fill_params_list();
 	virtual void param_set(const char * name, float value) override;
 	virtual float param_get(const char * name) override;
+	virtual bool param_is_volatile(const std::string& name) const override;
 
 	virtual void start_capture() override;
 	virtual void stop_capture() override;
@@ -195,10 +195,21 @@ export class LiveCapturePage {
   }
 
   getRotation(camera) {
-    if (camera.hasOwnProperty('jpeg_thumbnail_is_histogram') && camera.jpeg_thumbnail_is_histogram)
-      return 0;
-    else
-      return camera.rotation;
+    return camera.rotation;
+  }
+
+  histogramPoints(channel) {
+    // Histogram bins sent by the capture node are scaled from 0 to 255
+    return channel.bins.map((value, i) => i + ',' + (255 - value)).join(' ');
+  }
+
+  histogramColor(channel) {
+    switch (channel.channel) {
+      case 'R': return '#ff4040';
+      case 'G': return '#40ff40';
+      case 'B': return '#4080ff';
+      default: return '#e0e0e0';
+    }
   }
 
   onCameraRotateLeft(camera) {